@@ -0,0 +1,36 @@
+#!/bin/sh
+# Runs the standard load scenarios, each against a freshly started server on port 8080, and appends one
+# JSON line per scenario to results/scenarios.jsonl. SERVER_ARGS is passed through to the server.
+set -e
+cd "$(dirname "$0")"
+
+results=results/scenarios.jsonl
+mkdir -p results
+ulimit -n 65536 2>/dev/null || ulimit -n "$(ulimit -Hn)"
+
+run_scenario() {
+    name=$1
+    shift
+    ../server/bin/server -l warn $SERVER_ARGS > "results/$name.server.log" 2>&1 &
+    server=$!
+    sleep 0.5
+    bin/loadgen -n "$name" -o "$results" "$@" || status=$?
+    kill -INT "$server"
+    wait "$server" || true
+    if [ -n "$status" ]; then
+        echo "Scenario $name failed" >&2
+        exit "$status"
+    fi
+    tail -n 1 "$results"
+}
+
+# Connections that only handshake and sit there: connect rate and handshake latency
+run_scenario idle_swarm -c 2000 -s 0 -t 5
+# One busy room where everyone talks: fan-out latency and throughput
+run_scenario chatty_room -c 200 -s 200 -r 5 -z 128 -R chatty -t 10
+# Everyone arriving at once
+run_scenario join_storm -c 4000 -s 0 -t 2
+# The same storm with deflate asked for in the hello: received_bytes shows what compressing the roster saves
+run_scenario join_storm_deflate -c 4000 -s 0 -t 2 -d
+# A few readers that cannot keep up with a steady stream; they should be evicted without slowing the rest
+run_scenario slow_consumers -c 100 -s 20 -k 10 -r 100 -z 1000 -t 10
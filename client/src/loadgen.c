@@ -0,0 +1,637 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "event.h"
+#include "wire.h"
+
+// Headless load generator: opens many v2 connections over loopback, runs the username handshake, then sends
+// timestamped messages at a fixed rate per sender. Every receiver reads the timestamp back out of what it is
+// relayed, so fan-out latency is measured end to end on one clock. Prints one JSON object of results.
+
+#define INPUT_BYTES (64 * 1024)
+#define MAX_CONNECTING 512       // Connects in flight at once, so a storm does not just overflow the listen backlog
+#define MAX_READY 512
+#define SLOW_READ_BYTES 4096     // A slow consumer reads this much per SLOW_READ_MS
+#define SLOW_READ_MS 100
+#define HANDSHAKE_TIMEOUT_S 30
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_BUCKETS ((40 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+#define PAYLOAD_MARKER ": lg "   // Follows the sender's username in a relayed message
+
+enum connection_phase {
+    PHASE_IDLE = 0,      // Not opened yet
+    PHASE_CONNECTING,
+    PHASE_NAMING,        // Hello and username sent, waiting for the answer
+    PHASE_ACTIVE,
+    PHASE_CLOSED
+};
+
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+} histogram_t;
+
+typedef struct {
+    int fd;
+    enum connection_phase phase;
+    bool sender;
+    bool slow;
+    uint64_t started_ns;
+    uint64_t next_send_ns;
+    size_t batch_remaining; // Bytes left in a batch frame; batches only carry history, which is not timed
+    size_t input_length;
+    unsigned char *input;
+} connection_t;
+
+typedef struct {
+    const char *scenario;
+    const char *host;
+    int port;
+    unsigned int connections;
+    unsigned int senders;
+    unsigned int slow;
+    double rate;            // Messages per second per sender
+    size_t size;            // Content bytes per message, terminator included
+    double connect_rate;    // Connections opened per second, 0 for as fast as possible
+    double duration;        // Seconds of sending once every connection has finished its handshake
+    const char *room;
+    const char *output;
+    bool deflate;           // Ask the server to deflate large frames
+} options_t;
+
+typedef struct {
+    uint64_t established;
+    uint64_t failed;
+    uint64_t closed;        // Closed by the server after the handshake
+    uint64_t sent;
+    uint64_t send_blocked;  // Sends skipped because the socket was full
+    uint64_t throttled;     // Times the server said a sender was over its rate
+    uint64_t received;
+    uint64_t received_bytes;
+    histogram_t handshake;
+    histogram_t latency;
+    histogram_t slow_latency; // Kept apart so the backlog slow consumers build up does not hide everyone else's
+} results_t;
+
+static volatile sig_atomic_t stopping = false;
+
+static void handle_signal(int signal_type)
+{
+    stopping = true;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Log-linear buckets, 8 per power of two, the same layout as the server's stats
+static void histogram_record(histogram_t *histogram, uint64_t value)
+{
+    if(value >= (1ull << 40))
+        value = (1ull << 40) - 1;
+
+    unsigned int index = value;
+    if(value >= (1u << HISTOGRAM_SUB_BITS))
+    {
+        unsigned int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+        index = ((shift + 1) << HISTOGRAM_SUB_BITS) + ((value >> shift) & ((1u << HISTOGRAM_SUB_BITS) - 1));
+    }
+
+    histogram->counts[index]++;
+    histogram->count++;
+    if(value > histogram->max)
+        histogram->max = value;
+}
+
+static uint64_t histogram_quantile(const histogram_t *histogram, double quantile)
+{
+    uint64_t rank = (uint64_t)(quantile * histogram->count + 0.999999);
+    uint64_t seen = 0;
+    for(unsigned int index = 0; index < HISTOGRAM_BUCKETS && histogram->count > 0; index++)
+    {
+        seen += histogram->counts[index];
+        if(seen < rank)
+            continue;
+
+        if(index < (1u << HISTOGRAM_SUB_BITS))
+            return index;
+        unsigned int shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+        uint64_t limit = ((uint64_t)((1u << HISTOGRAM_SUB_BITS) + (index & ((1u << HISTOGRAM_SUB_BITS) - 1))) << shift) + (1ull << shift) - 1;
+        return limit < histogram->max ? limit : histogram->max;
+    }
+    return 0;
+}
+
+static void print_histogram(FILE *output, const char *name, const histogram_t *histogram)
+{
+    fprintf(output, "\"%s\":{\"count\":%" PRIu64 ",\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+        name, histogram->count,
+        histogram_quantile(histogram, 0.5) / 1000.0, histogram_quantile(histogram, 0.9) / 1000.0,
+        histogram_quantile(histogram, 0.99) / 1000.0, histogram_quantile(histogram, 0.999) / 1000.0,
+        histogram->max / 1000.0);
+}
+
+static bool send_frame(connection_t *connection, const options_t *options, enum event_code code, const void *content, size_t content_length)
+{
+    unsigned char frame[WIRE_HELLO_SIZE + WIRE_MAX_HEADER + 2048];
+    size_t length = 0;
+    if(connection->phase == PHASE_CONNECTING)
+        length = wire_put_hello(frame, WIRE_VERSION, options->deflate ? WIRE_FLAG_DEFLATE : 0);
+    if(content_length > sizeof(frame) - length - WIRE_MAX_HEADER)
+        return false;
+
+    length += wire_put_event_header(&frame[length], code, 0, content_length);
+    memcpy(&frame[length], content, content_length);
+    length += content_length;
+
+    // A frame is small enough that a partial write only happens on a socket that is already full
+    ssize_t written = send(connection->fd, frame, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+    return written == (ssize_t)length;
+}
+
+static void close_connection(connection_t *connection, results_t *results)
+{
+    if(connection->phase == PHASE_ACTIVE)
+        results->closed++;
+    else if(connection->phase != PHASE_CLOSED)
+        results->failed++;
+
+    close(connection->fd);
+    connection->fd = -1;
+    connection->phase = PHASE_CLOSED;
+}
+
+static bool in_handshake(const connection_t *connection)
+{
+    return connection->phase == PHASE_CONNECTING || connection->phase == PHASE_NAMING;
+}
+
+static bool open_connection(connection_t *connection, const struct sockaddr_in *address, int epoll_fd, unsigned int index)
+{
+    connection->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(connection->fd < 0)
+        return false;
+
+    int enable = 1;
+    setsockopt(connection->fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    connection->started_ns = now_ns();
+    connection->phase = PHASE_CONNECTING;
+    if(connect(connection->fd, (const struct sockaddr *)address, sizeof(*address)) < 0 && errno != EINPROGRESS)
+        return false;
+
+    struct epoll_event watch = {.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP, .data.u32 = index};
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection->fd, &watch) == 0;
+}
+
+static void handle_event(connection_t *connection, const event_t *header, const unsigned char *content, const options_t *options, results_t *results, int epoll_fd, unsigned int index)
+{
+    uint64_t now = now_ns();
+    switch(header->code)
+    {
+        case EVENT_USERNAME_ACCEPTED:
+            connection->phase = PHASE_ACTIVE;
+            results->established++;
+            histogram_record(&results->handshake, now - connection->started_ns);
+            if(options->room != NULL)
+                send_frame(connection, options, EVENT_ROOM_JOIN, options->room, strlen(options->room) + 1);
+
+            // Spread the first sends over one interval so the senders do not all fire together
+            if(connection->sender && options->rate > 0)
+                connection->next_send_ns = now + (uint64_t)(1e9 / options->rate * (rand() / (RAND_MAX + 1.0)));
+
+            if(connection->slow)
+            {
+                struct epoll_event watch = {.events = 0, .data.u32 = index};
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &watch);
+            }
+            break;
+
+        case EVENT_USERNAME_REJECTED:
+            close_connection(connection, results);
+            break;
+
+        case EVENT_PING:
+            send_frame(connection, options, EVENT_PONG, NULL, 0);
+            break;
+
+        case EVENT_THROTTLED:
+            results->throttled++;
+            break;
+
+        case EVENT_MESSAGE:
+        {
+            results->received++;
+            if(connection->batch_remaining > 0 || connection->phase != PHASE_ACTIVE)
+                break;
+
+            const unsigned char *marker = memmem(content, header->content_length, PAYLOAD_MARKER, strlen(PAYLOAD_MARKER));
+            if(marker == NULL)
+                break;
+            uint64_t sent_ns = strtoull((const char *)marker + strlen(PAYLOAD_MARKER), NULL, 16);
+            if(sent_ns != 0 && sent_ns <= now)
+                histogram_record(connection->slow ? &results->slow_latency : &results->latency, now - sent_ns);
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+static bool parse_frames(connection_t *connection, const unsigned char *input, size_t length, size_t *consumed,
+    const options_t *options, results_t *results, int epoll_fd, unsigned int index);
+
+// Inflates a whole deflate frame's content and handles the frames in it, which are always whole
+static bool parse_deflated(connection_t *connection, const unsigned char *content, size_t content_length,
+    const options_t *options, results_t *results, int epoll_fd, unsigned int index)
+{
+    uint64_t inflated_length;
+    int varint_size = wire_get_varint(content, content_length, &inflated_length);
+    if(varint_size <= 0 || inflated_length == 0 || inflated_length > WIRE_MAX_INFLATED)
+        return false;
+
+    unsigned char *inflated = malloc(inflated_length);
+    if(inflated == NULL)
+        return false;
+
+    uLongf length = inflated_length;
+    size_t consumed = 0;
+    bool valid = uncompress(inflated, &length, &content[varint_size], content_length - varint_size) == Z_OK
+        && length == inflated_length
+        && parse_frames(connection, inflated, length, &consumed, options, results, epoll_fd, index)
+        && consumed == length;
+    free(inflated);
+    return valid;
+}
+
+// Handles every whole frame in the input, setting consumed to where a partial one starts
+static bool parse_frames(connection_t *connection, const unsigned char *input, size_t length, size_t *consumed,
+    const options_t *options, results_t *results, int epoll_fd, unsigned int index)
+{
+    size_t offset = 0;
+    while(offset < length && connection->phase != PHASE_CLOSED)
+    {
+        const unsigned char *frame = &input[offset];
+        size_t available = length - offset;
+        if(frame[0] == WIRE_MAGIC)
+        {
+            if(available < WIRE_HELLO_SIZE)
+                break;
+            offset += WIRE_HELLO_SIZE;
+            continue;
+        }
+
+        event_t header;
+        size_t header_size;
+        enum wire_header type = wire_get_header(frame, available, &header, &header_size);
+        if(type == WIRE_MALFORMED)
+            return false;
+        if(type == WIRE_INCOMPLETE)
+            break;
+
+        if(type == WIRE_HEADER_BATCH)
+        {
+            connection->batch_remaining = header.content_length;
+            offset += header_size;
+            continue;
+        }
+
+        size_t frame_size = header_size + header.content_length;
+        if(frame_size > INPUT_BYTES)
+            return false;
+        if(frame_size > available)
+            break;
+
+        if(type == WIRE_HEADER_DEFLATE)
+        {
+            if(!parse_deflated(connection, &frame[header_size], header.content_length, options, results, epoll_fd, index))
+                return false;
+        }
+        else
+        {
+            handle_event(connection, &header, &frame[header_size], options, results, epoll_fd, index);
+            connection->batch_remaining -= connection->batch_remaining < frame_size ? connection->batch_remaining : frame_size;
+        }
+        offset += frame_size;
+    }
+
+    *consumed = offset;
+    return true;
+}
+
+// Consumes every whole frame in the connection's input, keeping a partial one for the next read
+static bool parse_input(connection_t *connection, const options_t *options, results_t *results, int epoll_fd, unsigned int index)
+{
+    size_t offset = 0;
+    if(!parse_frames(connection, connection->input, connection->input_length, &offset, options, results, epoll_fd, index))
+        return false;
+
+    memmove(connection->input, &connection->input[offset], connection->input_length - offset);
+    connection->input_length -= offset;
+    return true;
+}
+
+// Reads up to limit bytes; false once the connection has been closed
+static bool read_input(connection_t *connection, size_t limit, const options_t *options, results_t *results, int epoll_fd, unsigned int index)
+{
+    size_t total = 0;
+    while(total < limit && connection->phase != PHASE_CLOSED)
+    {
+        size_t space = INPUT_BYTES - connection->input_length;
+        if(space > limit - total)
+            space = limit - total;
+
+        ssize_t read_result = read(connection->fd, &connection->input[connection->input_length], space);
+        if(read_result < 0 && errno == EINTR)
+            continue;
+        if(read_result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        if(read_result <= 0)
+            return false;
+
+        total += read_result;
+        results->received_bytes += read_result;
+        connection->input_length += read_result;
+        if(!parse_input(connection, options, results, epoll_fd, index))
+            return false;
+    }
+    return true;
+}
+
+static void send_messages(connection_t *connections, const options_t *options, results_t *results, unsigned char *payload)
+{
+    uint64_t interval = (uint64_t)(1e9 / options->rate);
+    for(unsigned int i = 0; i < options->connections; i++)
+    {
+        connection_t *connection = &connections[i];
+        uint64_t now = now_ns();
+        if(!connection->sender || connection->phase != PHASE_ACTIVE || connection->next_send_ns > now)
+            continue;
+
+        // The timestamp is written over the start of the padding; hex keeps it a fixed width
+        int prefix_length = snprintf((char *)payload, options->size, "lg %016" PRIx64 " ", now);
+        payload[prefix_length] = 'x';
+        if(send_frame(connection, options, EVENT_MESSAGE, payload, options->size))
+            results->sent++;
+        else
+            results->send_blocked++;
+
+        // Catch up at most one interval; a sender that fell further behind just drops the backlog
+        connection->next_send_ns += interval;
+        if(connection->next_send_ns < now)
+            connection->next_send_ns = now + interval;
+    }
+}
+
+static void print_results(const options_t *options, const results_t *results, double connect_seconds, double run_seconds)
+{
+    FILE *output = stdout;
+    if(options->output != NULL)
+        output = fopen(options->output, "a");
+    if(output == NULL)
+    {
+        fprintf(stderr, "Unable to open %s;\n\t%s\n", options->output, strerror(errno));
+        output = stdout;
+    }
+
+    fprintf(output, "{\"scenario\":\"%s\",\"deflate\":%s,\"connections\":%u,\"senders\":%u,\"slow\":%u,\"rate\":%.2f,\"size\":%zu,"
+        "\"established\":%" PRIu64 ",\"failed\":%" PRIu64 ",\"closed\":%" PRIu64 ","
+        "\"connect_seconds\":%.3f,\"connect_rate\":%.1f,\"run_seconds\":%.3f,"
+        "\"sent\":%" PRIu64 ",\"send_blocked\":%" PRIu64 ",\"throttled\":%" PRIu64 ",\"received\":%" PRIu64 ",\"received_bytes\":%" PRIu64 ","
+        "\"send_rate\":%.1f,\"receive_rate\":%.1f,",
+        options->scenario, options->deflate ? "true" : "false", options->connections, options->senders, options->slow, options->rate, options->size,
+        results->established, results->failed, results->closed,
+        connect_seconds, connect_seconds > 0 ? results->established / connect_seconds : 0.0, run_seconds,
+        results->sent, results->send_blocked, results->throttled, results->received, results->received_bytes,
+        run_seconds > 0 ? results->sent / run_seconds : 0.0, run_seconds > 0 ? results->received / run_seconds : 0.0);
+    print_histogram(output, "handshake_us", &results->handshake);
+    fputc(',', output);
+    print_histogram(output, "latency_us", &results->latency);
+    fputc(',', output);
+    print_histogram(output, "slow_latency_us", &results->slow_latency);
+    fprintf(output, "}\n");
+
+    if(output != stdout)
+        fclose(output);
+}
+
+static void print_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-n scenario] [-a address] [-p port] [-c connections] [-s senders] [-k slow_consumers]\n"
+        "\t[-r messages_per_second] [-z message_bytes] [-C connects_per_second] [-t seconds] [-R room] [-o results_file] [-d]\n", program);
+}
+
+int main(int argc, char *argv[])
+{
+    options_t options = {
+        .scenario = "custom",
+        .host = "127.0.0.1",
+        .port = 8080,
+        .connections = 100,
+        .senders = 10,
+        .slow = 0,
+        .rate = 1,
+        .size = 64,
+        .connect_rate = 0,
+        .duration = 10,
+        .room = NULL,
+        .output = NULL,
+        .deflate = false
+    };
+
+    int option;
+    while((option = getopt(argc, argv, "n:a:p:c:s:k:r:z:C:t:R:o:d")) != -1)
+    {
+        switch(option)
+        {
+            case 'n': options.scenario = optarg; break;
+            case 'a': options.host = optarg; break;
+            case 'p': options.port = atoi(optarg); break;
+            case 'c': options.connections = strtoul(optarg, NULL, 10); break;
+            case 's': options.senders = strtoul(optarg, NULL, 10); break;
+            case 'k': options.slow = strtoul(optarg, NULL, 10); break;
+            case 'r': options.rate = strtod(optarg, NULL); break;
+            case 'z': options.size = strtoul(optarg, NULL, 10); break;
+            case 'C': options.connect_rate = strtod(optarg, NULL); break;
+            case 't': options.duration = strtod(optarg, NULL); break;
+            case 'R': options.room = optarg; break;
+            case 'o': options.output = optarg; break;
+            case 'd': options.deflate = true; break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if(options.connections == 0 || options.senders + options.slow > options.connections
+        || options.size < 24 || options.size > 1024 || options.rate <= 0)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    struct sigaction signal_action = {.sa_handler = &handle_signal, .sa_flags = 0};
+    sigemptyset(&signal_action.sa_mask);
+    sigaction(SIGINT, &signal_action, NULL);
+    sigaction(SIGTERM, &signal_action, NULL);
+
+    // Thousands of sockets need more than the usual soft limit of descriptors
+    struct rlimit files;
+    if(getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < options.connections + 64)
+    {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(options.port)};
+    if(inet_pton(AF_INET, options.host, &address.sin_addr) <= 0)
+    {
+        fprintf(stderr, "Unable to use address %s\n", options.host);
+        return 1;
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    connection_t *connections = calloc(options.connections, sizeof(connection_t));
+    results_t *results = calloc(1, sizeof(results_t));
+    unsigned char *payload = malloc(options.size);
+    if(epoll_fd < 0 || connections == NULL || results == NULL || payload == NULL)
+    {
+        fprintf(stderr, "Unable to set up;\n\t%s\n", strerror(errno));
+        return 1;
+    }
+    memset(payload, 'x', options.size);
+    payload[options.size - 1] = '\0';
+    srand(getpid());
+
+    // Senders come first, then slow consumers, then plain listeners
+    for(unsigned int i = 0; i < options.connections; i++)
+    {
+        connections[i].fd = -1;
+        connections[i].sender = i < options.senders;
+        connections[i].slow = i >= options.senders && i < options.senders + options.slow;
+        connections[i].input = malloc(INPUT_BYTES);
+        if(connections[i].input == NULL)
+        {
+            fprintf(stderr, "Unable to allocate connection buffers\n");
+            return 1;
+        }
+    }
+
+    struct epoll_event ready[MAX_READY];
+    uint64_t start = now_ns();
+    uint64_t connected_at = 0;
+    uint64_t run_until = 0;
+    uint64_t next_slow_read = start;
+    unsigned int opened = 0;
+    unsigned int connecting = 0;
+    while(!stopping)
+    {
+        uint64_t now = now_ns();
+
+        // Open more connections, at the requested rate if there is one
+        uint64_t allowed = options.connect_rate > 0 ? (uint64_t)((now - start) / 1e9 * options.connect_rate) + 1 : options.connections;
+        while(opened < options.connections && opened < allowed && connecting < MAX_CONNECTING)
+        {
+            if(open_connection(&connections[opened], &address, epoll_fd, opened))
+                connecting++;
+            else
+                close_connection(&connections[opened], results);
+            opened++;
+        }
+
+        if(run_until == 0 && opened == options.connections
+            && (connecting == 0 || now - start > (uint64_t)HANDSHAKE_TIMEOUT_S * 1000000000))
+        {
+            connected_at = now;
+            run_until = now + (uint64_t)(options.duration * 1e9);
+        }
+        if(run_until != 0 && now >= run_until)
+            break;
+
+        int ready_count = epoll_wait(epoll_fd, ready, MAX_READY, 1);
+        for(int i = 0; i < ready_count; i++)
+        {
+            unsigned int index = ready[i].data.u32;
+            connection_t *connection = &connections[index];
+            if(connection->phase == PHASE_CLOSED)
+                continue;
+
+            bool was_in_handshake = in_handshake(connection);
+            if(connection->phase == PHASE_CONNECTING && (ready[i].events & EPOLLOUT))
+            {
+                char username[32];
+                snprintf(username, sizeof(username), "lg%d-%u", getpid() % 100000, index);
+                if(send_frame(connection, &options, EVENT_USERNAME_SUBMIT, username, strlen(username) + 1))
+                {
+                    connection->phase = PHASE_NAMING;
+                    struct epoll_event watch = {.events = EPOLLIN | EPOLLRDHUP, .data.u32 = index};
+                    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &watch);
+                }
+                else
+                {
+                    close_connection(connection, results);
+                }
+            }
+
+            if(connection->phase != PHASE_CLOSED && (ready[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                && !read_input(connection, SIZE_MAX, &options, results, epoll_fd, index))
+                close_connection(connection, results);
+
+            if(was_in_handshake && !in_handshake(connection))
+                connecting--;
+        }
+
+        if(run_until != 0)
+            send_messages(connections, &options, results, payload);
+
+        // Slow consumers trickle their input in on a timer instead of reading when it is ready
+        if(now >= next_slow_read)
+        {
+            for(unsigned int i = options.senders; i < options.senders + options.slow; i++)
+            {
+                if(connections[i].phase == PHASE_ACTIVE && !read_input(&connections[i], SLOW_READ_BYTES, &options, results, epoll_fd, i))
+                    close_connection(&connections[i], results);
+            }
+            next_slow_read = now + SLOW_READ_MS * 1000000ull;
+        }
+    }
+
+    uint64_t end = now_ns();
+    if(connected_at == 0)
+        connected_at = end;
+    print_results(&options, results, (connected_at - start) / 1e9, (end - connected_at) / 1e9);
+
+    for(unsigned int i = 0; i < options.connections; i++)
+    {
+        if(connections[i].fd >= 0)
+            close(connections[i].fd);
+        free(connections[i].input);
+    }
+    free(connections);
+    free(results);
+    free(payload);
+    close(epoll_fd);
+    return 0;
+}
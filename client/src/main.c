@@ -1,228 +1,622 @@
-#include <arpa/inet.h>
-#include <assert.h>
-#include <ctype.h>
-#include <errno.h>
-#include <ncurses.h>
-#include <netinet/in.h>
-#include <poll.h>
-#include <stdbool.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <unistd.h>
-
-#include "event.h"
-
-#define BUFFER_SIZE 129
-typedef struct {
-    char buffer[BUFFER_SIZE];
-    unsigned int position;
-    bool done;
-} input_buffer_t;
-
-void print_event_to_window(event_t *event, WINDOW *window)
-{
-    wprintw(window, "===========================\n");
-    wprintw(window, "Event code: %02X\n", event->code);
-    wprintw(window, "Originator id: %02X\n", event->originator_id);
-    wprintw(window, "Content length: %08lX\n", event->content_length);
-    wprintw(window, "Content: ");
-
-    for(size_t i = 0; i < event->content_length; i++)
-        wprintw(window, "%02X | ", event->content[i]);
-    wprintw(window, "\n===========================\n");
-}
-
-int main(int argc, const char **argv)
-{
-    bool username_sent = false;
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if(server_fd < 0)
-    {
-        fprintf(stderr, "Unable to create socket;\n\t%s\n", strerror(errno));
-        return 1;
-    }
-
-    struct sockaddr_in server_address;
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(8080);
-    memset(server_address.sin_zero, 0, sizeof(server_address.sin_zero));
-
-    if(inet_pton(AF_INET, "127.0.0.1", &server_address.sin_addr) <= 0)
-    {
-        fprintf(stderr, "Unable to use address;\n\t%s\n", strerror(errno));
-        return 1;
-    }
-
-    if(connect(server_fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
-    {
-        fprintf(stderr, "Unable to connect to server;\n\t%s\n", strerror(errno));
-        return 1;
-    }
-
-    struct pollfd server_connection = {.fd = server_fd, .events = POLLIN | POLLOUT, .revents = 0};
-
-
-    initscr();
-    start_color();
-    init_color(8, 650, 650, 650);
-    init_pair(1, 8, COLOR_BLACK);
-    raw();
-    noecho();
-    keypad(stdscr, TRUE);
-    nl();
-
-    int max_x, max_y;
-    getmaxyx(stdscr, max_y, max_x);
-
-    WINDOW *history_window = newwin(max_y - 2, 0, 0, 0);
-    scrollok(history_window, true);
-    WINDOW *input_window = newwin(1, 0, max_y - 2, 0);
-    nodelay(input_window, true);
-
-    input_buffer_t input_buffer;
-    memset(input_buffer.buffer, 0, sizeof(input_buffer.buffer));
-    input_buffer.position = 0;
-    input_buffer.done = false;
-
-    bool exit = false;
-
-    while(!exit)
-    {
-        poll(&server_connection, 1, 0);
-
-        if(server_connection.revents & POLLIN)
-        {
-            event_t *incoming_event = malloc(sizeof(event_t));
-            if(incoming_event == NULL)
-                continue;
-            read(server_connection.fd, incoming_event, sizeof(event_t));
-
-            incoming_event = realloc(incoming_event, sizeof(event_t) + incoming_event->content_length);
-            if(incoming_event == NULL)
-                continue;
-            read(server_connection.fd, incoming_event->content, incoming_event->content_length);
-
-            if(incoming_event->content[0] == '\0')
-            {
-                printf("Lost connection to server\n");
-                exit = true;
-                free(incoming_event);
-                continue;
-                // break out of the loop; might work with POLLHUP;
-                wprintw(history_window, "# Lost connection to server\n");
-            }
-            
-            // print_event_to_window(incoming_event, history_window);
-            switch(incoming_event->code)
-            {
-                case EVENT_MESSAGE:
-                    wprintw(history_window, "%s\n", incoming_event->content);
-                    break;
-
-                case EVENT_USERNAME_REQUEST:
-                case EVENT_USERNAME_ACCEPTED:
-                    wattr_on(history_window, A_ITALIC, NULL);
-                    wcolor_set(history_window, 1, NULL);
-                    wprintw(history_window, "# %s\n", incoming_event->content);
-                    wattr_off(history_window, A_ITALIC, NULL);
-                    wcolor_set(history_window, 0, NULL);
-                    break;
-                
-                case EVENT_USER_JOIN:
-                    wattr_on(history_window, A_ITALIC, NULL);
-                    wcolor_set(history_window, 1, NULL);
-                    wprintw(history_window, "# %s joined\n", incoming_event->content);
-                    wattr_off(history_window, A_ITALIC, NULL);
-                    wcolor_set(history_window, 0, NULL);
-                    break;
-
-                case EVENT_USER_LEAVE:
-                    wattr_on(history_window, A_ITALIC, NULL);
-                    wcolor_set(history_window, 1, NULL);
-                    wprintw(history_window, "# %s left\n", incoming_event->content);
-                    wattr_off(history_window, A_ITALIC, NULL);
-                    wcolor_set(history_window, 0, NULL);
-                    break;
-                
-                default:
-                    break;
-            }
-            wrefresh(history_window);
-            free(incoming_event);
-        }
-
-        if(server_connection.revents & POLLOUT && input_buffer.done)
-        {
-            size_t message_event_size = sizeof(event_t) + input_buffer.position + 1;
-            event_t *message_event = malloc(message_event_size);
-            assert(message_event != NULL);
-
-            message_event->code = username_sent ? EVENT_MESSAGE : EVENT_USERNAME_SUBMIT;
-            message_event->originator_id = 0;
-            message_event->content_length = input_buffer.position + 1;
-            memcpy(message_event->content, input_buffer.buffer, message_event->content_length);
-            send(server_connection.fd, message_event, message_event_size, 0);
-            username_sent = true;
-            free(message_event);
-
-            memset(input_buffer.buffer, 0, sizeof(input_buffer.buffer));
-            input_buffer.position = 0;
-            input_buffer.done = false;
-
-            wclear(input_window);
-            wrefresh(input_window);
-        }
-
-        int input = wgetch(input_window);
-        if(isprint(input) || isspace(input))
-        {
-            if(input != '\n' && input_buffer.position < BUFFER_SIZE - 1 && !input_buffer.done)
-            {
-                input_buffer.buffer[input_buffer.position++] = input;
-                wprintw(input_window, "%c", input);
-                wrefresh(input_window);
-            }
-            else if(input_buffer.position > 0)
-            {
-                input_buffer.done = true;
-                wprintw(history_window, "> %s\n", input_buffer.buffer);
-                wrefresh(history_window);
-            }
-        }
-        else
-        {
-            switch(input)
-            {
-                // TODO add command keys here
-                case 127:
-                case KEY_BACKSPACE:
-                    if(input_buffer.position > 0)
-                    {
-                        input_buffer.buffer[input_buffer.position--] = '\0';
-                        wprintw(input_window, "\b \b");
-                        wrefresh(input_window);
-                    }
-                    break;
-                    
-                case ('c' & 0x1f): // ^c
-                    exit = true;
-                    break;
-
-                case ERR:
-                default:
-                    break;
-            };
-        }
-    }
-
-    event_t leave_event = { .code = EVENT_USER_LEAVE, .originator_id = 0, .content_length = 0 };
-    send(server_fd, &leave_event, sizeof(leave_event), 0);
-
-    shutdown(server_fd, SHUT_RDWR);
-    close(server_fd);
-    endwin();
-    return 0;
-};
\ No newline at end of file
+#include <arpa/inet.h>
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <ncurses.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "event.h"
+#include "wire.h"
+
+#define BUFFER_SIZE 129
+typedef struct {
+    char buffer[BUFFER_SIZE];
+    unsigned int position;
+} input_buffer_t;
+
+#define SCROLLBACK_LINES 10000          // Oldest lines are dropped past either limit
+#define SCROLLBACK_BYTES (1 << 20)
+#define FRAME_INTERVAL_MS 33            // The history is drawn at most this often
+
+enum line_style {
+    STYLE_PLAIN = 0,
+    STYLE_NOTICE
+};
+
+typedef struct {
+    uint32_t offset;                    // Into the arena
+    uint32_t length;
+    enum line_style style;
+} line_t;
+
+// Every line ever shown, up to the limits, kept back to back in one arena so the history can be redrawn at
+// any scroll position and at any width. When either limit is hit the oldest quarter goes in one move.
+typedef struct {
+    char *text;
+    size_t text_length;
+    line_t *lines;
+    size_t line_count;
+    size_t scroll;                      // Lines the view is lifted off the bottom; 0 follows new lines
+    bool dirty;
+} scrollback_t;
+
+static bool scrollback_init(scrollback_t *scrollback)
+{
+    memset(scrollback, 0, sizeof(*scrollback));
+    scrollback->text = malloc(SCROLLBACK_BYTES);
+    scrollback->lines = malloc(SCROLLBACK_LINES * sizeof(line_t));
+    return scrollback->text != NULL && scrollback->lines != NULL;
+}
+
+static void scrollback_free(scrollback_t *scrollback)
+{
+    free(scrollback->text);
+    free(scrollback->lines);
+}
+
+static void scrollback_drop_oldest(scrollback_t *scrollback)
+{
+    size_t dropped = scrollback->line_count / 4 + 1;
+    if(dropped > scrollback->line_count)
+        dropped = scrollback->line_count;
+
+    size_t text_start = dropped < scrollback->line_count ? scrollback->lines[dropped].offset : scrollback->text_length;
+    memmove(scrollback->text, &scrollback->text[text_start], scrollback->text_length - text_start);
+    scrollback->text_length -= text_start;
+
+    scrollback->line_count -= dropped;
+    memmove(scrollback->lines, &scrollback->lines[dropped], scrollback->line_count * sizeof(line_t));
+    for(size_t i = 0; i < scrollback->line_count; i++)
+        scrollback->lines[i].offset -= text_start;
+
+    if(scrollback->scroll >= scrollback->line_count)
+        scrollback->scroll = scrollback->line_count > 0 ? scrollback->line_count - 1 : 0;
+}
+
+static void scrollback_add(scrollback_t *scrollback, enum line_style style, const char *format, ...)
+{
+    va_list arguments;
+    va_start(arguments, format);
+    int formatted = vsnprintf(NULL, 0, format, arguments);
+    va_end(arguments);
+    if(formatted < 0)
+        return;
+
+    size_t length = (size_t)formatted < SCROLLBACK_BYTES / 4 ? (size_t)formatted : SCROLLBACK_BYTES / 4;
+    while(scrollback->line_count == SCROLLBACK_LINES || SCROLLBACK_BYTES - scrollback->text_length < length + 1)
+        scrollback_drop_oldest(scrollback);
+
+    char *line = &scrollback->text[scrollback->text_length];
+    va_start(arguments, format);
+    vsnprintf(line, length + 1, format, arguments);
+    va_end(arguments);
+
+    // Control characters would move the cursor about; they are shown as spaces
+    for(size_t i = 0; i < length; i++)
+    {
+        if((unsigned char)line[i] < ' ' || line[i] == 127)
+            line[i] = ' ';
+    }
+
+    scrollback->lines[scrollback->line_count++] = (line_t){.offset = scrollback->text_length, .length = length, .style = style};
+    scrollback->text_length += length;
+
+    // A lifted view stays on the lines it was showing
+    if(scrollback->scroll > 0)
+        scrollback->scroll++;
+    scrollback->dirty = true;
+}
+
+static void scrollback_scroll(scrollback_t *scrollback, long lines)
+{
+    long scroll = (long)scrollback->scroll + lines;
+    long limit = scrollback->line_count > 0 ? (long)scrollback->line_count - 1 : 0;
+    scrollback->scroll = scroll < 0 ? 0 : scroll > limit ? limit : scroll;
+    scrollback->dirty = true;
+}
+
+static int rows_for(const line_t *line, int width)
+{
+    return line->length == 0 ? 1 : (int)((line->length + width - 1) / width);
+}
+
+// Draws the lines ending at the scroll position, wrapped at the window width, bottom-aligned
+static void scrollback_render(scrollback_t *scrollback, WINDOW *history_window, WINDOW *status_window)
+{
+    int height, width;
+    getmaxyx(history_window, height, width);
+    werase(history_window);
+
+    size_t end = scrollback->line_count - scrollback->scroll;
+    size_t first = end;
+    int rows = 0;
+    while(first > 0 && rows + rows_for(&scrollback->lines[first - 1], width) <= height)
+        rows += rows_for(&scrollback->lines[--first], width);
+
+    int row = height - rows;
+    for(size_t i = first; i < end; i++)
+    {
+        const line_t *line = &scrollback->lines[i];
+        if(line->style == STYLE_NOTICE)
+        {
+            wattr_on(history_window, A_ITALIC, NULL);
+            wcolor_set(history_window, 1, NULL);
+        }
+        uint32_t done = 0;
+        do
+        {
+            uint32_t left = line->length - done;
+            int count = left < (uint32_t)width ? (int)left : width;
+            mvwaddnstr(history_window, row++, 0, &scrollback->text[line->offset + done], count);
+            done += count;
+        } while(done < line->length);
+        wattr_off(history_window, A_ITALIC, NULL);
+        wcolor_set(history_window, 0, NULL);
+    }
+
+    werase(status_window);
+    if(scrollback->scroll > 0)
+        wprintw(status_window, "-- %zu more below; PageDown to follow --", scrollback->scroll);
+
+    wnoutrefresh(history_window);
+    wnoutrefresh(status_window);
+    scrollback->dirty = false;
+}
+
+static long now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void print_event_to_window(event_t *event, WINDOW *window)
+{
+    wprintw(window, "===========================\n");
+    wprintw(window, "Event code: %02X\n", event->code);
+    wprintw(window, "Originator id: %02X\n", event->originator_id);
+    wprintw(window, "Content length: %08lX\n", event->content_length);
+    wprintw(window, "Content: ");
+
+    for(size_t i = 0; i < event->content_length; i++)
+        wprintw(window, "%02X | ", event->content[i]);
+    wprintw(window, "\n===========================\n");
+}
+
+#define RECEIVE_SIZE 65536     // Read from the socket at a time
+#define MAX_READS_PER_WAKE 16  // So a flood of events cannot keep the keyboard from being read
+
+// Buffers whatever the socket has and hands out whole events, so a frame split across reads is simply
+// finished on a later one; nothing ever blocks waiting for the rest of a frame
+typedef struct {
+    unsigned char *buffer;
+    size_t start;              // First byte not yet handled
+    size_t length;             // Bytes in the buffer
+    size_t capacity;
+    event_t *event;            // The last event handed out, reused for the next
+    size_t event_capacity;
+} frame_reader_t;
+
+enum frame_result {
+    FRAME_NEED_MORE = 0,
+    FRAME_EVENT,
+    FRAME_MALFORMED
+};
+
+enum fill_result {
+    FILL_READ = 0,
+    FILL_EMPTY,                // Nothing more to read for now
+    FILL_CLOSED                // The connection is gone
+};
+
+// Reads once without blocking, making room for a whole read first
+static enum fill_result frame_reader_fill(frame_reader_t *reader, int fd)
+{
+    if(reader->start > 0)
+    {
+        memmove(reader->buffer, &reader->buffer[reader->start], reader->length - reader->start);
+        reader->length -= reader->start;
+        reader->start = 0;
+    }
+
+    if(reader->capacity - reader->length < RECEIVE_SIZE)
+    {
+        unsigned char *buffer = realloc(reader->buffer, reader->length + RECEIVE_SIZE);
+        if(buffer == NULL)
+            return FILL_CLOSED;
+        reader->buffer = buffer;
+        reader->capacity = reader->length + RECEIVE_SIZE;
+    }
+
+    ssize_t read_result = recv(fd, &reader->buffer[reader->length], reader->capacity - reader->length, MSG_DONTWAIT);
+    if(read_result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return FILL_EMPTY;
+    if(read_result <= 0)
+        return FILL_CLOSED;
+
+    reader->length += read_result;
+    return FILL_READ;
+}
+
+// Swaps a whole deflate frame at reader->start for the frames it holds, so they are read like any others
+static bool frame_reader_inflate(frame_reader_t *reader, size_t header_size, size_t content_length)
+{
+    const unsigned char *content = &reader->buffer[reader->start + header_size];
+    uint64_t inflated_length;
+    int varint_size = wire_get_varint(content, content_length, &inflated_length);
+    if(varint_size <= 0 || inflated_length == 0 || inflated_length > WIRE_MAX_INFLATED)
+        return false;
+
+    size_t rest_start = reader->start + header_size + content_length;
+    size_t rest = reader->length - rest_start;
+    unsigned char *buffer = malloc(inflated_length + rest + RECEIVE_SIZE);
+    if(buffer == NULL)
+        return false;
+
+    uLongf length = inflated_length;
+    if(uncompress(buffer, &length, &content[varint_size], content_length - varint_size) != Z_OK
+        || length != inflated_length)
+    {
+        free(buffer);
+        return false;
+    }
+
+    memcpy(&buffer[inflated_length], &reader->buffer[rest_start], rest);
+    free(reader->buffer);
+    reader->buffer = buffer;
+    reader->start = 0;
+    reader->length = inflated_length + rest;
+    reader->capacity = reader->length + RECEIVE_SIZE;
+    return true;
+}
+
+// Takes the next whole v2 event out of the buffer into reader->event; hellos, batch wrappers and deflate
+// frames are stepped over so the events they carry come out one by one
+static enum frame_result frame_reader_next(frame_reader_t *reader)
+{
+    while(reader->start < reader->length)
+    {
+        const unsigned char *frame = &reader->buffer[reader->start];
+        size_t available = reader->length - reader->start;
+        if(frame[0] == WIRE_MAGIC)
+        {
+            if(available < WIRE_HELLO_SIZE)
+                return FRAME_NEED_MORE;
+            reader->start += WIRE_HELLO_SIZE;
+            continue;
+        }
+
+        event_t header;
+        size_t header_size;
+        switch(wire_get_header(frame, available, &header, &header_size))
+        {
+            case WIRE_INCOMPLETE:
+                return FRAME_NEED_MORE;
+
+            case WIRE_MALFORMED:
+                return FRAME_MALFORMED;
+
+            case WIRE_HEADER_BATCH:
+                reader->start += header_size;
+                continue;
+
+            case WIRE_HEADER_DEFLATE:
+                if(available - header_size < header.content_length)
+                    return FRAME_NEED_MORE;
+                if(!frame_reader_inflate(reader, header_size, header.content_length))
+                    return FRAME_MALFORMED;
+                continue;
+
+            case WIRE_HEADER_EVENT:
+                break;
+        }
+
+        if(available - header_size < header.content_length)
+            return FRAME_NEED_MORE;
+
+        if(reader->event_capacity < header.content_length + 1)
+        {
+            event_t *event = realloc(reader->event, sizeof(event_t) + header.content_length + 1);
+            if(event == NULL)
+                return FRAME_MALFORMED;
+            reader->event = event;
+            reader->event_capacity = header.content_length + 1;
+        }
+
+        *reader->event = header;
+        memcpy(reader->event->content, &frame[header_size], header.content_length);
+        reader->event->content[header.content_length] = '\0';
+        reader->start += header_size + header.content_length;
+        return FRAME_EVENT;
+    }
+    return FRAME_NEED_MORE;
+}
+
+static void frame_reader_free(frame_reader_t *reader)
+{
+    free(reader->buffer);
+    free(reader->event);
+}
+
+static void send_event(int fd, enum event_code code, const void *content, size_t content_length)
+{
+    unsigned char *frame = malloc(WIRE_MAX_HEADER + content_length);
+    assert(frame != NULL);
+
+    size_t header_size = wire_put_event_header(frame, code, 0, content_length);
+    if(content_length > 0)
+        memcpy(&frame[header_size], content, content_length);
+    send(fd, frame, header_size + content_length, 0);
+    free(frame);
+}
+
+// Only adds to the scrollback; it is drawn at most once a frame however many events arrive
+static void show_event(const event_t *event, scrollback_t *scrollback, int server_fd, bool *username_sent)
+{
+    switch(event->code)
+    {
+        case EVENT_MESSAGE:
+            scrollback_add(scrollback, STYLE_PLAIN, "%s", event->content);
+            break;
+
+        case EVENT_USERNAME_REJECTED:
+            *username_sent = false;
+            // fall through
+        case EVENT_USERNAME_REQUEST:
+        case EVENT_USERNAME_ACCEPTED:
+        case EVENT_THROTTLED:
+            scrollback_add(scrollback, STYLE_NOTICE, "# %s", event->content);
+            break;
+
+        case EVENT_USER_JOIN:
+            scrollback_add(scrollback, STYLE_NOTICE, "# %s joined", event->content);
+            break;
+
+        case EVENT_USER_LEAVE:
+            scrollback_add(scrollback, STYLE_NOTICE, "# %s left", event->content);
+            break;
+
+        case EVENT_ROOM_JOIN:
+        case EVENT_ROOM_PART:
+        {
+            // username, then room name
+            size_t username_size = strnlen((char *)event->content, event->content_length) + 1;
+            const char *room_name = username_size < event->content_length ? (char *)&event->content[username_size] : "";
+            scrollback_add(scrollback, STYLE_NOTICE, "# %s %s #%s", event->content,
+                event->code == EVENT_ROOM_JOIN ? "joined" : "left", room_name);
+            break;
+        }
+
+        case EVENT_PING:
+            send_event(server_fd, EVENT_PONG, NULL, 0);
+            break;
+
+        default:
+            break;
+    }
+}
+
+// Reads what the socket has, up to MAX_READS_PER_WAKE reads, and draws every whole event in it. Returns
+// false once the connection is lost or the server sends something that cannot be parsed.
+static bool receive_events(frame_reader_t *reader, int server_fd, scrollback_t *scrollback, bool *username_sent)
+{
+    for(int reads = 0; reads < MAX_READS_PER_WAKE; reads++)
+    {
+        enum fill_result fill = frame_reader_fill(reader, server_fd);
+        if(fill == FILL_CLOSED)
+            return false;
+
+        enum frame_result result;
+        while((result = frame_reader_next(reader)) == FRAME_EVENT)
+            show_event(reader->event, scrollback, server_fd, username_sent);
+        if(result == FRAME_MALFORMED)
+            return false;
+
+        if(fill == FILL_EMPTY)
+            break;
+    }
+    return true;
+}
+
+static void submit_input(input_buffer_t *input_buffer, int server_fd, bool *username_sent)
+{
+    if(!*username_sent)
+        send_event(server_fd, EVENT_USERNAME_SUBMIT, input_buffer->buffer, input_buffer->position + 1);
+    else if(strncmp(input_buffer->buffer, "/join ", 6) == 0)
+        send_event(server_fd, EVENT_ROOM_JOIN, &input_buffer->buffer[6], input_buffer->position - 6 + 1);
+    else if(strcmp(input_buffer->buffer, "/part") == 0)
+        send_event(server_fd, EVENT_ROOM_PART, NULL, 0);
+    else
+        send_event(server_fd, EVENT_MESSAGE, input_buffer->buffer, input_buffer->position + 1);
+    *username_sent = true;
+
+    memset(input_buffer->buffer, 0, sizeof(input_buffer->buffer));
+    input_buffer->position = 0;
+}
+
+int main(int argc, const char **argv)
+{
+    bool username_sent = false;
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(server_fd < 0)
+    {
+        fprintf(stderr, "Unable to create socket;\n\t%s\n", strerror(errno));
+        return 1;
+    }
+
+    struct sockaddr_in server_address;
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(8080);
+    memset(server_address.sin_zero, 0, sizeof(server_address.sin_zero));
+
+    if(inet_pton(AF_INET, "127.0.0.1", &server_address.sin_addr) <= 0)
+    {
+        fprintf(stderr, "Unable to use address;\n\t%s\n", strerror(errno));
+        return 1;
+    }
+
+    if(connect(server_fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
+    {
+        fprintf(stderr, "Unable to connect to server;\n\t%s\n", strerror(errno));
+        return 1;
+    }
+
+    unsigned char hello[WIRE_HELLO_SIZE];
+    send(server_fd, hello, wire_put_hello(hello, WIRE_VERSION, WIRE_FLAG_DEFLATE), 0);
+
+    initscr();
+    start_color();
+    init_color(8, 650, 650, 650);
+    init_pair(1, 8, COLOR_BLACK);
+    raw();
+    noecho();
+    keypad(stdscr, TRUE);
+    nl();
+
+    int max_x, max_y;
+    getmaxyx(stdscr, max_y, max_x);
+
+    WINDOW *history_window = newwin(max_y - 2, 0, 0, 0);
+    WINDOW *input_window = newwin(1, 0, max_y - 2, 0);
+    WINDOW *status_window = newwin(1, 0, max_y - 1, 0);
+    keypad(input_window, TRUE);
+    nodelay(input_window, true);
+
+    input_buffer_t input_buffer;
+    memset(input_buffer.buffer, 0, sizeof(input_buffer.buffer));
+    input_buffer.position = 0;
+
+    scrollback_t scrollback;
+    if(!scrollback_init(&scrollback))
+    {
+        endwin();
+        fprintf(stderr, "Unable to allocate the scrollback\n");
+        return 1;
+    }
+
+    frame_reader_t reader = {0};
+    bool exit = false;
+    bool lost = false;
+    long rendered_ms = 0;
+
+    // Sleeps until the server or the keyboard has something, or until the history is due to be drawn again.
+    // Typing shows at once; the history is drawn at most once per FRAME_INTERVAL_MS.
+    struct pollfd fds[2] = {
+        {.fd = server_fd, .events = POLLIN},
+        {.fd = STDIN_FILENO, .events = POLLIN}
+    };
+    while(!exit)
+    {
+        int timeout = -1;
+        if(scrollback.dirty)
+        {
+            long wait_ms = rendered_ms + FRAME_INTERVAL_MS - now_ms();
+            timeout = wait_ms > 0 ? (int)wait_ms : 0;
+        }
+
+        if(poll(fds, 2, timeout) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+
+        if(fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            if(!receive_events(&reader, server_fd, &scrollback, &username_sent))
+            {
+                lost = true;
+                break;
+            }
+        }
+
+        if(fds[1].revents & (POLLHUP | POLLERR))
+            break;
+
+        int input;
+        while(fds[1].revents & POLLIN && (input = wgetch(input_window)) != ERR)
+        {
+            if(input == '\n' || input == KEY_ENTER)
+            {
+                if(input_buffer.position == 0)
+                    continue;
+                scrollback_add(&scrollback, STYLE_PLAIN, "> %s", input_buffer.buffer);
+                scrollback_scroll(&scrollback, -(long)scrollback.scroll);
+                submit_input(&input_buffer, server_fd, &username_sent);
+                werase(input_window);
+            }
+            else if(input < 256 && (isprint(input) || isspace(input)))
+            {
+                if(input_buffer.position < BUFFER_SIZE - 1)
+                {
+                    input_buffer.buffer[input_buffer.position++] = input;
+                    wprintw(input_window, "%c", input);
+                }
+            }
+            else
+            {
+                switch(input)
+                {
+                    // TODO add command keys here
+                    case 127:
+                    case KEY_BACKSPACE:
+                        if(input_buffer.position > 0)
+                        {
+                            input_buffer.buffer[--input_buffer.position] = '\0';
+                            wprintw(input_window, "\b \b");
+                        }
+                        break;
+
+                    case KEY_PPAGE:
+                        scrollback_scroll(&scrollback, getmaxy(history_window) - 1);
+                        break;
+
+                    case KEY_NPAGE:
+                        scrollback_scroll(&scrollback, -(getmaxy(history_window) - 1));
+                        break;
+
+                    case ('c' & 0x1f): // ^c
+                        exit = true;
+                        break;
+
+                    default:
+                        break;
+                };
+            }
+        }
+
+        if(scrollback.dirty && now_ms() - rendered_ms >= FRAME_INTERVAL_MS)
+        {
+            scrollback_render(&scrollback, history_window, status_window);
+            rendered_ms = now_ms();
+        }
+
+        // The input window goes last so the cursor is left there
+        wnoutrefresh(input_window);
+        doupdate();
+    }
+
+    frame_reader_free(&reader);
+    scrollback_free(&scrollback);
+    if(!lost)
+        send_event(server_fd, EVENT_USER_LEAVE, NULL, 0);
+
+    shutdown(server_fd, SHUT_RDWR);
+    close(server_fd);
+    endwin();
+    if(lost)
+        fprintf(stderr, "Lost connection to server\n");
+    return lost ? 1 : 0;
+};
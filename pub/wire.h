@@ -0,0 +1,169 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "event.h"
+
+// Protocol v2 framing. Every multi-byte field is little-endian regardless of host, and lengths are
+// LEB128 varints, so a one line chat message costs a 7 byte header instead of sizeof(event_t).
+//
+//   hello:  [WIRE_MAGIC] [version] [flags]                        sent by a v2 client right after connecting,
+//                                                                  and echoed back by the server to accept
+//   event:  [WIRE_FRAME_EVENT] [code] [originator: 4] [length: varint] [content]
+//   batch:  [WIRE_FRAME_BATCH] [length: varint] [event frames]    several events in one frame
+//   deflate: [WIRE_FRAME_DEFLATE] [length: varint] [inflated length: varint] [zlib stream of frames]
+//
+// Deflate frames only go from the server to a client whose hello set WIRE_FLAG_DEFLATE and whose hello the
+// server echoed with it set; inflated, they hold event or batch frames to be read as if they came unwrapped.
+//
+// A legacy client sends a raw event_t instead; its first byte is the low byte of the code, which is
+// never WIRE_MAGIC, so the server can tell the two apart from the first byte of a connection.
+
+#define WIRE_MAGIC 0xC2
+#define WIRE_VERSION_LEGACY 1
+#define WIRE_VERSION 2
+
+#define WIRE_FRAME_EVENT 0x01
+#define WIRE_FRAME_BATCH 0x02
+#define WIRE_FRAME_DEFLATE 0x03
+
+#define WIRE_FLAG_DEFLATE 0x01   // Hello flag: the client can inflate deflate frames
+#define WIRE_MAX_INFLATED (1024 * 1024) // Deflate frames claiming to inflate to more than this are malformed
+
+#define WIRE_HELLO_SIZE 3
+#define WIRE_MAX_VARINT 10
+#define WIRE_MAX_HEADER (1 + 1 + 4 + WIRE_MAX_VARINT)
+
+enum wire_header {
+    WIRE_MALFORMED = -1,
+    WIRE_INCOMPLETE = 0,
+    WIRE_HEADER_EVENT,
+    WIRE_HEADER_BATCH,
+    WIRE_HEADER_DEFLATE
+};
+
+
+
+static inline size_t wire_put_varint(unsigned char *out, uint64_t value)
+{
+    size_t length = 0;
+    while(value >= 0x80)
+    {
+        out[length++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (unsigned char)value;
+    return length;
+};
+
+
+
+// Returns the bytes used, 0 if more input is needed, or -1 if the varint is too long to be valid
+static inline int wire_get_varint(const unsigned char *in, size_t available, uint64_t *value)
+{
+    *value = 0;
+    for(size_t i = 0; i < available && i < WIRE_MAX_VARINT; i++)
+    {
+        *value |= (uint64_t)(in[i] & 0x7F) << (7 * i);
+        if((in[i] & 0x80) == 0)
+            return i + 1;
+    }
+    return available >= WIRE_MAX_VARINT ? -1 : 0;
+};
+
+
+
+static inline void wire_put_u32(unsigned char *out, uint32_t value)
+{
+    out[0] = value;
+    out[1] = value >> 8;
+    out[2] = value >> 16;
+    out[3] = value >> 24;
+};
+
+
+
+static inline uint32_t wire_get_u32(const unsigned char *in)
+{
+    return (uint32_t)in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+};
+
+
+
+static inline size_t wire_put_hello(unsigned char *out, unsigned char version, unsigned char flags)
+{
+    out[0] = WIRE_MAGIC;
+    out[1] = version;
+    out[2] = flags;
+    return WIRE_HELLO_SIZE;
+};
+
+
+
+// out needs WIRE_MAX_HEADER bytes; returns the header size
+static inline size_t wire_put_event_header(unsigned char *out, enum event_code code, int originator_id, size_t content_length)
+{
+    out[0] = WIRE_FRAME_EVENT;
+    out[1] = (unsigned char)code;
+    wire_put_u32(&out[2], (uint32_t)originator_id);
+    return 6 + wire_put_varint(&out[6], content_length);
+};
+
+
+
+static inline size_t wire_put_batch_header(unsigned char *out, size_t batch_length)
+{
+    out[0] = WIRE_FRAME_BATCH;
+    return 1 + wire_put_varint(&out[1], batch_length);
+};
+
+
+
+// length counts the inflated length varint as well as the compressed bytes after it
+static inline size_t wire_put_deflate_header(unsigned char *out, size_t length)
+{
+    out[0] = WIRE_FRAME_DEFLATE;
+    return 1 + wire_put_varint(&out[1], length);
+};
+
+
+
+// Decodes an event, batch or deflate header; for the last two only content_length is set. *header_size is
+// the bytes used.
+static inline enum wire_header wire_get_header(const unsigned char *in, size_t available, event_t *header, size_t *header_size)
+{
+    if(available < 1)
+        return WIRE_INCOMPLETE;
+
+    uint64_t length;
+    int varint_size;
+    switch(in[0])
+    {
+        case WIRE_FRAME_EVENT:
+            if(available < 6)
+                return WIRE_INCOMPLETE;
+            varint_size = wire_get_varint(&in[6], available - 6, &length);
+            if(varint_size <= 0)
+                return varint_size == 0 ? WIRE_INCOMPLETE : WIRE_MALFORMED;
+
+            header->code = in[1];
+            header->originator_id = (int)wire_get_u32(&in[2]);
+            header->content_length = length;
+            *header_size = 6 + varint_size;
+            return WIRE_HEADER_EVENT;
+
+        case WIRE_FRAME_BATCH:
+        case WIRE_FRAME_DEFLATE:
+            varint_size = wire_get_varint(&in[1], available - 1, &length);
+            if(varint_size <= 0)
+                return varint_size == 0 ? WIRE_INCOMPLETE : WIRE_MALFORMED;
+
+            header->content_length = length;
+            *header_size = 1 + varint_size;
+            return in[0] == WIRE_FRAME_BATCH ? WIRE_HEADER_BATCH : WIRE_HEADER_DEFLATE;
+
+        default:
+            return WIRE_MALFORMED;
+    }
+};
@@ -0,0 +1,194 @@
+#include "bench.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+
+// Allocations are counted by wrapping the allocators at link time (see BENCH_WRAP in the Makefile), so only
+// calls made from the server's own code are seen, which is exactly what a change to it moves. A pool_alloc
+// counts once; the slabs and large blocks it gets from malloc underneath are its own business.
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *block, size_t size);
+void *__real_reallocarray(void *block, size_t count, size_t size);
+char *__real_strdup(const char *string);
+void *__real_pool_alloc(size_t size);
+
+static unsigned long allocations = 0;
+static unsigned long allocated_bytes = 0;
+static bool in_pool = false;
+
+static void count_allocation(size_t size)
+{
+    if(in_pool)
+        return;
+    allocations++;
+    allocated_bytes += size;
+};
+
+
+
+void *__wrap_malloc(size_t size)
+{
+    count_allocation(size);
+    return __real_malloc(size);
+};
+
+
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    count_allocation(count * size);
+    return __real_calloc(count, size);
+};
+
+
+
+void *__wrap_realloc(void *block, size_t size)
+{
+    count_allocation(size);
+    return __real_realloc(block, size);
+};
+
+
+
+void *__wrap_reallocarray(void *block, size_t count, size_t size)
+{
+    count_allocation(count * size);
+    return __real_reallocarray(block, count, size);
+};
+
+
+
+char *__wrap_strdup(const char *string)
+{
+    count_allocation(strlen(string) + 1);
+    return __real_strdup(string);
+};
+
+
+
+void *__wrap_pool_alloc(size_t size)
+{
+    count_allocation(size);
+    in_pool = true;
+    void *block = __real_pool_alloc(size);
+    in_pool = false;
+    return block;
+};
+
+
+
+static int filter_count = 0;
+static char **filters = NULL;
+
+uint64_t bench_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+};
+
+
+
+// With no arguments everything runs; otherwise only names containing one of them
+bool bench_selected(const char *name)
+{
+    if(filter_count == 0)
+        return true;
+
+    for(int i = 0; i < filter_count; i++)
+    {
+        if(strstr(name, filters[i]) != NULL)
+            return true;
+    }
+    return false;
+};
+
+
+
+void bench_pause(bench_t *bench)
+{
+    if(!bench->paused)
+        bench->elapsed_ns += bench_now() - bench->start_ns;
+    bench->paused = true;
+};
+
+
+
+void bench_resume(bench_t *bench)
+{
+    if(bench->paused)
+        bench->start_ns = bench_now();
+    bench->paused = false;
+};
+
+
+
+static void bench_once(bench_t *bench, bench_body_t body, void *context, size_t iterations)
+{
+    bench->iterations = iterations;
+    bench->elapsed_ns = 0;
+    bench->paused = false;
+    bench->start_ns = bench_now();
+    body(bench, context);
+    bench_pause(bench);
+};
+
+
+
+// Grows the iteration count until a run takes BENCH_TARGET_NS, like Go's testing package, then reports the
+// last run. Lines follow Go's benchmark format so before and after runs can be compared with benchstat.
+void bench_run(const char *name, bench_body_t body, void *context)
+{
+    if(!bench_selected(name))
+        return;
+
+    bench_t bench;
+    size_t iterations = 1;
+    unsigned long run_allocations, run_bytes;
+    while(true)
+    {
+        unsigned long allocations_before = allocations;
+        unsigned long bytes_before = allocated_bytes;
+        bench_once(&bench, body, context, iterations);
+        run_allocations = allocations - allocations_before;
+        run_bytes = allocated_bytes - bytes_before;
+
+        if(bench.elapsed_ns >= BENCH_TARGET_NS || iterations >= 1000000000)
+            break;
+
+        // Aim past the target rather than creep up on it, but never grow more than 100 times at once
+        double per_op = bench.elapsed_ns > 0 ? (double)bench.elapsed_ns / iterations : 1.0;
+        size_t next = (size_t)(BENCH_TARGET_NS * 1.2 / per_op);
+        if(next > iterations * 100)
+            next = iterations * 100;
+        iterations = next > iterations ? next : iterations + 1;
+    }
+
+    printf("Benchmark%s\t%zu\t%.1f ns/op\t%.0f B/op\t%.2f allocs/op\n", name, bench.iterations,
+        (double)bench.elapsed_ns / bench.iterations, (double)run_bytes / bench.iterations, (double)run_allocations / bench.iterations);
+    fflush(stdout);
+};
+
+
+
+int main(int argc, char *argv[])
+{
+    filter_count = argc - 1;
+    filters = &argv[1];
+
+    // Nothing drains the log ring in here; only errors are worth the record
+    log_set_level(LOG_LEVEL_ERROR);
+
+    bench_sanitize();
+    bench_framing();
+    bench_roster();
+    bench_relay();
+    return 0;
+};
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BENCH_TARGET_NS 200000000 // Each benchmark is grown until one run takes at least this long
+
+// Handed to every benchmark body, which must do its operation exactly iterations times. Work that is
+// not part of the operation, like draining sockets, goes between bench_pause and bench_resume.
+typedef struct {
+    size_t iterations;
+    uint64_t start_ns;
+    uint64_t elapsed_ns;
+    bool paused;
+} bench_t;
+
+typedef void (*bench_body_t)(bench_t *bench, void *context);
+
+
+
+uint64_t bench_now(void);
+bool bench_selected(const char *name);
+void bench_run(const char *name, bench_body_t body, void *context);
+void bench_pause(bench_t *bench);
+void bench_resume(bench_t *bench);
+
+void bench_sanitize(void);
+void bench_framing(void);
+void bench_roster(void);
+void bench_relay(void);
@@ -0,0 +1,151 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "event.h"
+#include "packet.h"
+#include "reader.h"
+#include "wire.h"
+
+#define STREAM_EVENTS 64
+#define SEGMENT_SIZE 1448 // What one read usually returns off a busy connection: a TCP segment
+
+typedef struct {
+    unsigned char content[MAX_CONTENT_LENGTH];
+    size_t length;
+    unsigned char version;
+    unsigned char *stream;
+    size_t stream_length;
+    size_t segment;     // Bytes handed to reader_next at a time
+    event_t *frame;
+} framing_case_t;
+
+static volatile size_t sink;
+
+static void run_encode(bench_t *bench, void *context)
+{
+    framing_case_t *test = context;
+    for(size_t i = 0; i < bench->iterations; i++)
+    {
+        packet_t *packet = packet_create_event(EVENT_MESSAGE, 42, test->content, test->length);
+        sink = packet_for_version(packet, test->version)->length;
+        packet_release(packet);
+    }
+};
+
+
+
+// The cost a broadcast pays once for every client that asked for deflate frames
+static void run_deflate(bench_t *bench, void *context)
+{
+    framing_case_t *test = context;
+    for(size_t i = 0; i < bench->iterations; i++)
+    {
+        packet_t *packet = packet_create_event(EVENT_MESSAGE, 42, test->content, test->length);
+        sink = packet_deflated(packet_for_version(packet, WIRE_VERSION), 1)->length;
+        packet_release(packet);
+    }
+};
+
+
+
+// One op is one frame out of the reader, fed the prepared stream a segment at a time and rewound when it runs out
+static void run_parse(bench_t *bench, void *context)
+{
+    framing_case_t *test = context;
+    reader_t reader = {0};
+    reader.version = test->version;
+    size_t offset = 0;
+    const unsigned char *input = test->stream;
+    size_t input_length = 0;
+    for(size_t i = 0; i < bench->iterations; i++)
+    {
+        enum reader_result result;
+        while((result = reader_next(&reader, &input, &input_length, test->frame)) == READER_NEED_MORE)
+        {
+            if(offset == test->stream_length)
+                offset = 0;
+            input = &test->stream[offset];
+            input_length = test->stream_length - offset < test->segment ? test->stream_length - offset : test->segment;
+            offset += input_length;
+        }
+
+        if(result != READER_FRAME)
+        {
+            fprintf(stderr, "Unexpected reader result %d\n", result);
+            exit(1);
+        }
+        sink = test->frame->content_length;
+    }
+    reader_free(&reader);
+};
+
+
+
+static bool build_stream(framing_case_t *test)
+{
+    packet_t *packet = packet_create_event(EVENT_MESSAGE, 42, test->content, test->length);
+    packet_t *encoded = packet_for_version(packet, test->version);
+    test->stream_length = encoded->length * STREAM_EVENTS;
+    test->stream = malloc(test->stream_length);
+    if(test->stream == NULL)
+    {
+        packet_release(packet);
+        return false;
+    }
+
+    for(size_t i = 0; i < STREAM_EVENTS; i++)
+        memcpy(&test->stream[i * encoded->length], encoded->data, encoded->length);
+    packet_release(packet);
+    return true;
+};
+
+
+
+void bench_framing(void)
+{
+    static const size_t lengths[] = {16, 128, 1024};
+    static const struct {
+        const char *name;
+        unsigned char version;
+    } versions[] = {{"legacy", WIRE_VERSION_LEGACY}, {"v2", WIRE_VERSION}};
+
+    static framing_case_t test;
+    memset(test.content, 'x', sizeof(test.content));
+    test.frame = malloc(sizeof(event_t) + MAX_CONTENT_LENGTH + 1);
+    if(test.frame == NULL)
+        return;
+
+    char name[64];
+    for(size_t v = 0; v < sizeof(versions) / sizeof(versions[0]); v++)
+    {
+        test.version = versions[v].version;
+        for(size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+        {
+            test.length = lengths[l];
+            snprintf(name, sizeof(name), "Encode/%s/%zu", versions[v].name, lengths[l]);
+            bench_run(name, run_encode, &test);
+
+            if(!build_stream(&test))
+                continue;
+            test.segment = test.stream_length;
+            snprintf(name, sizeof(name), "Parse/%s/%zu", versions[v].name, lengths[l]);
+            bench_run(name, run_parse, &test);
+
+            test.segment = SEGMENT_SIZE;
+            snprintf(name, sizeof(name), "Parse/%s/%zu/segmented", versions[v].name, lengths[l]);
+            bench_run(name, run_parse, &test);
+            free(test.stream);
+        }
+    }
+
+    for(size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+    {
+        test.length = lengths[l];
+        snprintf(name, sizeof(name), "Encode/deflate/%zu", lengths[l]);
+        bench_run(name, run_deflate, &test);
+    }
+    free(test.frame);
+};
@@ -0,0 +1,171 @@
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "connections.h"
+#include "directory.h"
+#include "packet.h"
+#include "user.h"
+#include "wire.h"
+
+#define DRAIN_EVERY 64 // Ops between emptying the queues and sockets, outside the timed part
+
+typedef struct {
+    connections_t connections;
+    directory_t directory;
+    int master;
+    int *peers;        // The client end of each user's socketpair
+    size_t users;
+    unsigned int sender;
+    bool flush;        // Whether writing the queues out is part of the op
+} relay_case_t;
+
+static void drain_peers(relay_case_t *test)
+{
+    unsigned char buffer[65536];
+    for(size_t i = 0; i < test->users; i++)
+    {
+        while(read(test->peers[i], buffer, sizeof(buffer)) > 0)
+            ;
+    }
+};
+
+
+
+// One op is a chat line from one user going out to everyone else in the lobby: decorated, encoded once,
+// queued for each receiver and kept in the room's history, plus written out when flush is set
+static void run_relay(bench_t *bench, void *context)
+{
+    relay_case_t *test = context;
+    char message[] = "hello everyone, this is a fairly ordinary line of chat";
+    for(size_t i = 0; i < bench->iterations; i++)
+    {
+        connections_relay_message_from(&test->connections, message, test->sender, 0);
+        if(test->flush)
+            connections_flush_pending(&test->connections);
+
+        if(i % DRAIN_EVERY == DRAIN_EVERY - 1 || i == bench->iterations - 1)
+        {
+            bench_pause(bench);
+            connections_flush_pending(&test->connections);
+            drain_peers(test);
+            bench_resume(bench);
+        }
+    }
+};
+
+
+
+static void relay_teardown(relay_case_t *test)
+{
+    connections_shutdown(&test->connections);
+    directory_destroy(&test->directory);
+    for(size_t i = 0; i < test->users; i++)
+        close(test->peers[i]);
+    close(test->master);
+    free(test->peers);
+};
+
+
+
+static bool relay_setup(relay_case_t *test, size_t users)
+{
+    static const connections_config_t config = {.outbound_cap = SIZE_MAX / 2, .flush_bytes = SIZE_MAX / 2, .flush_delay_us = 0};
+
+    test->users = 0;
+    test->peers = malloc(users * sizeof(int));
+    test->master = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(test->peers == NULL || test->master < 0 || !directory_init(&test->directory))
+    {
+        if(test->master >= 0)
+            close(test->master);
+        free(test->peers);
+        return false;
+    }
+    if(!connections_init(&test->connections, test->master, &config, &test->directory))
+    {
+        directory_destroy(&test->directory);
+        close(test->master);
+        free(test->peers);
+        return false;
+    }
+
+    for(size_t i = 0; i < users; i++)
+    {
+        int pair[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair) < 0)
+        {
+            relay_teardown(test);
+            return false;
+        }
+
+        int index = connections_add_connection(&test->connections, pair[0], MAX_USERNAME_LENGTH + 1);
+        if(index == 0)
+        {
+            close(pair[1]);
+            relay_teardown(test);
+            return false;
+        }
+        test->peers[test->users++] = pair[1];
+
+        user_t *user = connections_user(&test->connections, index);
+        snprintf((char *)user->username, MAX_USERNAME_LENGTH + 1, "user%06zu", i);
+        user->reader.version = WIRE_VERSION;
+        if(directory_add(&test->directory, connections_client_id(&test->connections, index), user->username, ROOM_LOBBY) != DIRECTORY_ADDED
+            || !connections_join_room(&test->connections, index, ROOM_LOBBY, (const unsigned char *)ROOM_LOBBY_NAME))
+        {
+            relay_teardown(test);
+            return false;
+        }
+        user->state = USER_ACTIVE;
+        if(i == 0)
+            test->sender = index;
+    }
+
+    return true;
+};
+
+
+
+void bench_relay(void)
+{
+    static const size_t sizes[] = {10, 100, 1000};
+
+    // Two descriptors per user
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    static relay_case_t test;
+    char name[64];
+    for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        char queue_name[64];
+        snprintf(queue_name, sizeof(queue_name), "Relay/queue/%zu", sizes[s]);
+        snprintf(name, sizeof(name), "Relay/flush/%zu", sizes[s]);
+        if(!bench_selected(queue_name) && !bench_selected(name))
+            continue;
+
+        if(!relay_setup(&test, sizes[s]))
+        {
+            fprintf(stderr, "Unable to set up %zu users for %s\n", sizes[s], name);
+            continue;
+        }
+
+        test.flush = false;
+        bench_run(queue_name, run_relay, &test);
+        test.flush = true;
+        bench_run(name, run_relay, &test);
+        relay_teardown(&test);
+    }
+};
@@ -0,0 +1,110 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "directory.h"
+#include "packet.h"
+
+typedef struct {
+    directory_t directory;
+    size_t users;
+    size_t next;          // The user to take out and put back in next
+    bool shared;          // Whether every page is queued for someone while the roster changes
+} roster_case_t;
+
+static volatile size_t sink;
+
+static void username_for(unsigned char *username, size_t user)
+{
+    snprintf((char *)username, 32, "user%06zu", user);
+};
+
+
+
+// One op is a user leaving the lobby and coming back, which patches their roster page twice
+static void run_join(bench_t *bench, void *context)
+{
+    roster_case_t *test = context;
+    unsigned char username[32];
+    for(size_t i = 0; i < bench->iterations; i++)
+    {
+        packet_t **pages = NULL;
+        size_t page_count = 0;
+        if(test->shared)
+        {
+            bench_pause(bench);
+            page_count = directory_retain_roster(&test->directory, ROOM_LOBBY, &pages);
+            bench_resume(bench);
+        }
+
+        username_for(username, test->next);
+        directory_remove(&test->directory, test->next, username);
+        directory_add(&test->directory, test->next, username, ROOM_LOBBY);
+        test->next = (test->next + 1) % test->users;
+
+        if(test->shared)
+        {
+            bench_pause(bench);
+            for(size_t p = 0; p < page_count; p++)
+                packet_release(pages[p]);
+            free(pages);
+            bench_resume(bench);
+        }
+    }
+};
+
+
+
+// One op is what greeting a client costs the directory: a reference to every page of the room's user list
+static void run_send(bench_t *bench, void *context)
+{
+    roster_case_t *test = context;
+    for(size_t i = 0; i < bench->iterations; i++)
+    {
+        packet_t **pages;
+        size_t page_count = directory_retain_roster(&test->directory, ROOM_LOBBY, &pages);
+        for(size_t p = 0; p < page_count; p++)
+            packet_release(pages[p]);
+        free(pages);
+        sink = page_count;
+    }
+};
+
+
+
+void bench_roster(void)
+{
+    static const size_t sizes[] = {10, 1000, 10000};
+
+    static roster_case_t test;
+    char name[64];
+    unsigned char username[32];
+    for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        if(!directory_init(&test.directory))
+            return;
+
+        test.users = sizes[s];
+        test.next = 0;
+        for(size_t user = 0; user < test.users; user++)
+        {
+            username_for(username, user);
+            directory_add(&test.directory, user, username, ROOM_LOBBY);
+        }
+
+        test.shared = false;
+        snprintf(name, sizeof(name), "Roster/join/%zu", sizes[s]);
+        bench_run(name, run_join, &test);
+
+        test.shared = true;
+        snprintf(name, sizeof(name), "Roster/join/%zu/shared", sizes[s]);
+        bench_run(name, run_join, &test);
+
+        snprintf(name, sizeof(name), "Roster/send/%zu", sizes[s]);
+        bench_run(name, run_send, &test);
+
+        directory_destroy(&test.directory);
+    }
+};
@@ -0,0 +1,113 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "messages.h"
+#include "pool.h"
+
+// The sanitizer as it was before sanitize_message, kept here to measure against
+static unsigned char *allocate_sanitized_message(unsigned char *input_message)
+{
+    int input_length = strlen(input_message);
+
+    unsigned char *sanitized = pool_alloc(input_length + 1);
+    if(sanitized == NULL)
+        return NULL;
+
+    int i,s;
+    for(i = s = 0; input_message[i] != '\0'; i++)
+        if(isprint(input_message[i]))
+            sanitized[s++] = input_message[i];
+
+    sanitized[s] = '\0';
+
+    return sanitized;
+};
+
+
+
+static void fill(unsigned char *buffer, size_t length, const char *kind)
+{
+    static const char text[] = "The quick brown fox jumps over the lazy dog, again and again. ";
+    static const char utf8[] = "caf\xC3\xA9 na\xC3\xAFve \xE2\x82\xAC" "5 \xF0\x9F\x99\x82 ok ";
+    for(size_t i = 0; i < length; i++)
+    {
+        if(strcmp(kind, "utf8") == 0)
+            buffer[i] = utf8[i % (sizeof(utf8) - 1)];
+        else
+            buffer[i] = text[i % (sizeof(text) - 1)];
+
+        if(strcmp(kind, "controls") == 0 && i % 23 == 22)
+            buffer[i] = '\t';
+    }
+    buffer[length] = '\0';
+};
+
+
+
+typedef struct {
+    unsigned char input[1025];
+    unsigned char output[1025];
+    size_t length;
+    unsigned int flags;
+} sanitize_case_t;
+
+static volatile size_t sink;
+
+static void run_legacy(bench_t *bench, void *context)
+{
+    sanitize_case_t *test = context;
+    for(size_t i = 0; i < bench->iterations; i++)
+    {
+        unsigned char *sanitized = allocate_sanitized_message(test->input);
+        sink = sanitized[0];
+        pool_free(sanitized);
+    }
+};
+
+
+
+static void run_kernel(bench_t *bench, void *context)
+{
+    sanitize_case_t *test = context;
+    for(size_t i = 0; i < bench->iterations; i++)
+        sink = sanitize_message(test->output, test->input, test->length, test->flags);
+};
+
+
+
+void bench_sanitize(void)
+{
+    static const size_t lengths[] = {32, 256, 1024};
+    static const char *kinds[] = {"ascii", "controls", "utf8"};
+    static const struct {
+        const char *name;
+        enum sanitize_kernel kernel;
+    } kernels[] = {{"scalar", SANITIZE_SCALAR}, {"sse2", SANITIZE_SSE2}, {"avx2", SANITIZE_AVX2}};
+
+    static sanitize_case_t test;
+    char name[64];
+    for(size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++)
+    {
+        test.flags = strcmp(kinds[k], "utf8") == 0 ? SANITIZE_UTF8 : 0;
+        for(size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+        {
+            test.length = lengths[l];
+            fill(test.input, test.length, kinds[k]);
+
+            snprintf(name, sizeof(name), "Sanitize/legacy/%s/%zu", kinds[k], lengths[l]);
+            bench_run(name, run_legacy, &test);
+
+            for(size_t n = 0; n < sizeof(kernels) / sizeof(kernels[0]); n++)
+            {
+                snprintf(name, sizeof(name), "Sanitize/%s/%s/%zu", kernels[n].name, kinds[k], lengths[l]);
+                if(!bench_selected(name) || !sanitize_use_kernel(kernels[n].kernel))
+                    continue;
+                bench_run(name, run_kernel, &test);
+            }
+        }
+    }
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Token bucket: credit refills at rate tokens a second up to burst, and every admitted event takes one.
+// A zero rate means no limit. A zeroed bucket starts out full the first time it is looked at.
+typedef struct {
+    double tokens;
+    uint64_t updated_ns;
+} bucket_t;
+
+typedef struct {
+    double rate;                 // Tokens a second; 0 turns the limit off
+    double burst;                // Most credit that can build up, and so the longest run admitted at once
+} bucket_limit_t;
+
+
+
+static inline void bucket_refill(bucket_t *bucket, const bucket_limit_t *limit, uint64_t now_ns)
+{
+    if(bucket->updated_ns == 0)
+        bucket->tokens = limit->burst;
+    else if(now_ns > bucket->updated_ns)
+        bucket->tokens += (now_ns - bucket->updated_ns) * 1e-9 * limit->rate;
+
+    if(bucket->tokens > limit->burst)
+        bucket->tokens = limit->burst;
+    bucket->updated_ns = now_ns;
+};
+
+
+
+// Whether there is credit for one more event; nothing is taken
+static inline bool bucket_ready(bucket_t *bucket, const bucket_limit_t *limit, uint64_t now_ns)
+{
+    if(limit->rate <= 0)
+        return true;
+
+    bucket_refill(bucket, limit, now_ns);
+    return bucket->tokens >= 1;
+};
+
+
+
+static inline void bucket_take(bucket_t *bucket, const bucket_limit_t *limit)
+{
+    if(limit->rate > 0)
+        bucket->tokens -= 1;
+};
+
+
+
+// When the bucket will next have credit for one event, as of its last refill
+static inline uint64_t bucket_ready_at(const bucket_t *bucket, const bucket_limit_t *limit)
+{
+    if(limit->rate <= 0 || bucket->tokens >= 1)
+        return bucket->updated_ns;
+    return bucket->updated_ns + (uint64_t)((1 - bucket->tokens) / limit->rate * 1e9) + 1;
+};
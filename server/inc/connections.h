@@ -1,24 +1,135 @@
-#pragma once
-
-#include <stdbool.h>
-#include <stdlib.h>
-
-#include "event.h"
-#include "user.h"
-
-#define GROW_FACTOR 1.8
-
-typedef struct {
-    user_t *users;
-    size_t count;
-    size_t size;
-} connections_t;
-
-
-
-bool connections_update_fds(connections_t *connections);
-void connections_relay_event_from(const connections_t *connections, event_t *event, int sender);
-void connections_relay_message_from(const connections_t *connections, char *message, int sender);
-int connections_add_connection(connections_t *connections, int new_connection, size_t username_size);
-void connections_close_connection(connections_t *connections, unsigned int index);
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+
+#include "directory.h"
+#include "event.h"
+#include "journal.h"
+#include "metrics.h"
+#include "packet.h"
+#include "ring.h"
+#include "rooms.h"
+#include "timers.h"
+#include "user.h"
+
+#define USERS_PER_PAGE 256        // Users live in pages that never move once allocated
+#define CONNECTION_SLOT_BITS 24   // Client ids and epoll tags keep the slot in the low bits and its generation above
+#define CONNECTION_SLOT_MASK ((1u << CONNECTION_SLOT_BITS) - 1)
+#define CONNECTION_GENERATION_MASK 0x7f // Seven bits keeps client ids positive; MAILBOX_TAG is never a valid tag
+#define MAX_READY_EVENTS 256
+#define DEFAULT_OUTBOUND_CAP (256 * 1024)
+#define DEFAULT_FLUSH_BYTES (64 * 1024)
+#define DEFAULT_FLUSH_DELAY_US 0
+#define DEFAULT_HANDSHAKE_TIMEOUT_MS 60000 // Long enough for someone to type a username
+#define DEFAULT_IDLE_TIMEOUT_MS 60000
+#define PROTOCOL_SNIFF_MS 250     // A client silent this long after connecting is taken to be a legacy client waiting to be greeted
+#define DEFAULT_USER_RATE 200     // Events a second from one user
+#define DEFAULT_USER_BURST 400
+#define DEFAULT_ROOM_RATE 0       // Messages a second into one room from one worker's members; off
+#define DEFAULT_ROOM_BURST 0
+#define RING_DRAIN_MS 1000        // How long shutdown waits for sends still in flight on the ring
+#define RING_BATCH 256            // Completions taken off the ring at a time
+
+// With io_uring each request carries what it is for in the low bits of its user data; sends carry their
+// own in-flight record above them, everything else the tag of whoever it is for
+enum ring_op {
+    RING_OP_ACCEPT = 1,
+    RING_OP_RECEIVE,
+    RING_OP_SEND,
+    RING_OP_WATCH,
+    RING_OP_WRITABLE,
+    RING_OP_CANCEL
+};
+#define RING_OP_BITS 3
+#define RING_OP_MASK ((1u << RING_OP_BITS) - 1)
+#define RING_DATA(op, tag) (((uint64_t)(tag) << RING_OP_BITS) | (op))
+#define RING_DATA_OP(data) ((enum ring_op)((data) & RING_OP_MASK))
+#define RING_DATA_TAG(data) ((uint32_t)((data) >> RING_OP_BITS))
+
+typedef struct {
+    size_t outbound_cap;         // Users with more than this many bytes waiting to be sent are evicted
+    size_t flush_bytes;          // A user's queue is written as soon as it holds this much
+    unsigned int flush_delay_us; // Otherwise queued events may wait this long to share a writev; 0 flushes every loop
+    unsigned int handshake_timeout_ms; // Users without a username this long after connecting are dropped
+    unsigned int idle_timeout_ms;      // Silent users are pinged after this long, and dropped if still silent after as long again; 0 never
+    bucket_limit_t user_limit;   // Every event a user sends is admitted against this
+    bucket_limit_t room_limit;   // And every message against this, for the room it goes to
+    bool io_uring;               // Use io_uring for accepts, receives and sends where the kernel has it; epoll otherwise
+    size_t deflate_bytes;        // Frames this long or longer are deflated for clients that asked; 0 never deflates
+} connections_config_t;
+
+typedef struct {
+    user_t **user_pages;
+    size_t page_count;
+    size_t count;
+    size_t size;                 // Slots in all pages; slot 0 is the listener
+    unsigned int free_head;      // Unused slots, oldest first so a slot's generation wraps as slowly as possible
+    unsigned int free_tail;
+
+    int epoll_fd;
+    struct epoll_event ready[MAX_READY_EVENTS]; // data.u32 holds the ready user's tag
+    ring_t *ring;                // Replaces epoll when set; see connections_use_ring
+    unsigned int sends_in_flight;
+
+    connections_config_t config;
+    unsigned int evicted;        // Head of the list of users waiting to be reaped, 0 when empty
+    unsigned int pending;        // Head of the list of users with unflushed events, 0 when empty
+    uint64_t flush_deadline;     // CLOCK_MONOTONIC ns by which the pending list must be flushed
+    outbound_stats_t write_stats;
+    size_t queued_bytes;         // In every user's outbound queue together
+    metrics_t metrics;           // Read by the stats thread; refreshed by connections_publish_metrics
+    timer_wheel_t timers;        // Users' deadlines; their handler is the caller's, see connections_arm_timer
+
+    rooms_t rooms;
+    directory_t *directory;      // Shared with every other worker
+    journal_t *journal;          // Every relayed event is appended here when journaling is on; shared, may be NULL
+    int id_base;
+    int id_stride;
+    unsigned int worker;         // This worker's bit in the directory's room masks
+    void (*broadcast)(void *context, packet_t *packet, uint32_t room); // Hands relayed packets to the other workers
+    void *broadcast_context;
+} connections_t;
+
+
+
+static inline user_t *connections_user(const connections_t *connections, unsigned int index)
+{
+    return &connections->user_pages[index / USERS_PER_PAGE][index % USERS_PER_PAGE];
+};
+
+
+
+bool connections_init(connections_t *connections, int master_socket, const connections_config_t *config, directory_t *directory);
+bool connections_use_ring(connections_t *connections);
+bool connections_watch(connections_t *connections, int fd, uint32_t tag);
+bool connections_accept(connections_t *connections);
+void connections_receive(connections_t *connections, unsigned int index);
+void connections_pause_receive(connections_t *connections, unsigned int index);
+void connections_complete_send(connections_t *connections, uint64_t user_data, int result);
+void connections_writable(connections_t *connections, unsigned int index);
+int connections_client_id(const connections_t *connections, unsigned int index);
+unsigned int connections_index_for_tag(const connections_t *connections, uint32_t tag);
+int connections_wait(connections_t *connections);
+void connections_arm_timer(connections_t *connections, unsigned int index, wheel_timer_t *timer, uint64_t deadline_ns);
+void connections_send(connections_t *connections, unsigned int index, packet_t *packet);
+void connections_flush(connections_t *connections, unsigned int index);
+void connections_flush_pending(connections_t *connections);
+void connections_print_write_stats(const connections_t *connections, const char *name);
+void connections_publish_metrics(connections_t *connections);
+void connections_evict(connections_t *connections, unsigned int index, enum evict_reason reason);
+void connections_reap(connections_t *connections);
+void connections_relay_local(connections_t *connections, packet_t *packet, uint32_t room, int sender);
+void connections_relay_packet_from(connections_t *connections, packet_t *packet, int sender);
+void connections_relay_message_from(connections_t *connections, char *message, int sender, uint64_t received_ns);
+int connections_add_connection(connections_t *connections, int new_connection, size_t username_size);
+void connections_send_user_list(connections_t *connections, unsigned int index);
+void connections_send_history(connections_t *connections, unsigned int index);
+bool connections_join_room(connections_t *connections, unsigned int index, uint32_t room, const unsigned char *name);
+void connections_leave_room(connections_t *connections, unsigned int index);
+void connections_enter_room(connections_t *connections, unsigned int index, const unsigned char *name);
+void connections_disconnect(connections_t *connections, unsigned int index);
+void connections_close_connection(connections_t *connections, unsigned int index);
 void connections_shutdown(connections_t *connections);
\ No newline at end of file
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "history.h"
+#include "packet.h"
+
+// A room id is its slot in the directory plus a generation, bumped each time the slot is freed,
+// so an event still in flight for a closed room never reaches the room that reuses its slot
+#define ROOM_SLOT_BITS 20
+#define ROOM_SLOT_MASK ((1u << ROOM_SLOT_BITS) - 1)
+#define ROOM_SLOT(room) ((room) & ROOM_SLOT_MASK)
+#define ROOM_NONE UINT32_MAX
+#define ROOM_LOBBY 0 // Slot 0, never closed; everyone starts here
+#define ROOM_LOBBY_NAME "lobby"
+#define ROOM_NAME_LENGTH 32
+#define ROSTER_PAGE_SIZE 2048 // Bytes of usernames per EVENT_USER_LIST, so a big room's list goes out in pieces
+#define ROOM_WORKERS_CHUNK 1024 // Room slots per chunk of worker masks
+
+enum directory_result {
+    DIRECTORY_ADDED,
+    DIRECTORY_DUPLICATE, // Someone already has the username
+    DIRECTORY_ERROR
+};
+
+// Every user that has set a username, across all workers; shared, so every call takes the lock
+typedef struct {
+    int id;
+    uint32_t room;
+    size_t hash;
+    size_t roster_page;  // Which of the room's roster pages lists the user
+    unsigned char *username;
+} directory_entry_t;
+
+typedef struct {
+    unsigned char *name; // NULL while the slot is free
+    size_t hash;
+    size_t next_free;    // While the slot is free, the next free slot + 1; 0 ends the list
+    unsigned int generation;
+    size_t members;      // Open references, one per user in the room on any worker
+    history_t *history;  // Lives as long as the room does
+    // The room's user list, kept serialized as EVENT_USER_LIST packets and patched as users come and go;
+    // everyone joining in between is sent references to the same pages
+    packet_t **roster;
+    size_t roster_count;
+    size_t roster_size;
+} directory_room_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    directory_entry_t *entries;
+    size_t count;
+    size_t size;
+    size_t *index;       // Open addressing over entries by username; position + 1, 0 when empty
+    size_t index_size;   // Power of two, kept at least twice count
+    directory_room_t *rooms;
+    size_t room_count;
+    size_t room_size;
+    size_t *room_index;     // Open addressing over named rooms by name; slot + 1, 0 when empty
+    size_t room_index_size; // Power of two, kept at least twice room_count
+    size_t free_rooms;      // First free slot + 1, 0 when none; reused before the slots grow
+    // A bit per worker with members in each room slot, read without the lock when relaying. Chunks are made
+    // as slots are first used and never move, unlike rooms.
+    _Atomic(atomic_uint_least64_t *) room_workers[(ROOM_SLOT_MASK + 1) / ROOM_WORKERS_CHUNK];
+} directory_t;
+
+
+
+bool directory_init(directory_t *directory);
+enum directory_result directory_add(directory_t *directory, int id, const unsigned char *username, uint32_t room);
+void directory_remove(directory_t *directory, int id, const unsigned char *username);
+bool directory_set_room(directory_t *directory, const unsigned char *username, uint32_t room);
+uint32_t directory_open_room(directory_t *directory, const unsigned char *name);
+void directory_close_room(directory_t *directory, uint32_t room);
+history_t *directory_history(directory_t *directory, uint32_t room);
+void directory_set_room_worker(directory_t *directory, uint32_t room, unsigned int worker, bool present);
+uint64_t directory_room_workers(directory_t *directory, uint32_t room);
+size_t directory_retain_roster(directory_t *directory, uint32_t room, packet_t ***pages);
+void directory_destroy(directory_t *directory);
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "packet.h"
+
+#define HISTORY_BYTES (64 * 1024)
+#define HISTORY_MESSAGES 100
+#define HISTORY_INITIAL_BYTES 4096
+
+// A room's most recent messages, kept as v2 event frames back to back in a ring; the oldest are dropped to
+// make room, by whichever of the byte or message limits is hit first. The ring starts small, so quiet rooms
+// stay cheap, and doubles up to HISTORY_BYTES; after that nothing is allocated. Shared by every worker
+// with users in the room, so each call takes the lock.
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned char *ring;
+    size_t capacity;
+    size_t start;   // Offset of the oldest frame
+    size_t length;  // Bytes in use
+    size_t count;   // Frames in use
+} history_t;
+
+
+
+history_t *history_create(void);
+void history_append(history_t *history, packet_t *packet);
+packet_t *history_replay(history_t *history, unsigned char version);
+void history_destroy(history_t *history);
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "event.h"
+
+#define JOURNAL_MAGIC "CCJRNL01"       // First bytes of every segment
+#define JOURNAL_MAGIC_LENGTH 8
+#define JOURNAL_SEGMENT_BYTES (16 * 1024 * 1024) // A segment is closed once it grows past this
+#define JOURNAL_BUFFER_BYTES (1024 * 1024)       // Each of the writer's two buffers
+#define JOURNAL_REPLAY_SEGMENTS 2      // Newest segments read back at startup
+#define JOURNAL_RECORD_PREFIX 8        // CRC and size, ahead of what the CRC covers
+#define JOURNAL_RECORD_FIXED 17        // Time, code, originator and room name length
+
+// On disk, little endian: [crc32][size] then size bytes of [time ns][code][originator][room length][room][content].
+// The CRC covers the size bytes as well, so a torn size is caught too.
+typedef struct {
+    uint64_t time_ns;          // CLOCK_REALTIME when the event was journaled
+    int32_t code;
+    int32_t originator_id;
+    const unsigned char *room; // Not NUL terminated
+    size_t room_length;
+    const unsigned char *content;
+    size_t content_length;
+} journal_record_t;
+
+typedef struct {
+    unsigned long records;
+    unsigned long writes;
+    unsigned long syncs;
+    unsigned long bytes;
+    unsigned long dropped;     // Records not journaled because both buffers were full
+} journal_stats_t;
+
+// Workers append into the active buffer under the lock; the writer thread swaps it for the idle one, then
+// writes and fsyncs the whole batch at once. Whatever arrives during one fsync is committed by the next.
+// Appending never waits for the disk: a record that finds both buffers full is dropped and counted.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;       // Signalled when the active buffer stops being empty
+    unsigned char *buffers[2];
+    unsigned int active;
+    size_t used;               // Bytes in the active buffer
+    bool stopping;
+    pthread_t thread;
+
+    char *directory;
+    unsigned int segment;      // Number of the segment being written
+    int fd;
+    size_t segment_bytes;
+    journal_stats_t stats;
+} journal_t;
+
+typedef void (*journal_visit_t)(void *context, const journal_record_t *record);
+
+
+
+uint32_t journal_crc32(const unsigned char *data, size_t length);
+size_t journal_parse_record(const unsigned char *data, size_t length, journal_record_t *record);
+bool journal_read_segment(const char *path, journal_visit_t visit, void *context, size_t *records, bool *truncated);
+bool journal_replay(const char *directory, journal_visit_t visit, void *context);
+
+journal_t *journal_open(const char *directory);
+void journal_append(journal_t *journal, const event_t *event, const unsigned char *room, size_t room_length);
+void journal_print_stats(journal_t *journal);
+void journal_close(journal_t *journal);
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOG_RING_RECORDS 8192  // Always a power of two
+#define LOG_MAX_FIELDS 6
+#define LOG_TEXT_BYTES 160     // Shared by a record's string fields; longer strings are cut short
+
+enum log_level {
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+};
+
+enum log_field_kind {
+    LOG_FIELD_INT = 0,
+    LOG_FIELD_STRING
+};
+
+// What callers pass; keys and event names must be string literals, since only the pointer is kept
+typedef struct {
+    const char *key;
+    enum log_field_kind kind;
+    long long number;
+    const char *string;
+} log_field_t;
+
+#define LOG_INT(key, value) ((log_field_t){(key), LOG_FIELD_INT, (long long)(value), NULL})
+#define LOG_STR(key, value) ((log_field_t){(key), LOG_FIELD_STRING, 0, (const char *)(value)})
+
+// Records below the threshold cost one relaxed load; the rest copy their fields into a ring slot and
+// return. Formatting and I/O happen on the writer thread, and a full ring drops the record and counts it.
+#define LOG(level, event, ...) do { \
+    if((level) >= atomic_load_explicit(&log_threshold, memory_order_relaxed)) \
+        log_write((level), (event), (const log_field_t[]){__VA_ARGS__}, \
+            sizeof((const log_field_t[]){__VA_ARGS__}) / sizeof(log_field_t)); \
+} while(0)
+
+#define LOG_DEBUG(event, ...) LOG(LOG_LEVEL_DEBUG, event, __VA_ARGS__)
+#define LOG_INFO(event, ...) LOG(LOG_LEVEL_INFO, event, __VA_ARGS__)
+#define LOG_WARN(event, ...) LOG(LOG_LEVEL_WARN, event, __VA_ARGS__)
+#define LOG_ERROR(event, ...) LOG(LOG_LEVEL_ERROR, event, __VA_ARGS__)
+
+extern atomic_int log_threshold;
+
+
+
+bool log_parse_level(const char *name, enum log_level *level);
+void log_set_level(enum log_level level);
+bool log_start(void);
+void log_write(enum log_level level, const char *event, const log_field_t *fields, size_t field_count);
+void log_stop(void);
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Intrusive multi-producer, single-consumer queue; any thread may push, only the owning worker pops
+typedef struct mailbox_node {
+    struct mailbox_node *_Atomic next;
+} mailbox_node_t;
+
+typedef struct {
+    mailbox_node_t *_Atomic head; // Most recently pushed node; producers swap themselves in here
+    mailbox_node_t *tail;         // Next node to pop; only touched by the consumer
+    mailbox_node_t stub;
+    atomic_bool signalled;        // Set while wake_fd has an unconsumed wakeup
+    int wake_fd;                  // eventfd the consumer polls for new mail
+} mailbox_t;
+
+
+
+bool mailbox_init(mailbox_t *mailbox);
+void mailbox_push(mailbox_t *mailbox, mailbox_node_t *node);
+mailbox_node_t *mailbox_pop(mailbox_t *mailbox);
+void mailbox_wake(mailbox_t *mailbox);
+void mailbox_acknowledge(mailbox_t *mailbox);
+void mailbox_destroy(mailbox_t *mailbox);
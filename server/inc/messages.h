@@ -1,3 +1,17 @@
-#pragma once
-
-unsigned char *allocate_sanitized_message(unsigned char *input_message);
\ No newline at end of file
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SANITIZE_UTF8 0x1 // Keep well-formed UTF-8 instead of stripping every byte outside printable ASCII
+
+enum sanitize_kernel {
+    SANITIZE_SCALAR,
+    SANITIZE_SSE2,
+    SANITIZE_AVX2
+};
+
+
+
+size_t sanitize_message(unsigned char *output, const unsigned char *input, size_t input_length, unsigned int flags);
+bool sanitize_use_kernel(enum sanitize_kernel kernel);
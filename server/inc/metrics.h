@@ -0,0 +1,89 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "event.h"
+
+#define HISTOGRAM_SUB_BITS 3       // Each power of two is split into 8 buckets, so bounds are within 12.5%
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 40      // Values are clamped just under 2^40 ns, about 18 minutes
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+#define METRICS_EVENT_CODES (MAX + 2) // Every event_code, plus one slot for codes out of range
+
+enum metrics_stage {
+    METRICS_STAGE_RECEIVE = 0, // One read from a client's socket
+    METRICS_STAGE_SANITIZE,    // Cleaning one message
+    METRICS_STAGE_RELAY,       // Queueing one event for this worker's room members and handing it to the others
+    METRICS_STAGE_SEND,        // One flush of a client's queue
+    METRICS_STAGE_DELIVERY,    // From reading a message to the end of its write to one receiver, on any worker
+    METRICS_STAGE_COUNT
+};
+
+// Log-linear buckets in the style of HdrHistogram: exact below 8, then 8 per power of two
+typedef struct {
+    atomic_ulong counts[HISTOGRAM_BUCKETS];
+    atomic_ulong count;
+    atomic_ulong sum;
+    atomic_ulong max;
+} histogram_t;
+
+// One per worker. Only the owning worker writes, so updates are plain relaxed loads and stores with no locked
+// instructions; the stats thread reads them whenever it is asked, without stopping anyone.
+typedef struct {
+    atomic_ulong accepted;
+    atomic_ulong disconnected;
+    atomic_ulong evicted;
+    atomic_ulong timed_out;
+    atomic_ulong throttled;
+    atomic_ulong bytes_received;
+    atomic_ulong events_received[METRICS_EVENT_CODES];
+    atomic_ulong events_relayed[METRICS_EVENT_CODES];
+    atomic_ulong events_sent;      // Copied from the worker's write stats once per loop
+    atomic_ulong write_syscalls;
+    atomic_ulong bytes_sent;
+    atomic_ulong connections;      // Gauges, also refreshed once per loop
+    atomic_ulong queued_bytes;
+    histogram_t stages[METRICS_STAGE_COUNT];
+} metrics_t;
+
+typedef struct {
+    char *path;
+    int fd;
+    metrics_t *const *sources;
+    unsigned int source_count;
+    atomic_bool stopping;
+    pthread_t thread;
+} metrics_server_t;
+
+
+
+static inline void metrics_add(atomic_ulong *counter, unsigned long amount)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+};
+
+
+
+static inline void metrics_set(atomic_ulong *gauge, unsigned long value)
+{
+    atomic_store_explicit(gauge, value, memory_order_relaxed);
+};
+
+
+
+static inline unsigned int metrics_event_slot(int code)
+{
+    return code >= 0 && code <= MAX ? (unsigned int)code : MAX + 1;
+};
+
+
+
+uint64_t metrics_now(void);
+void metrics_init(metrics_t *metrics);
+void histogram_record(histogram_t *histogram, uint64_t value);
+void metrics_record_since(metrics_t *metrics, enum metrics_stage stage, uint64_t start_ns);
+metrics_server_t *metrics_serve(const char *path, metrics_t *const *sources, unsigned int source_count);
+void metrics_server_stop(metrics_server_t *server);
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "metrics.h"
+#include "packet.h"
+
+#define OUTBOUND_IOVECS 64 // Packets gathered into a single writev
+
+enum outbound_result {
+    OUTBOUND_DRAINED = 0, // Everything queued has been written
+    OUTBOUND_BLOCKED,     // The socket is full; wait for it to become writable again
+    OUTBOUND_ERROR        // The socket failed; the connection should be dropped
+};
+
+
+
+typedef struct {
+    packet_t *packet;            // Holds one reference until fully written
+    size_t offset;               // Bytes of the packet already written to the socket
+} outbound_entry_t;
+
+typedef struct {
+    unsigned long syscalls;      // Writes that sent something; with io_uring, completed sends
+    unsigned long events;        // Packets completed
+    unsigned long bytes;
+} outbound_stats_t;
+
+// Ring of packet references; only allocated once something has to wait
+typedef struct {
+    outbound_entry_t *entries;
+    size_t capacity;             // Always zero or a power of two
+    size_t head;
+    size_t count;
+    size_t bytes;                // Bytes queued but not yet written
+} outbound_t;
+
+
+
+bool outbound_push(outbound_t *outbound, packet_t *packet);
+size_t outbound_gather(const outbound_t *outbound, struct iovec *iovecs, packet_t **packets);
+void outbound_consume(outbound_t *outbound, size_t sent, outbound_stats_t *stats, histogram_t *delivery);
+enum outbound_result outbound_flush(outbound_t *outbound, int fd, outbound_stats_t *stats, histogram_t *delivery);
+void outbound_free(outbound_t *outbound);
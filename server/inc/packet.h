@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "event.h"
+#include "wire.h"
+
+#define PACKET_RAW 0 // Sent to every client unchanged, whatever protocol version it speaks
+#define PACKET_DEFLATE_LEVEL 6
+#define DEFAULT_DEFLATE_BYTES 512 // Smaller frames, a chat line or two, barely shrink and are sent as they are
+
+// An encoded frame exactly as it goes on the wire; immutable once built and shared by every queue it is pushed to.
+// Events are built in the legacy event_t layout; the v2 encoding is made the first time a v2 client needs it
+// and kept alongside, so it is also only ever encoded once. A v2 packet keeps its deflate frame the same way.
+typedef struct packet {
+    atomic_uint references;
+    unsigned char version;       // WIRE_VERSION_LEGACY, WIRE_VERSION or PACKET_RAW
+    atomic_bool incompressible;  // Deflating it saved nothing, so it is not tried again
+    struct packet *_Atomic variant; // The v2 encoding of a legacy packet, or the deflate frame of a v2 one
+    uint64_t received_ns;        // When the message it carries was read from its sender, 0 if it was not timed
+    size_t length;
+    _Alignas(event_t) unsigned char data[];
+} packet_t;
+
+
+
+packet_t *packet_create(size_t length);
+packet_t *packet_create_raw(const void *data, size_t length);
+packet_t *packet_create_event(enum event_code code, int originator_id, const void *content, size_t content_length);
+packet_t *packet_for_version(packet_t *packet, unsigned char version);
+packet_t *packet_deflated(packet_t *packet, size_t min_length);
+void packet_thread_exit(void);
+packet_t *packet_make_writable(packet_t *packet, size_t capacity);
+packet_t *packet_retain(packet_t *packet);
+void packet_release(packet_t *packet);
+
+static inline event_t *packet_event(packet_t *packet)
+{
+    return (event_t *)packet->data;
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define POOL_CLASS_COUNT 4
+#define POOL_SLAB_SIZE (64 * 1024)
+
+// Block sizes include the pool header; the largest fits a full event_t frame of MAX_CONTENT_LENGTH
+// plus the username decoration added when it is relayed
+static const size_t pool_class_sizes[POOL_CLASS_COUNT] = {64, 256, 1280, 2560};
+
+typedef struct pool_block {
+    struct pool_block *next;
+} pool_block_t;
+
+typedef struct {
+    atomic_ulong hits[POOL_CLASS_COUNT];   // Served from a free list
+    atomic_ulong misses[POOL_CLASS_COUNT]; // Needed a new slab
+    atomic_ulong large;                    // Too big for any class, went to malloc
+} pool_stats_t;
+
+// One per thread; blocks freed by another thread go back to their owner through remote_free
+typedef struct pool {
+    pool_block_t *free[POOL_CLASS_COUNT];
+    pool_block_t *_Atomic remote_free[POOL_CLASS_COUNT];
+    void **slabs;
+    size_t slab_count;
+    size_t slab_size;
+    pool_stats_t stats;
+    struct pool *next_pool;
+} pool_t;
+
+
+
+void *pool_alloc(size_t size);
+void pool_free(void *block);
+pool_t *pool_for_thread(void);
+void pool_print_stats(const pool_t *pool, const char *name);
+void pool_destroy_all(void);
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "event.h"
+#include "wire.h"
+
+#define MAX_CONTENT_LENGTH 1024
+#define RECEIVE_BUFFER_SIZE 65536
+
+_Static_assert(sizeof(event_t) <= WIRE_MAX_HEADER, "legacy headers must fit the header buffer");
+
+enum reader_state {
+    READER_HEADER = 0, // Collecting a header; a legacy event_t or a v2 frame header
+    READER_CONTENT,    // Collecting header.content_length bytes of content
+    READER_DISCARD     // Skipping the content of an oversized event
+};
+
+enum reader_result {
+    READER_NEED_MORE = 0, // All input was consumed without completing a frame
+    READER_FRAME,         // A complete frame was written out
+    READER_OVERSIZED,     // The header announced too much content; it is being skipped
+    READER_SKIPPED,       // The last of an oversized event's content was skipped; nothing to handle
+    READER_HELLO,         // The client asked for protocol v2; version and flags are set
+    READER_MALFORMED,     // The stream cannot be parsed any further
+    READER_ERROR          // Unable to allocate space for a partial frame
+};
+
+
+
+typedef struct {
+    enum reader_state state;
+    unsigned char version;       // 0 until the first byte decides between WIRE_VERSION_LEGACY and WIRE_VERSION
+    unsigned char flags;         // From the client's hello, less any the server declined
+    event_t header;
+    size_t remaining;            // Bytes still to collect (or skip) in the current state
+    size_t batch_remaining;      // Bytes of the current batch frame still to come, 0 outside a batch
+
+    unsigned char header_bytes[WIRE_MAX_HEADER];
+    size_t header_length;
+    unsigned char *partial;      // Content carried between reads; only allocated when a frame is split
+    size_t partial_length;
+} reader_t;
+
+
+
+// frame must have room for MAX_CONTENT_LENGTH + 1 content bytes; content is always NUL terminated
+enum reader_result reader_next(reader_t *reader, const unsigned char **input, size_t *input_length, event_t *frame);
+bool reader_peek_code(const reader_t *reader, const unsigned char *input, size_t input_length, enum event_code *code);
+void reader_free(reader_t *reader);
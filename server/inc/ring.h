@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// A minimal io_uring, spoken through the raw syscalls: multishot accept, multishot receive into a ring of
+// provided buffers, non-blocking sendmsg, poll and cancel. Everything queued goes to the kernel in the single
+// io_uring_enter that also waits for completions, once per loop. Only the thread that calls ring_init may
+// use the ring. Built without <linux/io_uring.h>, ring_init always fails with ENOSYS.
+#define RING_ENTRIES 1024         // Submission slots; the completion queue gets four times as many
+#define RING_BUFFER_COUNT 128     // Receive buffers shared by every connection on the ring; a power of two
+#define RING_BUFFER_SIZE 16384
+
+typedef struct {
+    uint64_t user_data;
+    int result;                  // What the syscall would have returned, or -errno
+    bool more;                   // A multishot request is still armed and will complete again
+    bool has_buffer;
+    unsigned short buffer;       // The provided buffer holding the data, when has_buffer; give it back with ring_recycle
+} ring_completion_t;
+
+// The kernel's own structures are only named in ring.c
+typedef struct {
+    int fd;
+    unsigned int sq_entries;
+    unsigned int sq_mask;
+    unsigned int sq_tail;        // Ours; published to the kernel as each entry is filled in
+    unsigned int *sq_head_shared;
+    unsigned int *sq_tail_shared;
+    void *sqes;
+    unsigned int cq_mask;
+    unsigned int *cq_head_shared;
+    unsigned int *cq_tail_shared;
+    void *cqes;
+    void *rings;
+    size_t rings_size;
+    size_t sqes_size;
+
+    void *buffer_ring;
+    size_t buffer_ring_size;
+    unsigned char *buffers;
+    unsigned short buffer_tail;
+} ring_t;
+
+
+
+bool ring_init(ring_t *ring, unsigned int entries);
+bool ring_accept(ring_t *ring, int fd, uint64_t user_data);
+bool ring_receive(ring_t *ring, int fd, uint64_t user_data);
+bool ring_sendmsg(ring_t *ring, int fd, const struct msghdr *message, uint64_t user_data);
+bool ring_poll(ring_t *ring, int fd, uint64_t user_data);
+bool ring_writable(ring_t *ring, int fd, uint64_t user_data);
+bool ring_cancel(ring_t *ring, uint64_t target, uint64_t user_data);
+bool ring_cancel_all(ring_t *ring, uint64_t user_data);
+bool ring_submit(ring_t *ring);
+int ring_wait(ring_t *ring, uint64_t timeout_ns);
+bool ring_next(ring_t *ring, ring_completion_t *completion);
+const unsigned char *ring_buffer(const ring_t *ring, unsigned short buffer);
+void ring_recycle(ring_t *ring, unsigned short buffer);
+void ring_destroy(ring_t *ring);
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bucket.h"
+#include "directory.h"
+#include "history.h"
+
+// One worker's users grouped by directory room, so relaying only ever touches the room's own members
+typedef struct {
+    uint32_t id;             // The directory room these members are in; stale once count is 0
+    unsigned char name[ROOM_NAME_LENGTH];
+    history_t *history;      // The directory room's, looked up once when the first local member joins
+    bucket_t bucket;         // Messages admitted into the room from this worker's members
+    unsigned int *members;   // Local user indices, in no particular order
+    size_t count;
+    size_t size;
+} room_t;
+
+typedef struct {
+    room_t *rooms;           // Indexed by ROOM_SLOT
+    size_t size;
+} rooms_t;
+
+
+
+bool rooms_init(rooms_t *rooms);
+const room_t *rooms_find(const rooms_t *rooms, uint32_t room);
+bucket_t *rooms_bucket(rooms_t *rooms, uint32_t room);
+bool rooms_add(rooms_t *rooms, uint32_t room, const unsigned char *name, history_t *history, unsigned int index, size_t *position);
+unsigned int rooms_remove(rooms_t *rooms, uint32_t room, size_t position);
+void rooms_destroy(rooms_t *rooms);
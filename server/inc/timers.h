@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Hierarchical timing wheel: level 0 has a slot per tick, each level above a slot per whole turn of the one
+// below, so arming and cancelling are O(1) whatever the deadline, and a timer is only touched again when the
+// level it waits in turns over to the slot holding it
+#define TIMER_TICK_NS 10000000ULL // 10ms; deadlines are rounded up to a tick, never fired early
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1u << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4      // 2^24 ticks, about 46 hours; anything further out waits in the last level
+
+// Intrusive; lives in whatever it times, which must not move while the timer is armed
+typedef struct wheel_timer {
+    struct wheel_timer *next;
+    struct wheel_timer **link;   // The pointer to this timer in its slot, NULL while disarmed
+    uint64_t expires;            // Tick it is due on
+    unsigned int owner;          // For the expiry handler to tell whose timer it is
+} wheel_timer_t;
+
+typedef struct {
+    wheel_timer_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t now;                // Last tick processed
+    size_t count;                // Timers armed
+} timer_wheel_t;
+
+typedef void (*timer_expired_t)(void *context, wheel_timer_t *timer);
+
+
+
+static inline bool timer_armed(const wheel_timer_t *timer)
+{
+    return timer->link != NULL;
+};
+
+
+
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now_ns);
+void timer_wheel_arm(timer_wheel_t *wheel, wheel_timer_t *timer, uint64_t deadline_ns);
+void timer_wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer);
+uint64_t timer_wheel_next(const timer_wheel_t *wheel);
+void timer_wheel_expire(timer_wheel_t *wheel, uint64_t now_ns, timer_expired_t expired, void *context);
@@ -1,23 +1,64 @@
-#pragma once
-
-#include <poll.h>
-#include <stddef.h>
-
-enum user_state {
-    USER_UNINITIALIZED = 0,
-    USER_CONNECTED,
-    USER_NO_USERNAME,
-    USER_ACTIVE
-};
-
-
-
-typedef struct {
-    unsigned char *username;
-    struct pollfd pollfd;
-    enum user_state state;
-} user_t;
-
-
-
-static const user_t blank_user = {.username = NULL, .pollfd = {.fd = -1, .events = 0, .revents = 0}, .state = USER_UNINITIALIZED};
\ No newline at end of file
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bucket.h"
+#include "directory.h"
+#include "outbound.h"
+#include "reader.h"
+#include "timers.h"
+
+#define MAX_USERNAME_LENGTH 32
+
+enum user_state {
+    USER_UNINITIALIZED = 0,
+    USER_CONNECTED,
+    USER_NO_USERNAME,
+    USER_ACTIVE
+};
+
+// Why a user is waiting to be reaped; only slow consumers count as evictions
+enum evict_reason {
+    EVICT_SLOW_CONSUMER = 0,    // Over the outbound cap
+    EVICT_SEND_FAILED,          // The peer is gone, usually reset
+    EVICT_NO_RESOURCES          // Something the connection needed could not be had
+};
+
+
+
+typedef struct {
+    unsigned char *username;
+    int fd;
+    enum user_state state;
+    reader_t reader;
+    outbound_t outbound;
+    bool evicting;
+    enum evict_reason evict_reason;
+    unsigned int next_evicted;
+    bool flush_pending;
+    unsigned int next_pending;
+    uint32_t room;              // ROOM_NONE until the username is set
+    size_t room_position;       // Where the user sits in the room's member list
+    unsigned int generation;    // Bumped each time the slot is freed, so stale ids and tags can be told apart
+    unsigned int next_free;
+    wheel_timer_t timer;        // The next deadline: protocol sniff, handshake or heartbeat
+    uint64_t connected_ns;
+    uint64_t heard_ns;          // When bytes last came in from the client
+    bool pinged;                // A heartbeat ping is out, unanswered since heard_ns
+    bucket_t bucket;            // Events admitted from the user
+    bool throttled;             // Out of credit; not read again until throttle_timer expires
+    wheel_timer_t throttle_timer;
+    uint64_t throttle_notified_ns;
+    unsigned char *held;        // Input read but not yet handled when the user was throttled
+    size_t held_length;
+    bool receiving;             // io_uring only: a multishot receive is armed
+    bool cancelling;            // And a cancel for it, because the user was throttled, is on its way
+    bool sending;               // io_uring only: a send is in flight; the next waits for it to complete
+    bool blocked;               // io_uring only: the socket was full and a poll for it to drain is armed
+} user_t;
+
+
+
+static const user_t blank_user = {.username = NULL, .fd = -1, .state = USER_UNINITIALIZED, .evicting = false, .room = ROOM_NONE};
\ No newline at end of file
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "connections.h"
+#include "directory.h"
+#include "event.h"
+#include "mailbox.h"
+#include "packet.h"
+
+#define MAX_WORKERS 64
+_Static_assert(MAX_WORKERS <= 64, "each worker needs a bit in a room's worker mask");
+#define MAILBOX_TAG UINT32_MAX // epoll tag for a worker's mailbox wakeup, never a valid user tag
+
+typedef struct {
+    mailbox_node_t node;
+    packet_t *packet;
+    uint32_t room;
+} relayed_packet_t;
+
+
+
+struct workers;
+
+typedef struct {
+    unsigned int index;
+    pthread_t thread;
+    int listener;
+    connections_t connections;
+    mailbox_t mailbox;
+    struct workers *workers;
+} worker_t;
+
+typedef struct workers {
+    worker_t *workers;
+    unsigned int count;
+    directory_t directory;
+    atomic_bool stopping;
+} workers_t;
+
+
+
+bool workers_init(workers_t *workers, unsigned int count, const int *listeners, const connections_config_t *config);
+bool workers_start(workers_t *workers, void *(*run)(void *worker));
+void workers_stop(workers_t *workers);
+void workers_deliver_mail(worker_t *worker);
+void workers_destroy(workers_t *workers);
@@ -1,210 +1,998 @@
-#include "connections.h"
-
-#include <poll.h>
-#include <stdbool.h>
-#include <stdio.h>
-#include <string.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <unistd.h>
-
-#include "event.h"
-#include "user.h"
-
-bool connections_update_fds(connections_t *connections)
-{
-    struct pollfd *fds = calloc(connections->size, sizeof(struct pollfd));
-    if(fds == NULL)
-    {
-        return false;
-    }
-
-    for(int i = 0; i < connections->size; i++)
-    {
-        fds[i] = connections->users[i].pollfd;
-    }
-
-    poll(fds, connections->size, 0);
-
-    for(int i = 0; i < connections->size; i++)
-    {
-        connections->users[i].pollfd = fds[i];
-    }
-
-    free(fds);
-
-    return true;
-};
-
-
-
-void connections_relay_event_from(const connections_t *connections, event_t *event, int sender)
-{
-    for(int reciever = 1; reciever < connections->size; reciever++)
-    {
-        if(connections->users[reciever].state > USER_NO_USERNAME && sender != reciever && connections->users[reciever].pollfd.revents & POLLOUT)
-        {
-            send(connections->users[reciever].pollfd.fd, event, event->content_length + sizeof(event_t), 0);
-        }
-    }
-};
-
-
-
-void connections_relay_message_from(const connections_t *connections, char *message, int sender)
-{
-    size_t decorated_message_length = strlen(connections->users[sender].username) + 3 + strlen(message);
-    event_t *message_event = malloc(sizeof(event_t) + decorated_message_length);
-    if(message_event == NULL)
-    {
-        fprintf(stderr, "Unable to send message\n");
-        return;
-    }
-
-    message_event->code = EVENT_MESSAGE;
-    message_event->originator_id = sender;
-    message_event->content_length = decorated_message_length;
-
-    strcpy(message_event->content, connections->users[sender].username);
-    strcat(message_event->content, ": ");
-    strcat(message_event->content, message);
-    message_event->content[decorated_message_length - 1] = '\0';
-
-    connections_relay_event_from(connections, message_event, sender);
-    free(message_event);
-};
-
-
-
-int connections_add_connection(connections_t *connections, int new_connection, size_t username_size)
-{
-    unsigned char connection_fail_message[] = "Server is unable to handle new connections at the moment.";
-    event_t *connection_fail_event = malloc(sizeof(event_t) + sizeof(connection_fail_message));
-    if(connection_fail_event != NULL)
-    {
-        connection_fail_event->code = EVENT_CONNECTION_FAILED;
-        connection_fail_event->originator_id = 0;
-        connection_fail_event->content_length = strlen(connection_fail_message);
-        strcpy(connection_fail_event->content, connection_fail_message);
-    }
-
-    if(connections->count >= connections->size)
-    {
-        size_t new_size = connections->size * GROW_FACTOR;
-        user_t *new_users = reallocarray(connections->users, new_size, sizeof(user_t));
-        if(new_users == NULL)
-        {
-            if(connection_fail_event != NULL)
-                send(new_connection, connection_fail_event, sizeof(event_t) + sizeof(connection_fail_message), 0);
-            close(new_connection);
-            free(connection_fail_event);
-            return 0;
-        }
-
-        for(int i = connections->size; i < new_size; i++)
-            new_users[i] = blank_user;
-
-        connections->users = new_users;
-        connections->size = new_size;
-    }
-
-    unsigned char *username = (unsigned char *)malloc(username_size);
-    if(username == NULL)
-    {
-        if(connection_fail_event != NULL)
-            send(new_connection, connection_fail_event, sizeof(event_t) + sizeof(connection_fail_message), 0);
-        close(new_connection);
-        free(connection_fail_event);
-        return 0;
-    }
-    free(connection_fail_event);
-
-    user_t new_user = {.username = username, .pollfd = {.fd = new_connection, .events = POLLIN | POLLOUT, .revents = 0}, .state = USER_CONNECTED};
-    int insert_position = -1;
-    size_t usernames_size = 0;
-    unsigned char *usernames = NULL;
-    bool user_list_failed = false;
-    for(int i = 1; i < connections->size; i++)
-    {
-        if(!user_list_failed && connections->users[i].state == USER_ACTIVE)
-        {
-            size_t next_username_size = strlen(connections->users[i].username) + 1;
-            unsigned char *new_usernames = realloc(usernames, usernames_size + next_username_size);
-            if(new_usernames == NULL)
-            {
-                free(usernames);
-                user_list_failed = true;
-                usernames = NULL;
-                continue;
-            }
-
-            usernames = new_usernames;
-            memcpy(&usernames[usernames_size], connections->users[i].username, next_username_size);
-            usernames_size += next_username_size;
-        }
-        if(insert_position < 0 && connections->users[i].state == USER_UNINITIALIZED)
-            insert_position = i;
-    }
-
-    event_t *user_list_event = malloc(sizeof(event_t) + usernames_size);
-    if(user_list_event != NULL && usernames != NULL)
-    {
-        user_list_event->code = EVENT_USER_LIST;
-        user_list_event->originator_id = 0;
-        user_list_event->content_length = usernames_size;
-        memcpy(user_list_event->content, usernames, usernames_size);
-
-        send(new_user.pollfd.fd, user_list_event, sizeof(event_t) + usernames_size, 0);
-    }
-    free(user_list_event);
-
-    connections->users[insert_position] = new_user;
-    connections->count++;
-
-    free(usernames);
-    return insert_position;
-};
-
-
-
-void connections_close_connection(connections_t *connections, unsigned int index)
-{
-    if(index < 1 || index > connections->size)
-        return;
-
-    close(connections->users[index].pollfd.fd);
-    free(connections->users[index].username);
-    connections->users[index] = blank_user;
-    connections->count--;
-};
-
-
-
-void connections_shutdown(connections_t *connections)
-{
-    unsigned char shutdown_message[] = "Server is shutting down";
-    size_t shutdown_event_size = sizeof(event_t) + sizeof(shutdown_message);
-    event_t *shutdown_event = (event_t *)malloc(shutdown_event_size);
-
-    if(shutdown_event != NULL)
-    {
-        shutdown_event->code = EVENT_SERVER_SHUTDOWN;
-        shutdown_event->originator_id = 0;
-        shutdown_event->content_length = sizeof(shutdown_message);
-        strcpy(shutdown_event->content, shutdown_message);
-    }
-
-    for(int i = 1; i < connections->size; i++)
-    {
-        if(connections->users[i].state > USER_UNINITIALIZED)
-        {
-            if(shutdown_event != NULL)
-                send(connections->users[i].pollfd.fd, shutdown_event, shutdown_event_size, 0);
-
-            connections_close_connection(connections, i);
-        }
-    }
-
-    free(connections->users);
-    free(shutdown_event);
+#include "connections.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "log.h"
+#include "outbound.h"
+#include "pool.h"
+#include "ring.h"
+#include "user.h"
+
+// A send on the ring, with everything the kernel reads until it completes. It holds its own references to the
+// packets, so it can outlive the user it was for.
+typedef struct {
+    struct msghdr message;
+    struct iovec iovecs[OUTBOUND_IOVECS];
+    packet_t *packets[OUTBOUND_IOVECS];
+    size_t count;
+    uint32_t tag;
+} ring_send_t;
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+};
+
+
+
+// Removes index from an intrusive list threaded through the users by the field at link_offset
+static void connections_unlink(connections_t *connections, unsigned int *head, unsigned int index, size_t link_offset)
+{
+    unsigned int *link = head;
+    while(*link != 0 && *link != index)
+        link = (unsigned int *)((unsigned char *)connections_user(connections, *link) + link_offset);
+    if(*link == index)
+        *link = *(unsigned int *)((unsigned char *)connections_user(connections, index) + link_offset);
+};
+
+
+
+static void connections_push_free(connections_t *connections, unsigned int index)
+{
+    connections_user(connections, index)->next_free = 0;
+    if(connections->free_tail != 0)
+        connections_user(connections, connections->free_tail)->next_free = index;
+    else
+        connections->free_head = index;
+    connections->free_tail = index;
+};
+
+
+
+// Adds a page of blank users to the free list; earlier pages stay where they are
+static bool connections_add_page(connections_t *connections)
+{
+    unsigned long last_id = (unsigned long)(connections->size + USERS_PER_PAGE - 1) * connections->id_stride + connections->id_base;
+    if(last_id > CONNECTION_SLOT_MASK)
+        return false;
+
+    user_t **new_pages = reallocarray(connections->user_pages, connections->page_count + 1, sizeof(user_t *));
+    if(new_pages == NULL)
+        return false;
+    connections->user_pages = new_pages;
+
+    user_t *page = malloc(USERS_PER_PAGE * sizeof(user_t));
+    if(page == NULL)
+        return false;
+
+    for(size_t i = 0; i < USERS_PER_PAGE; i++)
+        page[i] = blank_user;
+    connections->user_pages[connections->page_count++] = page;
+
+    unsigned int first = connections->size == 0 ? 1 : connections->size;
+    connections->size += USERS_PER_PAGE;
+    for(unsigned int i = first; i < connections->size; i++)
+        connections_push_free(connections, i);
+
+    return true;
+};
+
+
+
+static void connections_free_pages(connections_t *connections)
+{
+    for(size_t i = 0; i < connections->page_count; i++)
+        free(connections->user_pages[i]);
+
+    free(connections->user_pages);
+};
+
+
+
+bool connections_init(connections_t *connections, int master_socket, const connections_config_t *config, directory_t *directory)
+{
+    connections->count = 1;
+    connections->size = 0;
+    connections->user_pages = NULL;
+    connections->page_count = 0;
+    connections->free_head = 0;
+    connections->free_tail = 0;
+    connections->id_base = 0;
+    connections->id_stride = 1;
+    connections->worker = 0;
+    if(!connections_add_page(connections))
+    {
+        connections_free_pages(connections);
+        return false;
+    }
+
+    if(!rooms_init(&connections->rooms))
+    {
+        connections_free_pages(connections);
+        return false;
+    }
+
+    connections->epoll_fd = epoll_create1(0);
+    if(connections->epoll_fd < 0)
+    {
+        rooms_destroy(&connections->rooms);
+        connections_free_pages(connections);
+        return false;
+    }
+
+    struct epoll_event master_event = {.events = EPOLLIN | EPOLLET, .data.u32 = 0};
+    if(epoll_ctl(connections->epoll_fd, EPOLL_CTL_ADD, master_socket, &master_event) < 0)
+    {
+        close(connections->epoll_fd);
+        rooms_destroy(&connections->rooms);
+        connections_free_pages(connections);
+        return false;
+    }
+
+    connections_user(connections, 0)->username = "Server";
+    connections_user(connections, 0)->fd = master_socket;
+    connections_user(connections, 0)->state = USER_ACTIVE;
+    connections_user(connections, 0)->room = ROOM_NONE;
+    connections->evicted = 0;
+    connections->pending = 0;
+    connections->flush_deadline = 0;
+    connections->write_stats = (outbound_stats_t){0};
+    connections->queued_bytes = 0;
+    metrics_init(&connections->metrics);
+    timer_wheel_init(&connections->timers, monotonic_ns());
+    connections->config = *config;
+    connections->directory = directory;
+    connections->journal = NULL;
+    connections->broadcast = NULL;
+    connections->broadcast_context = NULL;
+    connections->ring = NULL;
+    connections->sends_in_flight = 0;
+
+    return true;
+};
+
+
+
+// Moves accepts, receives and sends from epoll to io_uring. Called on the worker's own thread, before any
+// client connects; watched fds must be watched again afterwards. False, with errno set, leaves epoll in charge.
+bool connections_use_ring(connections_t *connections)
+{
+    ring_t *ring = malloc(sizeof(ring_t));
+    if(ring == NULL)
+        return false;
+
+    if(!ring_init(ring, RING_ENTRIES))
+    {
+        free(ring);
+        return false;
+    }
+
+    connections->ring = ring;
+    if(!connections_accept(connections))
+    {
+        ring_destroy(ring);
+        free(ring);
+        connections->ring = NULL;
+        return false;
+    }
+    return true;
+};
+
+
+
+// Arms the multishot accept on the listener; again whenever it ends
+bool connections_accept(connections_t *connections)
+{
+    return ring_accept(connections->ring, connections_user(connections, 0)->fd, RING_DATA(RING_OP_ACCEPT, 0));
+};
+
+
+
+// With io_uring, a multishot poll that has to be watched again when it completes without more to come
+bool connections_watch(connections_t *connections, int fd, uint32_t tag)
+{
+    if(connections->ring != NULL)
+        return ring_poll(connections->ring, fd, RING_DATA(RING_OP_WATCH, tag));
+
+    struct epoll_event watch_event = {.events = EPOLLIN | EPOLLET, .data.u32 = tag};
+    return epoll_ctl(connections->epoll_fd, EPOLL_CTL_ADD, fd, &watch_event) == 0;
+};
+
+
+
+// Ids handed to clients are unique across workers; with a single worker they are just the slot index
+int connections_client_id(const connections_t *connections, unsigned int index)
+{
+    unsigned int generation = connections_user(connections, index)->generation;
+    return (int)((generation << CONNECTION_SLOT_BITS) | (index * connections->id_stride + connections->id_base));
+};
+
+
+
+static uint32_t connections_tag(const connections_t *connections, unsigned int index)
+{
+    return (connections_user(connections, index)->generation << CONNECTION_SLOT_BITS) | index;
+};
+
+
+
+// Maps an epoll tag back to its user; 0 for a connection closed earlier in the same batch of events,
+// even if its slot has already been handed to someone new
+unsigned int connections_index_for_tag(const connections_t *connections, uint32_t tag)
+{
+    unsigned int index = tag & CONNECTION_SLOT_MASK;
+    if(index == 0 || index >= connections->size)
+        return 0;
+
+    const user_t *user = connections_user(connections, index);
+    if(user->state == USER_UNINITIALIZED || user->generation != tag >> CONNECTION_SLOT_BITS)
+        return 0;
+
+    return index;
+};
+
+
+
+// Sleeps until something is ready, the pending flush is due, or the next timer is. Returns the number of
+// entries filled in connections->ready, or with io_uring the completions waiting for ring_next.
+int connections_wait(connections_t *connections)
+{
+    uint64_t deadline = timer_wheel_next(&connections->timers);
+    if(connections->pending != 0 && connections->flush_deadline < deadline)
+        deadline = connections->flush_deadline;
+
+    uint64_t wait_ns = UINT64_MAX;
+    if(deadline != UINT64_MAX)
+    {
+        uint64_t now = monotonic_ns();
+        wait_ns = now >= deadline ? 0 : deadline - now;
+    }
+
+    if(connections->ring != NULL)
+        return ring_wait(connections->ring, wait_ns);
+
+    int timeout = wait_ns == UINT64_MAX ? -1 : (wait_ns + 999999) / 1000000;
+    return epoll_wait(connections->epoll_fd, connections->ready, MAX_READY_EVENTS, timeout);
+};
+
+
+
+// timer is one of the user's own, moved rather than added to; the caller handles it when it expires
+void connections_arm_timer(connections_t *connections, unsigned int index, wheel_timer_t *timer, uint64_t deadline_ns)
+{
+    timer->owner = index;
+    timer_wheel_arm(&connections->timers, timer, deadline_ns);
+};
+
+
+
+// Puts the user on the list connections_flush_pending works through
+static void connections_mark_pending(connections_t *connections, unsigned int index)
+{
+    user_t *user = connections_user(connections, index);
+    if(user->flush_pending || user->outbound.bytes == 0)
+        return;
+
+    if(connections->pending == 0)
+        connections->flush_deadline = monotonic_ns() + (uint64_t)connections->config.flush_delay_us * 1000;
+
+    user->flush_pending = true;
+    user->next_pending = connections->pending;
+    connections->pending = index;
+};
+
+
+
+// Queues the packet for the user; it is written by connections_flush_pending along with everything else
+// queued for them this loop, unless the queue has reached flush_bytes. A user whose queue is still over
+// the cap after a flush attempt is marked for eviction.
+void connections_send(connections_t *connections, unsigned int index, packet_t *packet)
+{
+    user_t *user = connections_user(connections, index);
+    if(user->evicting)
+        return;
+
+    packet_t *encoded = packet_for_version(packet, user->reader.version);
+    if(encoded != NULL && (user->reader.flags & WIRE_FLAG_DEFLATE))
+        encoded = packet_deflated(encoded, connections->config.deflate_bytes);
+    if(encoded == NULL || !outbound_push(&user->outbound, encoded))
+    {
+        connections_evict(connections, index, EVICT_NO_RESOURCES);
+        return;
+    }
+    connections->queued_bytes += encoded->length;
+
+    if(user->outbound.bytes >= connections->config.flush_bytes)
+        connections_flush(connections, index);
+
+    if(user->outbound.bytes > connections->config.outbound_cap)
+    {
+        connections_evict(connections, index, EVICT_SLOW_CONSUMER);
+        return;
+    }
+
+    connections_mark_pending(connections, index);
+};
+
+
+
+// Puts the head of the user's queue on the ring as one sendmsg; only one is in flight per user, so what is
+// queued behind it waits for it to complete
+static void connections_ring_send(connections_t *connections, unsigned int index)
+{
+    user_t *user = connections_user(connections, index);
+    if(user->sending || user->blocked || user->evicting || user->outbound.count == 0)
+        return;
+
+    ring_send_t *send = pool_alloc(sizeof(ring_send_t));
+    if(send == NULL)
+    {
+        connections_evict(connections, index, EVICT_NO_RESOURCES);
+        return;
+    }
+
+    send->count = outbound_gather(&user->outbound, send->iovecs, send->packets);
+    for(size_t i = 0; i < send->count; i++)
+        packet_retain(send->packets[i]);
+    send->message = (struct msghdr){.msg_iov = send->iovecs, .msg_iovlen = send->count};
+    send->tag = connections_tag(connections, index);
+
+    if(!ring_sendmsg(connections->ring, user->fd, &send->message, (uintptr_t)send | RING_OP_SEND))
+    {
+        for(size_t i = 0; i < send->count; i++)
+            packet_release(send->packets[i]);
+        pool_free(send);
+        connections_evict(connections, index, EVICT_NO_RESOURCES);
+        return;
+    }
+
+    user->sending = true;
+    connections->sends_in_flight++;
+};
+
+
+
+// Like EPOLLOUT: once the socket drains, the queue goes on the ring again. Until then connections_flush
+// may still write to it directly, since nothing of the user's is in flight.
+static void connections_wait_writable(connections_t *connections, unsigned int index)
+{
+    user_t *user = connections_user(connections, index);
+    if(user->blocked)
+        return;
+
+    if(!ring_writable(connections->ring, user->fd, RING_DATA(RING_OP_WRITABLE, connections_tag(connections, index))))
+    {
+        connections_evict(connections, index, EVICT_NO_RESOURCES);
+        return;
+    }
+    user->blocked = true;
+};
+
+
+
+// Whatever the send took comes off the user's queue, if the user is still there; resend says whether the
+// rest may go. It goes with the loop's other sends rather than at once: a send on the ring keeps
+// connections_flush from writing, which the rest of the completions may need it to.
+static void connections_finish_send(connections_t *connections, uint64_t user_data, int result, bool resend)
+{
+    ring_send_t *send = (ring_send_t *)(uintptr_t)(user_data & ~(uint64_t)RING_OP_MASK);
+    connections->sends_in_flight--;
+
+    unsigned int index = connections_index_for_tag(connections, send->tag);
+    if(index != 0)
+    {
+        user_t *user = connections_user(connections, index);
+        user->sending = false;
+        if(result > 0)
+        {
+            size_t queued = user->outbound.bytes;
+            outbound_consume(&user->outbound, result, &connections->write_stats,
+                &connections->metrics.stages[METRICS_STAGE_DELIVERY]);
+            connections->queued_bytes -= queued - user->outbound.bytes;
+        }
+
+        if(result < 0 && result != -EAGAIN && result != -EINTR && result != -ECANCELED)
+            connections_evict(connections, index, EVICT_SEND_FAILED);
+        else if(resend && result == -EAGAIN)
+            connections_wait_writable(connections, index);
+        else if(resend && result != -ECANCELED)
+            connections_mark_pending(connections, index);
+    }
+
+    for(size_t i = 0; i < send->count; i++)
+        packet_release(send->packets[i]);
+    pool_free(send);
+};
+
+
+
+void connections_complete_send(connections_t *connections, uint64_t user_data, int result)
+{
+    connections_finish_send(connections, user_data, result, true);
+};
+
+
+
+void connections_writable(connections_t *connections, unsigned int index)
+{
+    connections_user(connections, index)->blocked = false;
+    connections_ring_send(connections, index);
+};
+
+
+
+// Arms the user's multishot receive, unless it is still armed or the user may not be read right now
+void connections_receive(connections_t *connections, unsigned int index)
+{
+    user_t *user = connections_user(connections, index);
+    if(connections->ring == NULL || user->receiving || user->throttled || user->evicting || user->state == USER_UNINITIALIZED)
+        return;
+
+    if(!ring_receive(connections->ring, user->fd, RING_DATA(RING_OP_RECEIVE, connections_tag(connections, index))))
+    {
+        LOG_ERROR("receive_failed", LOG_INT("client", connections_client_id(connections, index)));
+        connections_evict(connections, index, EVICT_NO_RESOURCES);
+        return;
+    }
+    user->receiving = true;
+};
+
+
+
+// A throttled user's bytes should wait in the kernel, as they do with epoll, so their receive is cancelled;
+// whatever it delivers before the cancel lands is held
+void connections_pause_receive(connections_t *connections, unsigned int index)
+{
+    user_t *user = connections_user(connections, index);
+    if(connections->ring == NULL || !user->receiving || user->cancelling)
+        return;
+
+    uint32_t tag = connections_tag(connections, index);
+    if(ring_cancel(connections->ring, RING_DATA(RING_OP_RECEIVE, tag), RING_DATA(RING_OP_CANCEL, tag)))
+        user->cancelling = true;
+};
+
+
+
+// Cancels everything on the ring and waits, up to RING_DRAIN_MS, for the sends in flight to give back their
+// packets; the connections are then left to be closed the epoll way
+static void connections_stop_ring(connections_t *connections)
+{
+    ring_t *ring = connections->ring;
+    ring_cancel_all(ring, RING_DATA(RING_OP_CANCEL, 0));
+
+    uint64_t give_up = monotonic_ns() + (uint64_t)RING_DRAIN_MS * 1000000;
+    uint64_t wait_ns = 0;
+    ring_completion_t completion;
+    do
+    {
+        ring_wait(ring, wait_ns);
+        while(ring_next(ring, &completion))
+        {
+            if(RING_DATA_OP(completion.user_data) == RING_OP_SEND)
+                connections_finish_send(connections, completion.user_data, completion.result, false);
+            else if(completion.has_buffer)
+                ring_recycle(ring, completion.buffer);
+        }
+        wait_ns = 10000000;
+    } while(connections->sends_in_flight > 0 && monotonic_ns() < give_up);
+
+    ring_destroy(ring);
+    free(ring);
+    connections->ring = NULL;
+};
+
+
+
+// Writes the user's queue now. With io_uring this is for a queue that reached flush_bytes: a send on the
+// ring would only go at the next wait, by which time the rest of the batch may have pushed the queue past
+// the cap, so it is written directly unless a send is already in flight.
+void connections_flush(connections_t *connections, unsigned int index)
+{
+    user_t *user = connections_user(connections, index);
+    if(user->evicting)
+        return;
+
+    if(user->outbound.count == 0 || user->sending)
+        return;
+
+    uint64_t start = metrics_now();
+    size_t queued = user->outbound.bytes;
+    enum outbound_result result = outbound_flush(&user->outbound, user->fd, &connections->write_stats,
+        &connections->metrics.stages[METRICS_STAGE_DELIVERY]);
+    connections->queued_bytes -= queued - user->outbound.bytes;
+    metrics_record_since(&connections->metrics, METRICS_STAGE_SEND, start);
+
+    if(result == OUTBOUND_ERROR)
+        connections_evict(connections, index, EVICT_SEND_FAILED);
+    else if(result == OUTBOUND_BLOCKED && connections->ring != NULL)
+        connections_wait_writable(connections, index);
+};
+
+
+
+// Called once per loop; writes every queue that has waited long enough, one writev per user where possible,
+// or with io_uring queues one send per user to go in the loop's single io_uring_enter
+void connections_flush_pending(connections_t *connections)
+{
+    if(connections->pending == 0 || monotonic_ns() < connections->flush_deadline)
+        return;
+
+    while(connections->pending != 0)
+    {
+        unsigned int index = connections->pending;
+        connections->pending = connections_user(connections, index)->next_pending;
+        connections_user(connections, index)->flush_pending = false;
+
+        if(connections->ring != NULL)
+            connections_ring_send(connections, index);
+        else
+            connections_flush(connections, index);
+    }
+};
+
+
+
+void connections_print_write_stats(const connections_t *connections, const char *name)
+{
+    const outbound_stats_t *stats = &connections->write_stats;
+    LOG_INFO("write_stats", LOG_STR("worker", name), LOG_INT("events", stats->events),
+        LOG_INT("syscalls", stats->syscalls), LOG_INT("bytes", stats->bytes));
+};
+
+
+
+// Called once per loop, so the stats thread sees totals and gauges at most one loop old
+void connections_publish_metrics(connections_t *connections)
+{
+    metrics_t *metrics = &connections->metrics;
+    metrics_set(&metrics->events_sent, connections->write_stats.events);
+    metrics_set(&metrics->write_syscalls, connections->write_stats.syscalls);
+    metrics_set(&metrics->bytes_sent, connections->write_stats.bytes);
+    metrics_set(&metrics->connections, connections->count - 1);
+    metrics_set(&metrics->queued_bytes, connections->queued_bytes);
+};
+
+
+
+// Eviction is deferred to connections_reap so relaying never closes a connection out from under its caller
+void connections_evict(connections_t *connections, unsigned int index, enum evict_reason reason)
+{
+    user_t *user = connections_user(connections, index);
+    if(user->evicting || user->state == USER_UNINITIALIZED)
+        return;
+
+    user->evicting = true;
+    user->evict_reason = reason;
+    user->next_evicted = connections->evicted;
+    connections->evicted = index;
+};
+
+
+
+// Only slow consumers are evictions; a peer that went away is an ordinary disconnect
+void connections_reap(connections_t *connections)
+{
+    while(connections->evicted != 0)
+    {
+        unsigned int index = connections->evicted;
+        user_t *user = connections_user(connections, index);
+        connections->evicted = user->next_evicted;
+        int id = connections_client_id(connections, index);
+
+        switch(user->evict_reason)
+        {
+            case EVICT_SLOW_CONSUMER:
+                metrics_add(&connections->metrics.evicted, 1);
+                LOG_WARN("client_evicted", LOG_INT("client", id), LOG_INT("queued_bytes", user->outbound.bytes));
+                break;
+
+            case EVICT_SEND_FAILED:
+                LOG_DEBUG("send_failed", LOG_INT("client", id));
+                break;
+
+            case EVICT_NO_RESOURCES:
+                LOG_WARN("client_dropped", LOG_INT("client", id));
+                break;
+        }
+        connections_disconnect(connections, index);
+    }
+};
+
+
+
+// Delivers to this worker's members of the room only; sender is a local index, or 0 when the event came
+// from another worker. Sending never changes membership, since evictions wait for connections_reap.
+void connections_relay_local(connections_t *connections, packet_t *packet, uint32_t room, int sender)
+{
+    const room_t *members = rooms_find(&connections->rooms, room);
+    if(members == NULL)
+        return;
+
+    for(size_t i = 0; i < members->count; i++)
+    {
+        if(members->members[i] != sender)
+            connections_send(connections, members->members[i], packet);
+    }
+};
+
+
+
+// Goes to everyone in the sender's room. The packet is encoded once by the caller; every receiver,
+// on every worker, only takes a reference to it.
+void connections_relay_packet_from(connections_t *connections, packet_t *packet, int sender)
+{
+    uint64_t start = metrics_now();
+    uint32_t room = connections_user(connections, sender)->room;
+    connections_relay_local(connections, packet, room, sender);
+    if(connections->broadcast != NULL)
+        connections->broadcast(connections->broadcast_context, packet, room);
+    metrics_add(&connections->metrics.events_relayed[metrics_event_slot(packet_event(packet)->code)], 1);
+    metrics_record_since(&connections->metrics, METRICS_STAGE_RELAY, start);
+
+    if(connections->journal != NULL)
+    {
+        const room_t *members = rooms_find(&connections->rooms, room);
+        const unsigned char *name = members != NULL ? members->name : (const unsigned char *)"";
+        journal_append(connections->journal, packet_event(packet), name, strlen((const char *)name));
+    }
+};
+
+
+
+// received_ns is when the message was read, so its delivery to each receiver can be timed
+void connections_relay_message_from(connections_t *connections, char *message, int sender, uint64_t received_ns)
+{
+    size_t username_length = strlen(connections_user(connections, sender)->username);
+    size_t message_length = strlen(message);
+    size_t decorated_message_length = username_length + 3 + message_length;
+    // Built straight into the packet so the line is written exactly once, however many receive it
+    packet_t *message_packet = packet_create(sizeof(event_t) + decorated_message_length);
+    if(message_packet == NULL)
+    {
+        LOG_ERROR("relay_failed", LOG_INT("client", connections_client_id(connections, sender)));
+        return;
+    }
+
+    event_t *message_event = packet_event(message_packet);
+    message_event->code = EVENT_MESSAGE;
+    message_event->originator_id = connections_client_id(connections, sender);
+    message_event->content_length = decorated_message_length;
+    memcpy(message_event->content, connections_user(connections, sender)->username, username_length);
+    memcpy(&message_event->content[username_length], ": ", 2);
+    memcpy(&message_event->content[username_length + 2], message, message_length);
+    message_event->content[decorated_message_length - 1] = '\0';
+    message_packet->received_ns = received_ns;
+
+    connections_relay_packet_from(connections, message_packet, sender);
+
+    const room_t *room = rooms_find(&connections->rooms, connections_user(connections, sender)->room);
+    if(room != NULL && room->history != NULL)
+        history_append(room->history, message_packet);
+    packet_release(message_packet);
+};
+
+
+
+int connections_add_connection(connections_t *connections, int new_connection, size_t username_size)
+{
+    unsigned char connection_fail_message[] = "Server is unable to handle new connections at the moment.";
+    event_t *connection_fail_event = malloc(sizeof(event_t) + sizeof(connection_fail_message));
+    if(connection_fail_event != NULL)
+    {
+        connection_fail_event->code = EVENT_CONNECTION_FAILED;
+        connection_fail_event->originator_id = 0;
+        connection_fail_event->content_length = strlen(connection_fail_message);
+        strcpy(connection_fail_event->content, connection_fail_message);
+    }
+
+    if(connections->free_head == 0 && !connections_add_page(connections))
+    {
+        if(connection_fail_event != NULL)
+            send(new_connection, connection_fail_event, sizeof(event_t) + sizeof(connection_fail_message), 0);
+        close(new_connection);
+        free(connection_fail_event);
+        return 0;
+    }
+
+    unsigned char *username = (unsigned char *)malloc(username_size);
+    if(username == NULL)
+    {
+        if(connection_fail_event != NULL)
+            send(new_connection, connection_fail_event, sizeof(event_t) + sizeof(connection_fail_message), 0);
+        close(new_connection);
+        free(connection_fail_event);
+        return 0;
+    }
+    free(connection_fail_event);
+
+    unsigned int insert_position = connections->free_head;
+    user_t *new_user = connections_user(connections, insert_position);
+
+    uint32_t tag = connections_tag(connections, insert_position);
+    bool watched;
+    if(connections->ring != NULL)
+        watched = ring_receive(connections->ring, new_connection, RING_DATA(RING_OP_RECEIVE, tag));
+    else
+    {
+        struct epoll_event new_event = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.u32 = tag};
+        watched = epoll_ctl(connections->epoll_fd, EPOLL_CTL_ADD, new_connection, &new_event) == 0;
+    }
+    if(!watched)
+    {
+        close(new_connection);
+        free(username);
+        return 0;
+    }
+
+    connections->free_head = new_user->next_free;
+    if(connections->free_head == 0)
+        connections->free_tail = 0;
+
+    new_user->username = username;
+    new_user->fd = new_connection;
+    new_user->state = USER_CONNECTED;
+    new_user->receiving = connections->ring != NULL;
+    new_user->connected_ns = monotonic_ns();
+    new_user->heard_ns = new_user->connected_ns;
+    new_user->pinged = false;
+    connections_arm_timer(connections, insert_position, &new_user->timer, new_user->connected_ns + (uint64_t)PROTOCOL_SNIFF_MS * 1000000);
+    connections->count++;
+    metrics_add(&connections->metrics.accepted, 1);
+
+    return insert_position;
+};
+
+
+
+// Lists the user's room, or the lobby they are about to join if they have no username yet
+void connections_send_user_list(connections_t *connections, unsigned int index)
+{
+    uint32_t room = connections_user(connections, index)->room == ROOM_NONE ? ROOM_LOBBY : connections_user(connections, index)->room;
+    packet_t **pages;
+    size_t page_count = directory_retain_roster(connections->directory, room, &pages);
+    for(size_t i = 0; i < page_count; i++)
+    {
+        connections_send(connections, index, pages[i]);
+        packet_release(pages[i]);
+    }
+
+    free(pages);
+};
+
+
+
+// Replays the recent messages of the user's room, or of the lobby they are about to join, in one packet
+void connections_send_history(connections_t *connections, unsigned int index)
+{
+    user_t *user = connections_user(connections, index);
+    uint32_t room = user->room == ROOM_NONE ? ROOM_LOBBY : user->room;
+    const room_t *local_room = rooms_find(&connections->rooms, room);
+    history_t *history = local_room != NULL ? local_room->history : directory_history(connections->directory, room);
+    if(history == NULL)
+        return;
+
+    packet_t *replay = history_replay(history, user->reader.version);
+    if(replay != NULL)
+        connections_send(connections, index, replay);
+    packet_release(replay);
+};
+
+
+
+// Only this worker's membership; the directory's reference on the room is left to the caller
+bool connections_join_room(connections_t *connections, unsigned int index, uint32_t room, const unsigned char *name)
+{
+    user_t *user = connections_user(connections, index);
+    const room_t *local_room = rooms_find(&connections->rooms, room);
+    history_t *history = local_room != NULL ? local_room->history : directory_history(connections->directory, room);
+    if(!rooms_add(&connections->rooms, room, name, history, index, &user->room_position))
+        return false;
+    if(local_room == NULL)
+        directory_set_room_worker(connections->directory, room, connections->worker, true);
+
+    user->room = room;
+    return true;
+};
+
+
+
+void connections_leave_room(connections_t *connections, unsigned int index)
+{
+    user_t *user = connections_user(connections, index);
+    if(user->room == ROOM_NONE)
+        return;
+
+    unsigned int moved = rooms_remove(&connections->rooms, user->room, user->room_position);
+    if(moved != 0)
+        connections_user(connections, moved)->room_position = user->room_position;
+    if(rooms_find(&connections->rooms, user->room) == NULL)
+        directory_set_room_worker(connections->directory, user->room, connections->worker, false);
+    user->room = ROOM_NONE;
+};
+
+
+
+static packet_t *create_room_packet(enum event_code code, int originator, const unsigned char *username, const unsigned char *room_name)
+{
+    size_t username_size = strlen((const char *)username) + 1;
+    size_t room_name_size = strlen((const char *)room_name) + 1;
+    packet_t *room_packet = packet_create(sizeof(event_t) + username_size + room_name_size);
+    if(room_packet == NULL)
+        return NULL;
+
+    event_t *room_event = packet_event(room_packet);
+    room_event->code = code;
+    room_event->originator_id = originator;
+    room_event->content_length = username_size + room_name_size;
+    memcpy(room_event->content, username, username_size);
+    memcpy(&room_event->content[username_size], room_name, room_name_size);
+    return room_packet;
+};
+
+
+
+// Moves an active user to the named room: the old room hears them part, the new one (them included)
+// hears them join, and they get the new room's user list
+void connections_enter_room(connections_t *connections, unsigned int index, const unsigned char *name)
+{
+    user_t *user = connections_user(connections, index);
+    int id = connections_client_id(connections, index);
+
+    uint32_t room = directory_open_room(connections->directory, name);
+    if(room == ROOM_NONE)
+    {
+        LOG_ERROR("room_open_failed", LOG_INT("client", id), LOG_STR("room", name));
+        return;
+    }
+    if(room == user->room)
+    {
+        directory_close_room(connections->directory, room);
+        return;
+    }
+
+    const room_t *old_room = rooms_find(&connections->rooms, user->room);
+    if(old_room != NULL)
+    {
+        packet_t *part_packet = create_room_packet(EVENT_ROOM_PART, id, user->username, old_room->name);
+        if(part_packet != NULL)
+            connections_relay_packet_from(connections, part_packet, index);
+        packet_release(part_packet);
+    }
+
+    uint32_t old_room_id = user->room;
+    connections_leave_room(connections, index);
+    directory_close_room(connections->directory, old_room_id);
+    if(!connections_join_room(connections, index, room, name))
+    {
+        directory_close_room(connections->directory, room);
+        connections_evict(connections, index, EVICT_NO_RESOURCES);
+        return;
+    }
+    if(!directory_set_room(connections->directory, user->username, room))
+        LOG_ERROR("room_list_failed", LOG_INT("client", id), LOG_STR("room", name));
+
+    packet_t *join_packet = create_room_packet(EVENT_ROOM_JOIN, id, user->username, name);
+    if(join_packet != NULL)
+    {
+        connections_send(connections, index, join_packet);
+        connections_relay_packet_from(connections, join_packet, index);
+    }
+    packet_release(join_packet);
+
+    connections_send_user_list(connections, index);
+    connections_send_history(connections, index);
+    LOG_INFO("room_moved", LOG_INT("client", id), LOG_STR("room", name));
+};
+
+
+
+// Tells everyone else the user left (if they had finished joining) before closing the connection
+void connections_disconnect(connections_t *connections, unsigned int index)
+{
+    int id = connections_client_id(connections, index);
+    LOG_INFO("client_disconnected", LOG_INT("client", id));
+    if(connections_user(connections, index)->state == USER_ACTIVE)
+    {
+        directory_remove(connections->directory, id, connections_user(connections, index)->username);
+
+        size_t username_length = strlen(connections_user(connections, index)->username) + 1;
+        packet_t *user_leave_packet = packet_create_event(EVENT_USER_LEAVE, id, connections_user(connections, index)->username, username_length);
+        if(user_leave_packet != NULL)
+            connections_relay_packet_from(connections, user_leave_packet, index);
+        packet_release(user_leave_packet);
+    }
+    connections_close_connection(connections, index);
+};
+
+
+
+void connections_close_connection(connections_t *connections, unsigned int index)
+{
+    if(index < 1 || index >= connections->size)
+        return;
+
+    user_t *user = connections_user(connections, index);
+    if(user->state == USER_UNINITIALIZED)
+        return;
+
+    if(user->evicting)
+        connections_unlink(connections, &connections->evicted, index, offsetof(user_t, next_evicted));
+    if(user->flush_pending)
+        connections_unlink(connections, &connections->pending, index, offsetof(user_t, next_pending));
+    timer_wheel_cancel(&connections->timers, &user->timer);
+    timer_wheel_cancel(&connections->timers, &user->throttle_timer);
+
+    // Requests on the ring keep the socket open past close; shutting it down first ends them. Those still
+    // queued go in first, or the next accept could hand them the fd number.
+    if(connections->ring != NULL)
+    {
+        ring_submit(connections->ring);
+        shutdown(user->fd, SHUT_RDWR);
+    }
+    else
+        epoll_ctl(connections->epoll_fd, EPOLL_CTL_DEL, user->fd, NULL);
+    close(user->fd);
+    reader_free(&user->reader);
+    connections->queued_bytes -= user->outbound.bytes;
+    outbound_free(&user->outbound);
+    free(user->username);
+    free(user->held);
+
+    uint32_t room = user->room;
+    connections_leave_room(connections, index);
+    directory_close_room(connections->directory, room);
+
+    // The slot goes to the back of the free list under a new generation, so nothing still holding the old
+    // id or epoll tag can reach whoever gets it next
+    unsigned int generation = (user->generation + 1) & CONNECTION_GENERATION_MASK;
+    *user = blank_user;
+    user->generation = generation;
+    connections_push_free(connections, index);
+    connections->count--;
+    metrics_add(&connections->metrics.disconnected, 1);
+};
+
+
+
+void connections_shutdown(connections_t *connections)
+{
+    unsigned char shutdown_message[] = "Server is shutting down";
+    packet_t *shutdown_packet = packet_create_event(EVENT_SERVER_SHUTDOWN, 0, shutdown_message, sizeof(shutdown_message));
+    if(connections->ring != NULL)
+        connections_stop_ring(connections);
+
+    for(int i = 1; i < connections->size; i++)
+    {
+        if(connections_user(connections, i)->state > USER_UNINITIALIZED)
+        {
+            // A send the ring never gave back may still go out; nothing can safely follow it
+            if(shutdown_packet != NULL && !connections_user(connections, i)->sending)
+            {
+                connections_send(connections, i, shutdown_packet);
+                connections_flush(connections, i);
+            }
+
+            connections_close_connection(connections, i);
+        }
+    }
+
+    close(connections->epoll_fd);
+    rooms_destroy(&connections->rooms);
+    connections_free_pages(connections);
+    packet_release(shutdown_packet);
 };
\ No newline at end of file
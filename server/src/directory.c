@@ -0,0 +1,608 @@
+#include "directory.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "event.h"
+#include "packet.h"
+
+#define DIRECTORY_INITIAL_SIZE 16
+#define ROSTER_PAGE_CAPACITY (sizeof(event_t) + ROSTER_PAGE_SIZE)
+
+static size_t hash_name(const unsigned char *name)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for(; *name != '\0'; name++)
+        hash = (hash ^ *name) * 1099511628211ULL;
+    return (size_t)hash;
+};
+
+
+
+// Returns the room index slot holding the room named name, or the empty slot where it would go
+static size_t directory_probe_room(const directory_t *directory, const unsigned char *name, size_t hash)
+{
+    size_t mask = directory->room_index_size - 1;
+    size_t slot = hash & mask;
+    while(directory->room_index[slot] != 0)
+    {
+        const directory_room_t *room = &directory->rooms[directory->room_index[slot] - 1];
+        if(room->hash == hash && strcmp((const char *)room->name, (const char *)name) == 0)
+            break;
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+};
+
+
+
+// Makes sure the slot has a worker mask; only called with the lock held, or before any worker starts
+static bool directory_make_room_workers(directory_t *directory, size_t slot)
+{
+    size_t chunk = slot / ROOM_WORKERS_CHUNK;
+    if(atomic_load_explicit(&directory->room_workers[chunk], memory_order_relaxed) != NULL)
+        return true;
+
+    atomic_uint_least64_t *masks = malloc(ROOM_WORKERS_CHUNK * sizeof(atomic_uint_least64_t));
+    if(masks == NULL)
+        return false;
+    for(size_t i = 0; i < ROOM_WORKERS_CHUNK; i++)
+        atomic_init(&masks[i], 0);
+
+    atomic_store_explicit(&directory->room_workers[chunk], masks, memory_order_release);
+    return true;
+};
+
+
+
+bool directory_init(directory_t *directory)
+{
+    for(size_t i = 0; i < sizeof(directory->room_workers) / sizeof(directory->room_workers[0]); i++)
+        atomic_init(&directory->room_workers[i], NULL);
+
+    directory->count = 0;
+    directory->size = DIRECTORY_INITIAL_SIZE;
+    directory->entries = calloc(directory->size, sizeof(directory_entry_t));
+    if(directory->entries == NULL)
+        return false;
+
+    directory->index_size = DIRECTORY_INITIAL_SIZE * 2;
+    directory->index = calloc(directory->index_size, sizeof(size_t));
+    if(directory->index == NULL)
+    {
+        free(directory->entries);
+        return false;
+    }
+
+    directory->room_count = 1;
+    directory->room_size = DIRECTORY_INITIAL_SIZE;
+    directory->rooms = calloc(directory->room_size, sizeof(directory_room_t));
+    if(directory->rooms == NULL)
+    {
+        free(directory->index);
+        free(directory->entries);
+        return false;
+    }
+
+    directory->free_rooms = 0;
+    directory->room_index_size = DIRECTORY_INITIAL_SIZE * 2;
+    directory->room_index = calloc(directory->room_index_size, sizeof(size_t));
+    if(directory->room_index == NULL)
+    {
+        free(directory->rooms);
+        free(directory->index);
+        free(directory->entries);
+        return false;
+    }
+
+    directory->rooms[ROOM_LOBBY].name = (unsigned char *)strdup(ROOM_LOBBY_NAME);
+    directory->rooms[ROOM_LOBBY].hash = hash_name((const unsigned char *)ROOM_LOBBY_NAME);
+    directory->rooms[ROOM_LOBBY].history = history_create();
+    if(directory->rooms[ROOM_LOBBY].name == NULL || directory->rooms[ROOM_LOBBY].history == NULL
+        || !directory_make_room_workers(directory, ROOM_LOBBY) || pthread_mutex_init(&directory->lock, NULL) != 0)
+    {
+        free(atomic_load(&directory->room_workers[0]));
+        free(directory->rooms[ROOM_LOBBY].name);
+        history_destroy(directory->rooms[ROOM_LOBBY].history);
+        free(directory->room_index);
+        free(directory->rooms);
+        free(directory->index);
+        free(directory->entries);
+        return false;
+    }
+    directory->room_index[directory_probe_room(directory, directory->rooms[ROOM_LOBBY].name, directory->rooms[ROOM_LOBBY].hash)] = ROOM_LOBBY + 1;
+
+    return true;
+};
+
+
+
+// Returns the index slot holding username, or the empty slot where it would go
+static size_t directory_probe(const directory_t *directory, const unsigned char *username, size_t hash)
+{
+    size_t mask = directory->index_size - 1;
+    size_t slot = hash & mask;
+    while(directory->index[slot] != 0)
+    {
+        const directory_entry_t *entry = &directory->entries[directory->index[slot] - 1];
+        if(entry->hash == hash && strcmp((const char *)entry->username, (const char *)username) == 0)
+            break;
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+};
+
+
+
+// Keeps the index at most half full so probe runs stay short
+static bool directory_grow_index(directory_t *directory)
+{
+    size_t new_size = directory->index_size * 2;
+    size_t *new_index = calloc(new_size, sizeof(size_t));
+    if(new_index == NULL)
+        return false;
+
+    free(directory->index);
+    directory->index = new_index;
+    directory->index_size = new_size;
+    for(size_t i = 0; i < directory->count; i++)
+        directory->index[directory_probe(directory, directory->entries[i].username, directory->entries[i].hash)] = i + 1;
+
+    return true;
+};
+
+
+
+// Backward-shift deletion; later members of the probe run move up so no tombstones are needed
+static void directory_unindex(directory_t *directory, size_t slot)
+{
+    size_t mask = directory->index_size - 1;
+    size_t next = (slot + 1) & mask;
+    while(directory->index[next] != 0)
+    {
+        size_t home = directory->entries[directory->index[next] - 1].hash & mask;
+        if(((next - home) & mask) >= ((next - slot) & mask))
+        {
+            directory->index[slot] = directory->index[next];
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+    directory->index[slot] = 0;
+};
+
+
+
+// Grows the room index like the username one, rebuilt from the named slots
+static bool directory_grow_room_index(directory_t *directory)
+{
+    size_t new_size = directory->room_index_size * 2;
+    size_t *new_index = calloc(new_size, sizeof(size_t));
+    if(new_index == NULL)
+        return false;
+
+    free(directory->room_index);
+    directory->room_index = new_index;
+    directory->room_index_size = new_size;
+    for(size_t i = 0; i < directory->room_count; i++)
+    {
+        if(directory->rooms[i].name != NULL)
+            directory->room_index[directory_probe_room(directory, directory->rooms[i].name, directory->rooms[i].hash)] = i + 1;
+    }
+
+    return true;
+};
+
+
+
+// Backward-shift deletion, as for usernames
+static void directory_unindex_room(directory_t *directory, size_t slot)
+{
+    size_t mask = directory->room_index_size - 1;
+    size_t next = (slot + 1) & mask;
+    while(directory->room_index[next] != 0)
+    {
+        size_t home = directory->rooms[directory->room_index[next] - 1].hash & mask;
+        if(((next - home) & mask) >= ((next - slot) & mask))
+        {
+            directory->room_index[slot] = directory->room_index[next];
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+    directory->room_index[slot] = 0;
+};
+
+
+
+// Appends the username to the first roster page with space for it; a page still queued for
+// someone is copied rather than changed under them
+static bool roster_add(directory_room_t *room, directory_entry_t *entry)
+{
+    size_t username_size = strlen((const char *)entry->username) + 1;
+    size_t page = 0;
+    while(page < room->roster_count && packet_event(room->roster[page])->content_length + username_size > ROSTER_PAGE_SIZE)
+        page++;
+
+    if(page == room->roster_count)
+    {
+        if(room->roster_count >= room->roster_size)
+        {
+            size_t new_size = room->roster_size > 0 ? room->roster_size * 2 : 1;
+            packet_t **new_roster = reallocarray(room->roster, new_size, sizeof(packet_t *));
+            if(new_roster == NULL)
+                return false;
+
+            room->roster = new_roster;
+            room->roster_size = new_size;
+        }
+
+        packet_t *new_page = packet_create(ROSTER_PAGE_CAPACITY);
+        if(new_page == NULL)
+            return false;
+
+        event_t *list = packet_event(new_page);
+        list->code = EVENT_USER_LIST;
+        list->originator_id = 0;
+        list->content_length = 0;
+        new_page->length = sizeof(event_t);
+        room->roster[room->roster_count++] = new_page;
+    }
+    else
+    {
+        packet_t *writable_page = packet_make_writable(room->roster[page], ROSTER_PAGE_CAPACITY);
+        if(writable_page == NULL)
+            return false;
+        room->roster[page] = writable_page;
+    }
+
+    event_t *list = packet_event(room->roster[page]);
+    memcpy(&list->content[list->content_length], entry->username, username_size);
+    list->content_length += username_size;
+    room->roster[page]->length += username_size;
+    entry->roster_page = page;
+    return true;
+};
+
+
+
+static void roster_remove(directory_room_t *room, directory_entry_t *entry)
+{
+    if(entry->roster_page >= room->roster_count)
+        return;
+
+    packet_t *writable_page = packet_make_writable(room->roster[entry->roster_page], ROSTER_PAGE_CAPACITY);
+    if(writable_page == NULL)
+        return;
+    room->roster[entry->roster_page] = writable_page;
+
+    event_t *list = packet_event(writable_page);
+    size_t username_size = strlen((const char *)entry->username) + 1;
+    for(size_t position = 0; position < list->content_length; position += strlen((const char *)&list->content[position]) + 1)
+    {
+        if(memcmp(&list->content[position], entry->username, username_size) == 0)
+        {
+            memmove(&list->content[position], &list->content[position + username_size], list->content_length - position - username_size);
+            list->content_length -= username_size;
+            writable_page->length -= username_size;
+            return;
+        }
+    }
+};
+
+
+
+static void roster_clear(directory_room_t *room)
+{
+    for(size_t i = 0; i < room->roster_count; i++)
+        packet_release(room->roster[i]);
+
+    free(room->roster);
+    room->roster = NULL;
+    room->roster_count = 0;
+    room->roster_size = 0;
+};
+
+
+
+// Claims the username for id; names are unique across every worker, so a taken one is refused
+enum directory_result directory_add(directory_t *directory, int id, const unsigned char *username, uint32_t room)
+{
+    unsigned char *username_copy = (unsigned char *)strdup((const char *)username);
+    if(username_copy == NULL)
+        return DIRECTORY_ERROR;
+
+    size_t hash = hash_name(username);
+    pthread_mutex_lock(&directory->lock);
+    size_t slot = directory_probe(directory, username, hash);
+    if(directory->index[slot] != 0)
+    {
+        pthread_mutex_unlock(&directory->lock);
+        free(username_copy);
+        return DIRECTORY_DUPLICATE;
+    }
+
+    if(directory->count >= directory->size)
+    {
+        directory_entry_t *new_entries = reallocarray(directory->entries, directory->size * 2, sizeof(directory_entry_t));
+        if(new_entries == NULL)
+        {
+            pthread_mutex_unlock(&directory->lock);
+            free(username_copy);
+            return DIRECTORY_ERROR;
+        }
+
+        directory->entries = new_entries;
+        directory->size *= 2;
+    }
+
+    if((directory->count + 1) * 2 > directory->index_size)
+    {
+        if(!directory_grow_index(directory))
+        {
+            pthread_mutex_unlock(&directory->lock);
+            free(username_copy);
+            return DIRECTORY_ERROR;
+        }
+        slot = directory_probe(directory, username, hash);
+    }
+
+    directory_entry_t *entry = &directory->entries[directory->count];
+    entry->id = id;
+    entry->room = room;
+    entry->hash = hash;
+    entry->username = username_copy;
+    if(!roster_add(&directory->rooms[ROOM_SLOT(room)], entry))
+    {
+        pthread_mutex_unlock(&directory->lock);
+        free(username_copy);
+        return DIRECTORY_ERROR;
+    }
+    directory->count++;
+    directory->index[slot] = directory->count;
+    pthread_mutex_unlock(&directory->lock);
+
+    return DIRECTORY_ADDED;
+};
+
+
+
+// Only removes the entry if it belongs to id, so a stale call cannot drop someone else's claim
+void directory_remove(directory_t *directory, int id, const unsigned char *username)
+{
+    size_t hash = hash_name(username);
+    pthread_mutex_lock(&directory->lock);
+    size_t slot = directory_probe(directory, username, hash);
+    size_t position = directory->index[slot];
+    if(position != 0 && directory->entries[position - 1].id == id)
+    {
+        directory_unindex(directory, slot);
+        roster_remove(&directory->rooms[ROOM_SLOT(directory->entries[position - 1].room)], &directory->entries[position - 1]);
+        free(directory->entries[position - 1].username);
+
+        directory->count--;
+        if(position - 1 != directory->count)
+        {
+            directory_entry_t *moved = &directory->entries[directory->count];
+            directory->index[directory_probe(directory, moved->username, moved->hash)] = position;
+            directory->entries[position - 1] = *moved;
+        }
+    }
+    pthread_mutex_unlock(&directory->lock);
+};
+
+
+
+// Moves the user between room rosters; false if they could not be listed in the new one
+bool directory_set_room(directory_t *directory, const unsigned char *username, uint32_t room)
+{
+    size_t hash = hash_name(username);
+    bool listed = true;
+    pthread_mutex_lock(&directory->lock);
+    size_t position = directory->index[directory_probe(directory, username, hash)];
+    if(position != 0)
+    {
+        directory_entry_t *entry = &directory->entries[position - 1];
+        roster_remove(&directory->rooms[ROOM_SLOT(entry->room)], entry);
+        entry->room = room;
+        listed = roster_add(&directory->rooms[ROOM_SLOT(room)], entry);
+    }
+    pthread_mutex_unlock(&directory->lock);
+
+    return listed;
+};
+
+
+
+// Finds the room with this name, creating it if nobody is in it yet, and takes a reference on it;
+// returns ROOM_NONE when a new room cannot be made
+uint32_t directory_open_room(directory_t *directory, const unsigned char *name)
+{
+    size_t hash = hash_name(name);
+    pthread_mutex_lock(&directory->lock);
+    size_t index_slot = directory_probe_room(directory, name, hash);
+    if(directory->room_index[index_slot] != 0)
+    {
+        size_t slot = directory->room_index[index_slot] - 1;
+        directory->rooms[slot].members++;
+        pthread_mutex_unlock(&directory->lock);
+        return (directory->rooms[slot].generation << ROOM_SLOT_BITS) | slot;
+    }
+
+    unsigned char *name_copy = (unsigned char *)strdup((const char *)name);
+    history_t *history = history_create();
+    if(name_copy == NULL || history == NULL)
+    {
+        free(name_copy);
+        history_destroy(history);
+        pthread_mutex_unlock(&directory->lock);
+        return ROOM_NONE;
+    }
+
+    size_t slot;
+    if(directory->free_rooms != 0)
+    {
+        slot = directory->free_rooms - 1;
+        directory->free_rooms = directory->rooms[slot].next_free;
+    }
+    else
+    {
+        slot = directory->room_count;
+        bool grown = slot <= ROOM_SLOT_MASK && directory_make_room_workers(directory, slot);
+        if(grown && directory->room_count >= directory->room_size)
+        {
+            directory_room_t *new_rooms = reallocarray(directory->rooms, directory->room_size * 2, sizeof(directory_room_t));
+            grown = new_rooms != NULL;
+            if(grown)
+            {
+                memset(&new_rooms[directory->room_size], 0, directory->room_size * sizeof(directory_room_t));
+                directory->rooms = new_rooms;
+                directory->room_size *= 2;
+            }
+        }
+        if(grown && (directory->room_count + 1) * 2 > directory->room_index_size)
+        {
+            grown = directory_grow_room_index(directory);
+            if(grown)
+                index_slot = directory_probe_room(directory, name, hash);
+        }
+        if(!grown)
+        {
+            free(name_copy);
+            history_destroy(history);
+            pthread_mutex_unlock(&directory->lock);
+            return ROOM_NONE;
+        }
+        directory->room_count++;
+    }
+
+    directory_room_t *room = &directory->rooms[slot];
+    room->name = name_copy;
+    room->hash = hash;
+    room->history = history;
+    room->members = 1;
+    directory->room_index[index_slot] = slot + 1;
+    uint32_t room_id = (room->generation << ROOM_SLOT_BITS) | slot;
+    pthread_mutex_unlock(&directory->lock);
+
+    return room_id;
+};
+
+
+
+// Drops a reference taken by directory_open_room; the last one out frees the name and retires the id
+void directory_close_room(directory_t *directory, uint32_t room)
+{
+    if(room == ROOM_NONE || ROOM_SLOT(room) == ROOM_LOBBY)
+        return;
+
+    pthread_mutex_lock(&directory->lock);
+    directory_room_t *entry = &directory->rooms[ROOM_SLOT(room)];
+    if(entry->name != NULL && --entry->members == 0)
+    {
+        directory_unindex_room(directory, directory_probe_room(directory, entry->name, entry->hash));
+        entry->next_free = directory->free_rooms;
+        directory->free_rooms = ROOM_SLOT(room) + 1;
+        free(entry->name);
+        entry->name = NULL;
+        history_destroy(entry->history);
+        entry->history = NULL;
+        roster_clear(entry);
+        entry->generation = (entry->generation + 1) & (UINT32_MAX >> ROOM_SLOT_BITS);
+    }
+    pthread_mutex_unlock(&directory->lock);
+};
+
+
+
+// Only valid while the caller holds a reference on the room, or for the lobby
+history_t *directory_history(directory_t *directory, uint32_t room)
+{
+    pthread_mutex_lock(&directory->lock);
+    history_t *history = directory->rooms[ROOM_SLOT(room)].history;
+    pthread_mutex_unlock(&directory->lock);
+
+    return history;
+};
+
+
+
+// Marks whether the worker has members in the room; only valid while the caller holds a reference on it
+void directory_set_room_worker(directory_t *directory, uint32_t room, unsigned int worker, bool present)
+{
+    atomic_uint_least64_t *masks = atomic_load_explicit(&directory->room_workers[ROOM_SLOT(room) / ROOM_WORKERS_CHUNK], memory_order_acquire);
+    atomic_uint_least64_t *mask = &masks[ROOM_SLOT(room) % ROOM_WORKERS_CHUNK];
+    if(present)
+        atomic_fetch_or_explicit(mask, (uint64_t)1 << worker, memory_order_release);
+    else
+        atomic_fetch_and_explicit(mask, ~((uint64_t)1 << worker), memory_order_release);
+};
+
+
+
+// The workers with members in the room, without taking the lock. A worker whose first member is joining at
+// the same moment may be missed, as if the event had come just before the join.
+uint64_t directory_room_workers(directory_t *directory, uint32_t room)
+{
+    if(room == ROOM_NONE)
+        return 0;
+
+    atomic_uint_least64_t *masks = atomic_load_explicit(&directory->room_workers[ROOM_SLOT(room) / ROOM_WORKERS_CHUNK], memory_order_acquire);
+    if(masks == NULL)
+        return 0;
+    return atomic_load_explicit(&masks[ROOM_SLOT(room) % ROOM_WORKERS_CHUNK], memory_order_acquire);
+};
+
+
+
+// Fills pages with a reference to each non-empty page of the room's roster, for the caller to send and
+// release, and returns how many there are; the array is the caller's to free
+size_t directory_retain_roster(directory_t *directory, uint32_t room, packet_t ***pages)
+{
+    *pages = NULL;
+    size_t count = 0;
+    pthread_mutex_lock(&directory->lock);
+    directory_room_t *entry = &directory->rooms[ROOM_SLOT(room)];
+    if(entry->roster_count > 0)
+        *pages = malloc(entry->roster_count * sizeof(packet_t *));
+
+    if(*pages != NULL)
+    {
+        for(size_t i = 0; i < entry->roster_count; i++)
+        {
+            if(packet_event(entry->roster[i])->content_length > 0)
+                (*pages)[count++] = packet_retain(entry->roster[i]);
+        }
+    }
+    pthread_mutex_unlock(&directory->lock);
+
+    return count;
+};
+
+
+
+void directory_destroy(directory_t *directory)
+{
+    for(size_t i = 0; i < directory->count; i++)
+        free(directory->entries[i].username);
+    for(size_t i = 0; i < directory->room_count; i++)
+    {
+        free(directory->rooms[i].name);
+        history_destroy(directory->rooms[i].history);
+        roster_clear(&directory->rooms[i]);
+    }
+
+    for(size_t i = 0; i < sizeof(directory->room_workers) / sizeof(directory->room_workers[0]); i++)
+        free(atomic_load(&directory->room_workers[i]));
+
+    free(directory->entries);
+    free(directory->index);
+    free(directory->room_index);
+    free(directory->rooms);
+    pthread_mutex_destroy(&directory->lock);
+};
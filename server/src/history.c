@@ -0,0 +1,194 @@
+#include "history.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "event.h"
+#include "packet.h"
+#include "wire.h"
+
+history_t *history_create(void)
+{
+    history_t *history = malloc(sizeof(history_t));
+    if(history == NULL)
+        return NULL;
+
+    if(pthread_mutex_init(&history->lock, NULL) != 0)
+    {
+        free(history);
+        return NULL;
+    }
+
+    history->ring = NULL;
+    history->capacity = 0;
+    history->start = 0;
+    history->length = 0;
+    history->count = 0;
+    return history;
+};
+
+
+
+static void ring_write(history_t *history, size_t offset, const unsigned char *data, size_t length)
+{
+    offset %= history->capacity;
+    size_t first = history->capacity - offset < length ? history->capacity - offset : length;
+    memcpy(&history->ring[offset], data, first);
+    memcpy(history->ring, &data[first], length - first);
+};
+
+
+
+static void ring_read(const history_t *history, size_t offset, unsigned char *data, size_t length)
+{
+    offset %= history->capacity;
+    size_t first = history->capacity - offset < length ? history->capacity - offset : length;
+    memcpy(data, &history->ring[offset], first);
+    memcpy(&data[first], history->ring, length - first);
+};
+
+
+
+// Reads the header of the frame at offset; returns the whole frame's size and fills header
+static size_t ring_frame(const history_t *history, size_t offset, event_t *header, size_t *header_size)
+{
+    unsigned char header_bytes[WIRE_MAX_HEADER];
+    size_t available = history->start + history->length - offset;
+    ring_read(history, offset, header_bytes, available < WIRE_MAX_HEADER ? available : WIRE_MAX_HEADER);
+    wire_get_header(header_bytes, available < WIRE_MAX_HEADER ? available : WIRE_MAX_HEADER, header, header_size);
+    return *header_size + header->content_length;
+};
+
+
+
+// Doubles the ring, unwrapping it into the new one
+static bool history_grow(history_t *history, size_t needed)
+{
+    size_t new_capacity = history->capacity > 0 ? history->capacity : HISTORY_INITIAL_BYTES;
+    while(new_capacity < needed && new_capacity < HISTORY_BYTES)
+        new_capacity *= 2;
+    if(new_capacity > HISTORY_BYTES)
+        new_capacity = HISTORY_BYTES;
+
+    unsigned char *new_ring = malloc(new_capacity);
+    if(new_ring == NULL)
+        return false;
+
+    if(history->length > 0)
+        ring_read(history, history->start, new_ring, history->length);
+    free(history->ring);
+    history->ring = new_ring;
+    history->capacity = new_capacity;
+    history->start = 0;
+    return true;
+};
+
+
+
+// Copies the message into the ring in its v2 encoding, dropping the oldest until it fits
+void history_append(history_t *history, packet_t *packet)
+{
+    event_t *event = packet_event(packet);
+    unsigned char header[WIRE_MAX_HEADER];
+    size_t header_size = wire_put_event_header(header, event->code, event->originator_id, event->content_length);
+    size_t frame_size = header_size + event->content_length;
+    if(frame_size > HISTORY_BYTES)
+        return;
+
+    pthread_mutex_lock(&history->lock);
+    if(history->length + frame_size > history->capacity && history->capacity < HISTORY_BYTES
+        && !history_grow(history, history->length + frame_size))
+    {
+        pthread_mutex_unlock(&history->lock);
+        return;
+    }
+
+    while(history->count > 0 && (history->length + frame_size > history->capacity || history->count >= HISTORY_MESSAGES))
+    {
+        event_t oldest;
+        size_t oldest_header_size;
+        size_t oldest_size = ring_frame(history, history->start, &oldest, &oldest_header_size);
+        history->start = (history->start + oldest_size) % history->capacity;
+        history->length -= oldest_size;
+        history->count--;
+    }
+
+    size_t end = history->start + history->length;
+    ring_write(history, end, header, header_size);
+    ring_write(history, end + header_size, event->content, event->content_length);
+    history->length += frame_size;
+    history->count++;
+    pthread_mutex_unlock(&history->lock);
+};
+
+
+
+// Builds every remembered message into a single packet for a client speaking version: one batch frame for v2,
+// the events back to back for legacy clients. Returns NULL when there is nothing to replay.
+packet_t *history_replay(history_t *history, unsigned char version)
+{
+    packet_t *replay = NULL;
+    pthread_mutex_lock(&history->lock);
+    if(history->count > 0 && version == WIRE_VERSION)
+    {
+        unsigned char batch_header[WIRE_MAX_HEADER];
+        size_t batch_header_size = wire_put_batch_header(batch_header, history->length);
+        replay = packet_create(batch_header_size + history->length);
+        if(replay != NULL)
+        {
+            memcpy(replay->data, batch_header, batch_header_size);
+            ring_read(history, history->start, &replay->data[batch_header_size], history->length);
+        }
+    }
+    else if(history->count > 0)
+    {
+        // Each v2 header is swapped for an event_t, so the size is the content plus one event_t per frame
+        size_t content_size = 0;
+        size_t offset = history->start;
+        for(size_t i = 0; i < history->count; i++)
+        {
+            event_t header;
+            size_t header_size;
+            offset += ring_frame(history, offset, &header, &header_size);
+            content_size += header.content_length;
+        }
+
+        replay = packet_create(history->count * sizeof(event_t) + content_size);
+        if(replay != NULL)
+        {
+            size_t position = 0;
+            offset = history->start;
+            for(size_t i = 0; i < history->count; i++)
+            {
+                event_t header;
+                size_t header_size;
+                size_t frame_size = ring_frame(history, offset, &header, &header_size);
+
+                memcpy(&replay->data[position], &header, sizeof(event_t));
+                ring_read(history, offset + header_size, &replay->data[position + sizeof(event_t)], header.content_length);
+                position += sizeof(event_t) + header.content_length;
+                offset += frame_size;
+            }
+        }
+    }
+    pthread_mutex_unlock(&history->lock);
+
+    // Made for this one client's protocol, so it goes out as is; a v2 batch may still be deflated
+    if(replay != NULL)
+        replay->version = version == WIRE_VERSION ? WIRE_VERSION : PACKET_RAW;
+    return replay;
+};
+
+
+
+void history_destroy(history_t *history)
+{
+    if(history == NULL)
+        return;
+
+    pthread_mutex_destroy(&history->lock);
+    free(history->ring);
+    free(history);
+};
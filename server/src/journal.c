@@ -0,0 +1,483 @@
+#include "journal.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "log.h"
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void build_crc_table(void)
+{
+    for(uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for(int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+        crc_table[i] = crc;
+    }
+};
+
+
+
+// The same CRC-32 as zlib and gzip, so segments can be checked with common tools
+uint32_t journal_crc32(const unsigned char *data, size_t length)
+{
+    pthread_once(&crc_table_once, &build_crc_table);
+
+    uint32_t crc = 0xFFFFFFFFu;
+    for(size_t i = 0; i < length; i++)
+        crc = (crc >> 8) ^ crc_table[(crc ^ data[i]) & 0xFF];
+    return crc ^ 0xFFFFFFFFu;
+};
+
+
+
+static void put_u32(unsigned char *data, uint32_t value)
+{
+    for(int i = 0; i < 4; i++)
+        data[i] = value >> (8 * i);
+};
+
+
+
+static void put_u64(unsigned char *data, uint64_t value)
+{
+    for(int i = 0; i < 8; i++)
+        data[i] = value >> (8 * i);
+};
+
+
+
+static uint32_t get_u32(const unsigned char *data)
+{
+    uint32_t value = 0;
+    for(int i = 0; i < 4; i++)
+        value |= (uint32_t)data[i] << (8 * i);
+    return value;
+};
+
+
+
+static uint64_t get_u64(const unsigned char *data)
+{
+    uint64_t value = 0;
+    for(int i = 0; i < 8; i++)
+        value |= (uint64_t)data[i] << (8 * i);
+    return value;
+};
+
+
+
+// Returns the size of the record at the start of data, or 0 when it is incomplete or fails its CRC
+size_t journal_parse_record(const unsigned char *data, size_t length, journal_record_t *record)
+{
+    if(length < JOURNAL_RECORD_PREFIX + JOURNAL_RECORD_FIXED)
+        return 0;
+
+    uint32_t size = get_u32(&data[4]);
+    if(size < JOURNAL_RECORD_FIXED || size > length - JOURNAL_RECORD_PREFIX)
+        return 0;
+    if(journal_crc32(&data[4], size + 4) != get_u32(data))
+        return 0;
+
+    const unsigned char *body = &data[JOURNAL_RECORD_PREFIX];
+    record->time_ns = get_u64(body);
+    record->code = (int32_t)get_u32(&body[8]);
+    record->originator_id = (int32_t)get_u32(&body[12]);
+    record->room_length = body[16];
+    if(JOURNAL_RECORD_FIXED + record->room_length > size)
+        return 0;
+
+    record->room = &body[JOURNAL_RECORD_FIXED];
+    record->content = &body[JOURNAL_RECORD_FIXED + record->room_length];
+    record->content_length = size - JOURNAL_RECORD_FIXED - record->room_length;
+    return JOURNAL_RECORD_PREFIX + size;
+};
+
+
+
+// Visits every intact record in order. A crash can leave a torn record at the end of the newest segment;
+// reading stops there and truncated is set, since nothing after it can be trusted.
+bool journal_read_segment(const char *path, journal_visit_t visit, void *context, size_t *records, bool *truncated)
+{
+    *records = 0;
+    *truncated = false;
+
+    FILE *file = fopen(path, "rb");
+    if(file == NULL)
+        return false;
+
+    unsigned char *data = NULL;
+    size_t length = 0;
+    struct stat file_stat;
+    if(fstat(fileno(file), &file_stat) == 0 && file_stat.st_size > 0)
+    {
+        data = malloc(file_stat.st_size);
+        if(data != NULL)
+            length = fread(data, 1, file_stat.st_size, file);
+    }
+    fclose(file);
+
+    if(length < JOURNAL_MAGIC_LENGTH || memcmp(data, JOURNAL_MAGIC, JOURNAL_MAGIC_LENGTH) != 0)
+    {
+        free(data);
+        return false;
+    }
+
+    size_t offset = JOURNAL_MAGIC_LENGTH;
+    while(offset < length)
+    {
+        journal_record_t record;
+        size_t record_size = journal_parse_record(&data[offset], length - offset, &record);
+        if(record_size == 0)
+        {
+            *truncated = true;
+            break;
+        }
+
+        visit(context, &record);
+        (*records)++;
+        offset += record_size;
+    }
+
+    free(data);
+    return true;
+};
+
+
+
+static int compare_segments(const void *a, const void *b)
+{
+    unsigned int left = *(const unsigned int *)a;
+    unsigned int right = *(const unsigned int *)b;
+    return (left > right) - (left < right);
+};
+
+
+
+// Fills segments with the numbers of every segment in the directory, oldest first
+static bool list_segments(const char *directory, unsigned int **segments, size_t *count)
+{
+    *segments = NULL;
+    *count = 0;
+
+    DIR *dir = opendir(directory);
+    if(dir == NULL)
+        return errno == ENOENT;
+
+    size_t size = 0;
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL)
+    {
+        unsigned int number;
+        int end = 0;
+        if(sscanf(entry->d_name, "%u.journal%n", &number, &end) != 1 || entry->d_name[end] != '\0' || end == 0)
+            continue;
+
+        if(*count == size)
+        {
+            size_t new_size = size > 0 ? size * 2 : 16;
+            unsigned int *new_segments = realloc(*segments, new_size * sizeof(unsigned int));
+            if(new_segments == NULL)
+            {
+                closedir(dir);
+                free(*segments);
+                *segments = NULL;
+                *count = 0;
+                return false;
+            }
+            *segments = new_segments;
+            size = new_size;
+        }
+        (*segments)[(*count)++] = number;
+    }
+    closedir(dir);
+
+    if(*count > 1)
+        qsort(*segments, *count, sizeof(unsigned int), &compare_segments);
+    return true;
+};
+
+
+
+static void segment_path(char *path, size_t path_size, const char *directory, unsigned int segment)
+{
+    snprintf(path, path_size, "%s/%010u.journal", directory, segment);
+};
+
+
+
+// Reads back the newest JOURNAL_REPLAY_SEGMENTS segments, oldest first
+bool journal_replay(const char *directory, journal_visit_t visit, void *context)
+{
+    unsigned int *segments;
+    size_t count;
+    if(!list_segments(directory, &segments, &count))
+        return false;
+
+    size_t first = count > JOURNAL_REPLAY_SEGMENTS ? count - JOURNAL_REPLAY_SEGMENTS : 0;
+    for(size_t i = first; i < count; i++)
+    {
+        char path[4096];
+        size_t records;
+        bool truncated;
+        segment_path(path, sizeof(path), directory, segments[i]);
+        if(!journal_read_segment(path, visit, context, &records, &truncated))
+            LOG_WARN("journal_segment_skipped", LOG_STR("path", path));
+        else if(truncated)
+            LOG_WARN("journal_segment_torn", LOG_STR("path", path), LOG_INT("records", records));
+    }
+
+    free(segments);
+    return true;
+};
+
+
+
+// Starts the next segment; the directory is synced too so the new file itself survives a crash
+static bool journal_open_segment(journal_t *journal)
+{
+    char path[4096];
+    segment_path(path, sizeof(path), journal->directory, journal->segment);
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+    if(fd < 0)
+        return false;
+
+    if(write(fd, JOURNAL_MAGIC, JOURNAL_MAGIC_LENGTH) != JOURNAL_MAGIC_LENGTH || fdatasync(fd) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    int dir_fd = open(journal->directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dir_fd >= 0)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    journal->fd = fd;
+    journal->segment_bytes = JOURNAL_MAGIC_LENGTH;
+    return true;
+};
+
+
+
+static bool write_fully(int fd, const unsigned char *data, size_t length)
+{
+    while(length > 0)
+    {
+        ssize_t written = write(fd, data, length);
+        if(written < 0 && errno == EINTR)
+            continue;
+        if(written <= 0)
+            return false;
+
+        data += written;
+        length -= written;
+    }
+
+    return true;
+};
+
+
+
+static void *run_journal_writer(void *argument)
+{
+    journal_t *journal = argument;
+    bool failed = false;
+
+    pthread_mutex_lock(&journal->lock);
+    while(true)
+    {
+        while(journal->used == 0 && !journal->stopping)
+            pthread_cond_wait(&journal->wake, &journal->lock);
+        if(journal->used == 0)
+            break;
+
+        unsigned char *batch = journal->buffers[journal->active];
+        size_t batch_length = journal->used;
+        journal->active ^= 1;
+        journal->used = 0;
+        pthread_mutex_unlock(&journal->lock);
+
+        // One write and one fsync for the whole batch, however many events it holds
+        bool written = journal->fd >= 0 && write_fully(journal->fd, batch, batch_length) && fdatasync(journal->fd) == 0;
+        if(!written && !failed)
+        {
+            LOG_ERROR("journal_write_failed", LOG_INT("segment", journal->segment), LOG_STR("error", strerror(errno)));
+            failed = true;
+        }
+
+        if(written && journal->segment_bytes + batch_length >= JOURNAL_SEGMENT_BYTES)
+        {
+            close(journal->fd);
+            journal->fd = -1;
+            journal->segment++;
+            if(!journal_open_segment(journal))
+                LOG_ERROR("journal_segment_failed", LOG_INT("segment", journal->segment), LOG_STR("error", strerror(errno)));
+        }
+        else if(written)
+        {
+            journal->segment_bytes += batch_length;
+        }
+
+        pthread_mutex_lock(&journal->lock);
+        if(written)
+        {
+            journal->stats.writes++;
+            journal->stats.syncs++;
+            journal->stats.bytes += batch_length;
+        }
+    }
+    pthread_mutex_unlock(&journal->lock);
+
+    return NULL;
+};
+
+
+
+// Appends go to a new segment after the newest one already in the directory, which is created if needed
+journal_t *journal_open(const char *directory)
+{
+    if(mkdir(directory, 0755) != 0 && errno != EEXIST)
+        return NULL;
+
+    unsigned int *segments;
+    size_t count;
+    if(!list_segments(directory, &segments, &count))
+        return NULL;
+
+    journal_t *journal = calloc(1, sizeof(journal_t));
+    if(journal == NULL)
+    {
+        free(segments);
+        return NULL;
+    }
+
+    journal->segment = count > 0 ? segments[count - 1] + 1 : 0;
+    free(segments);
+
+    journal->fd = -1;
+    journal->directory = strdup(directory);
+    journal->buffers[0] = malloc(JOURNAL_BUFFER_BYTES);
+    journal->buffers[1] = malloc(JOURNAL_BUFFER_BYTES);
+    if(journal->directory == NULL || journal->buffers[0] == NULL || journal->buffers[1] == NULL
+        || !journal_open_segment(journal))
+    {
+        if(journal->fd >= 0)
+            close(journal->fd);
+        free(journal->directory);
+        free(journal->buffers[0]);
+        free(journal->buffers[1]);
+        free(journal);
+        return NULL;
+    }
+
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->wake, NULL);
+    if(pthread_create(&journal->thread, NULL, &run_journal_writer, journal) != 0)
+    {
+        pthread_mutex_destroy(&journal->lock);
+        pthread_cond_destroy(&journal->wake);
+        close(journal->fd);
+        free(journal->directory);
+        free(journal->buffers[0]);
+        free(journal->buffers[1]);
+        free(journal);
+        return NULL;
+    }
+
+    return journal;
+};
+
+
+
+// Copies the event into the active buffer and returns without touching the disk. When both buffers are full,
+// the disk has fallen a whole buffer behind; the record is dropped rather than hold up the worker's loop.
+void journal_append(journal_t *journal, const event_t *event, const unsigned char *room, size_t room_length)
+{
+    if(room_length > UINT8_MAX)
+        room_length = UINT8_MAX;
+    size_t size = JOURNAL_RECORD_FIXED + room_length + event->content_length;
+    size_t record_size = JOURNAL_RECORD_PREFIX + size;
+    if(record_size > JOURNAL_BUFFER_BYTES)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    pthread_mutex_lock(&journal->lock);
+    if(journal->used + record_size > JOURNAL_BUFFER_BYTES || journal->stopping)
+    {
+        journal->stats.dropped++;
+        pthread_mutex_unlock(&journal->lock);
+        return;
+    }
+
+    unsigned char *record = &journal->buffers[journal->active][journal->used];
+    unsigned char *body = &record[JOURNAL_RECORD_PREFIX];
+    put_u32(&record[4], size);
+    put_u64(body, (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+    put_u32(&body[8], (uint32_t)event->code);
+    put_u32(&body[12], (uint32_t)event->originator_id);
+    body[16] = room_length;
+    memcpy(&body[JOURNAL_RECORD_FIXED], room, room_length);
+    memcpy(&body[JOURNAL_RECORD_FIXED + room_length], event->content, event->content_length);
+    put_u32(record, journal_crc32(&record[4], size + 4));
+
+    if(journal->used == 0)
+        pthread_cond_signal(&journal->wake);
+    journal->used += record_size;
+    journal->stats.records++;
+    pthread_mutex_unlock(&journal->lock);
+};
+
+
+
+void journal_print_stats(journal_t *journal)
+{
+    pthread_mutex_lock(&journal->lock);
+    journal_stats_t stats = journal->stats;
+    pthread_mutex_unlock(&journal->lock);
+
+    LOG_INFO("journal_stats", LOG_INT("events", stats.records), LOG_INT("writes", stats.writes),
+        LOG_INT("fsyncs", stats.syncs), LOG_INT("bytes", stats.bytes), LOG_INT("dropped", stats.dropped));
+};
+
+
+
+// Commits everything already appended before returning
+void journal_close(journal_t *journal)
+{
+    if(journal == NULL)
+        return;
+
+    pthread_mutex_lock(&journal->lock);
+    journal->stopping = true;
+    pthread_cond_broadcast(&journal->wake);
+    pthread_mutex_unlock(&journal->lock);
+    pthread_join(journal->thread, NULL);
+
+    if(journal->fd >= 0)
+        close(journal->fd);
+    pthread_mutex_destroy(&journal->lock);
+    pthread_cond_destroy(&journal->wake);
+    free(journal->directory);
+    free(journal->buffers[0]);
+    free(journal->buffers[1]);
+    free(journal);
+};
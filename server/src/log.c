@@ -0,0 +1,285 @@
+#include "log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    const char *key;
+    enum log_field_kind kind;
+    long long number;
+    unsigned short text_offset; // Where a string field's copy starts in the record's text
+    unsigned short text_length;
+} log_record_field_t;
+
+typedef struct {
+    uint64_t time_ns;
+    const char *event;
+    enum log_level level;
+    unsigned int field_count;
+    log_record_field_t fields[LOG_MAX_FIELDS];
+    char text[LOG_TEXT_BYTES];
+} log_record_t;
+
+// A slot is free for the producer claiming position p when its sequence is p, and holds a finished record
+// for the writer reading position p when its sequence is p + 1
+typedef struct {
+    atomic_size_t sequence;
+    log_record_t record;
+} log_slot_t;
+
+static const char *log_level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+atomic_int log_threshold = LOG_LEVEL_INFO;
+
+static log_slot_t log_slots[LOG_RING_RECORDS];
+static atomic_size_t log_tail;      // Next position producers claim
+static size_t log_head;             // Next position the writer reads; only touched by the writer
+static atomic_ulong log_dropped;
+static atomic_bool log_stopping;
+static atomic_bool log_signalled;   // A wakeup is on its way to the writer, so producers need not send another
+static int log_wake_fd = -1;        // The writer blocks reading this while the ring is empty
+static bool log_running = false;
+static pthread_t log_thread;
+
+
+
+bool log_parse_level(const char *name, enum log_level *level)
+{
+    static const char *lower_names[] = {"debug", "info", "warn", "error"};
+    for(int i = LOG_LEVEL_DEBUG; i <= LOG_LEVEL_ERROR; i++)
+    {
+        if(strcmp(name, lower_names[i]) == 0)
+        {
+            *level = i;
+            return true;
+        }
+    }
+
+    return false;
+};
+
+
+
+// Safe to call from a signal handler
+void log_set_level(enum log_level level)
+{
+    if(level < LOG_LEVEL_DEBUG)
+        level = LOG_LEVEL_DEBUG;
+    if(level > LOG_LEVEL_ERROR)
+        level = LOG_LEVEL_ERROR;
+    atomic_store_explicit(&log_threshold, level, memory_order_relaxed);
+};
+
+
+
+// Never blocks; when the writer has fallen a whole ring behind the record is dropped and counted instead
+void log_write(enum log_level level, const char *event, const log_field_t *fields, size_t field_count)
+{
+    size_t position = atomic_load_explicit(&log_tail, memory_order_relaxed);
+    log_slot_t *slot;
+    while(true)
+    {
+        slot = &log_slots[position & (LOG_RING_RECORDS - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if(sequence == position)
+        {
+            if(atomic_compare_exchange_weak_explicit(&log_tail, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if(sequence < position)
+        {
+            atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            position = atomic_load_explicit(&log_tail, memory_order_relaxed);
+        }
+    }
+
+    log_record_t *record = &slot->record;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record->time_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    record->event = event;
+    record->level = level;
+    record->field_count = field_count < LOG_MAX_FIELDS ? field_count : LOG_MAX_FIELDS;
+
+    size_t text_used = 0;
+    for(unsigned int i = 0; i < record->field_count; i++)
+    {
+        log_record_field_t *field = &record->fields[i];
+        field->key = fields[i].key;
+        field->kind = fields[i].kind;
+        field->number = fields[i].number;
+        if(field->kind != LOG_FIELD_STRING)
+            continue;
+
+        const char *string = fields[i].string != NULL ? fields[i].string : "";
+        size_t length = strnlen(string, LOG_TEXT_BYTES - text_used);
+        memcpy(&record->text[text_used], string, length);
+        field->text_offset = text_used;
+        field->text_length = length;
+        text_used += length;
+    }
+
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+
+    // As with a mailbox, only the first record after the writer's last wakeup pays for the eventfd write
+    if(!atomic_exchange(&log_signalled, true))
+    {
+        uint64_t one = 1;
+        ssize_t written = write(log_wake_fd, &one, sizeof(one));
+        (void)written;
+    }
+};
+
+
+
+static void print_quoted(FILE *stream, const char *text, size_t length)
+{
+    fputc('"', stream);
+    for(size_t i = 0; i < length; i++)
+    {
+        unsigned char character = text[i];
+        if(character == '"' || character == '\\')
+            fprintf(stream, "\\%c", character);
+        else if(character < 0x20 || character == 0x7F)
+            fprintf(stream, "\\x%02x", character);
+        else
+            fputc(character, stream);
+    }
+    fputc('"', stream);
+};
+
+
+
+// One line per record: time, level and event, then key=value fields with every string quoted
+static void print_record(const log_record_t *record)
+{
+    FILE *stream = record->level >= LOG_LEVEL_WARN ? stderr : stdout;
+
+    time_t seconds = record->time_ns / 1000000000;
+    struct tm utc;
+    char timestamp[32];
+    gmtime_r(&seconds, &utc);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &utc);
+    fprintf(stream, "%s.%06luZ %s %s", timestamp, (unsigned long)(record->time_ns % 1000000000) / 1000,
+        log_level_names[record->level], record->event);
+
+    for(unsigned int i = 0; i < record->field_count; i++)
+    {
+        const log_record_field_t *field = &record->fields[i];
+        fprintf(stream, " %s=", field->key);
+        if(field->kind == LOG_FIELD_STRING)
+            print_quoted(stream, &record->text[field->text_offset], field->text_length);
+        else
+            fprintf(stream, "%lld", field->number);
+    }
+    fputc('\n', stream);
+};
+
+
+
+// Prints every finished record; returns how many there were
+static size_t log_drain(void)
+{
+    size_t drained = 0;
+    while(true)
+    {
+        log_slot_t *slot = &log_slots[log_head & (LOG_RING_RECORDS - 1)];
+        if(atomic_load_explicit(&slot->sequence, memory_order_acquire) != log_head + 1)
+            break;
+
+        print_record(&slot->record);
+        atomic_store_explicit(&slot->sequence, log_head + LOG_RING_RECORDS, memory_order_release);
+        log_head++;
+        drained++;
+    }
+
+    unsigned long dropped = atomic_exchange_explicit(&log_dropped, 0, memory_order_relaxed);
+    if(dropped > 0)
+        LOG_WARN("log_dropped", LOG_INT("records", dropped));
+
+    if(drained > 0)
+    {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return drained;
+};
+
+
+
+// Sleeps until a producer signals; clearing the signal before draining means a record published after the
+// drain has looked always brings another wakeup
+static void *run_log_writer(void *argument)
+{
+    while(!atomic_load_explicit(&log_stopping, memory_order_acquire))
+    {
+        uint64_t count;
+        if(read(log_wake_fd, &count, sizeof(count)) < 0 && errno != EINTR)
+            break;
+        atomic_exchange(&log_signalled, false);
+        log_drain();
+    }
+
+    // Producers have stopped by now; print whatever they left behind
+    while(log_drain() > 0)
+        ;
+    return NULL;
+};
+
+
+
+bool log_start(void)
+{
+    for(size_t i = 0; i < LOG_RING_RECORDS; i++)
+        atomic_init(&log_slots[i].sequence, i);
+    atomic_init(&log_tail, 0);
+    log_head = 0;
+    atomic_init(&log_dropped, 0);
+    atomic_init(&log_stopping, false);
+    atomic_init(&log_signalled, false);
+
+    log_wake_fd = eventfd(0, EFD_CLOEXEC);
+    if(log_wake_fd < 0)
+        return false;
+
+    log_running = pthread_create(&log_thread, NULL, &run_log_writer, NULL) == 0;
+    if(!log_running)
+    {
+        close(log_wake_fd);
+        log_wake_fd = -1;
+    }
+    return log_running;
+};
+
+
+
+// Waits for every record already written to be printed
+void log_stop(void)
+{
+    if(!log_running)
+        return;
+
+    atomic_store_explicit(&log_stopping, true, memory_order_release);
+    uint64_t one = 1;
+    ssize_t written = write(log_wake_fd, &one, sizeof(one));
+    (void)written;
+    pthread_join(log_thread, NULL);
+
+    // Nobody is left to wake; any later record only fills the ring, and never writes to a reused descriptor
+    atomic_store(&log_signalled, true);
+    close(log_wake_fd);
+    log_wake_fd = -1;
+    log_running = false;
+};
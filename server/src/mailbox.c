@@ -0,0 +1,101 @@
+#include "mailbox.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+bool mailbox_init(mailbox_t *mailbox)
+{
+    atomic_init(&mailbox->stub.next, NULL);
+    atomic_init(&mailbox->head, &mailbox->stub);
+    mailbox->tail = &mailbox->stub;
+    atomic_init(&mailbox->signalled, false);
+
+    mailbox->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return mailbox->wake_fd >= 0;
+};
+
+
+
+static void mailbox_link(mailbox_t *mailbox, mailbox_node_t *node)
+{
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    mailbox_node_t *previous = atomic_exchange_explicit(&mailbox->head, node, memory_order_acq_rel);
+    atomic_store_explicit(&previous->next, node, memory_order_release);
+};
+
+
+
+// Only the first push after the consumer acknowledged its last wakeup pays for the eventfd write
+void mailbox_push(mailbox_t *mailbox, mailbox_node_t *node)
+{
+    mailbox_link(mailbox, node);
+    if(!atomic_exchange(&mailbox->signalled, true))
+        mailbox_wake(mailbox);
+};
+
+
+
+// Returns NULL when the mailbox is empty, or when a producer is part way through a push;
+// in the second case that producer's wakeup will bring the consumer back
+mailbox_node_t *mailbox_pop(mailbox_t *mailbox)
+{
+    mailbox_node_t *tail = mailbox->tail;
+    mailbox_node_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if(tail == &mailbox->stub)
+    {
+        if(next == NULL)
+            return NULL;
+        mailbox->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+
+    if(next != NULL)
+    {
+        mailbox->tail = next;
+        return tail;
+    }
+
+    if(tail != atomic_load_explicit(&mailbox->head, memory_order_acquire))
+        return NULL;
+
+    mailbox_link(mailbox, &mailbox->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if(next != NULL)
+    {
+        mailbox->tail = next;
+        return tail;
+    }
+
+    return NULL;
+};
+
+
+
+void mailbox_wake(mailbox_t *mailbox)
+{
+    uint64_t one = 1;
+    write(mailbox->wake_fd, &one, sizeof(one));
+};
+
+
+
+// Called by the consumer before draining, so anything pushed after this point signals again
+void mailbox_acknowledge(mailbox_t *mailbox)
+{
+    uint64_t count;
+    read(mailbox->wake_fd, &count, sizeof(count));
+    atomic_store(&mailbox->signalled, false);
+};
+
+
+
+void mailbox_destroy(mailbox_t *mailbox)
+{
+    close(mailbox->wake_fd);
+    mailbox->wake_fd = -1;
+};
@@ -1,261 +1,1089 @@
-#include <arpa/inet.h>
-#include <assert.h>
-#include <errno.h>
-#include <netinet/in.h>
-#include <poll.h>
-#include <signal.h>
-#include <stdbool.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <unistd.h>
-
-#include "connections.h"
-#include "event.h"
-#include "messages.h"
-
-#define MAX_CONTENT_LENGTH 1024
-
-static bool exiting = false;
-
-
-
-static void handle_signal(int signal_type)
-{
-    exiting = true;
-};
-
-
-
-static unsigned char username_request_message[] = "Enter username to begin chatting";
-static event_t username_request_event = {
-    .code = EVENT_USERNAME_REQUEST,
-    .originator_id = 0,
-    .content_length = sizeof(username_request_message)
-};
-
-
-
-static unsigned char username_accepted_message[] = "Username set";
-static event_t username_accepted_event = {
-    .code = EVENT_USERNAME_ACCEPTED,
-    .originator_id = 0,
-    .content_length = sizeof(username_accepted_message)
-};
-
-
-
-static event_t oversized_content_event = {
-    .code = EVENT_OVERSIZED_CONTENT,
-    .originator_id = 0,
-    .content_length = 0
-};
-
-
-
-int main(int argc, const char *argv[])
-{
-    struct sigaction signal_action = {.sa_handler = &handle_signal, .sa_flags = 0};
-    sigemptyset(&signal_action.sa_mask);
-    sigaction(SIGHUP, &signal_action, NULL);
-    sigaction(SIGINT, &signal_action, NULL);
-    sigaction(SIGABRT, &signal_action, NULL);
-    sigaction(SIGTERM, &signal_action, NULL);
-
-    int master_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if(master_socket < 0)
-    {
-        fprintf(stderr, "Unable to create socket;\n\t%s\n", strerror(errno));
-        return 1;
-    }
-
-    int opt = 1;
-    if(setsockopt(master_socket, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)))
-    {
-        fprintf(stderr, "Unable to set socket options;\n\t%s\n", strerror(errno));
-        return 1;
-    }
-
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(8080);
-    memset(address.sin_zero, 0, sizeof(address.sin_zero));
-    
-    if(bind(master_socket, (struct sockaddr *)&address, sizeof(address)) < 0)
-    {
-        fprintf(stderr, "Unable to bind;\n\t%s\n", strerror(errno));
-        return 1;
-    }
-    
-    if(listen(master_socket, 16) < 0)
-    {
-        fprintf(stderr, "Unable to listen;\n\t%s\n", strerror(errno));
-        return 1;
-    }
-
-    unsigned char buffer[1025];
-    memset(buffer, '\0', sizeof(buffer));
-
-    int addr_len = sizeof(address);
-
-    connections_t connections;
-    connections.count = 1;
-    connections.size = 8;
-    connections.users = calloc(connections.size, sizeof(user_t));
-    assert(connections.users != NULL);
-
-    connections.users[0].username = "Server";
-    connections.users[0].pollfd.fd = master_socket;
-    connections.users[0].pollfd.events = POLLIN;
-    connections.users[0].pollfd.revents = 0;
-
-    for(int i = 1; i < connections.size; i++)
-        connections.users[i] = blank_user;
-
-    printf("Server ready;\nWaiting for connections...\n");
-    while(!exiting)
-    {
-        if(!connections_update_fds(&connections))
-        {
-            fprintf(stderr, "Unable to update fds\n");
-            continue;
-        }
-        
-        for(int sender = 1; sender < connections.size; sender++)
-        {
-            if(connections.users[sender].state == USER_CONNECTED && connections.users[sender].pollfd.revents & POLLOUT)
-            {
-                send(connections.users[sender].pollfd.fd, &username_request_event, sizeof(event_t), 0);
-                send(connections.users[sender].pollfd.fd, &username_request_message, sizeof(username_request_message), 0);
-                connections.users[sender].state = USER_NO_USERNAME;
-            }
-
-            if(connections.users[sender].pollfd.revents & POLLIN)
-            {
-                event_t *incoming_event = malloc(sizeof(event_t));
-                assert(incoming_event != NULL); // REVIEW maybe don't assert in operating path
-                read(connections.users[sender].pollfd.fd, incoming_event, sizeof(event_t));
-                if(incoming_event->content_length > MAX_CONTENT_LENGTH)
-                {
-                    send(connections.users[sender].pollfd.fd, &oversized_content_event, sizeof(event_t), 0);
-                    
-                    unsigned char ignore_buffer;
-                    for(
-                        int i = 0;
-                        i < incoming_event->content_length
-                        && read(connections.users[sender].pollfd.fd, &ignore_buffer, 1) > 0;
-                        i++
-                    );
-
-                    free(incoming_event);
-                    continue;
-                }
-
-                incoming_event = realloc(incoming_event, sizeof(event_t) + incoming_event->content_length);
-                assert(incoming_event != NULL); // REVIEW maybe don't assert in operating path
-                read(connections.users[sender].pollfd.fd, incoming_event->content, incoming_event->content_length);
-                unsigned char *sanitized = NULL;
-                switch(incoming_event->code)
-                {
-                    case EVENT_USER_LEAVE:
-                    case EVENT_UNDEFINED:
-                    default:
-                        printf("Client %d disconnected\n", sender);
-                        size_t username_length = strlen(connections.users[sender].username) + 1;
-                        event_t *user_leave_event = malloc(sizeof(event_t) + username_length);
-                        if(user_leave_event != NULL)
-                        {
-                            user_leave_event->code = EVENT_USER_LEAVE;
-                            user_leave_event->originator_id = sender;
-                            user_leave_event->content_length = username_length;
-                            strcpy(user_leave_event->content, connections.users[sender].username);
-                            user_leave_event->content[username_length - 1] = '\0';
-
-                            connections_relay_event_from(&connections, user_leave_event, sender);
-                        }
-                        free(user_leave_event);
-                        connections_close_connection(&connections, sender);
-                        break;
-
-
-                    case EVENT_USERNAME_REQUEST:
-                    case EVENT_USERNAME_SUBMIT:
-                        if(connections.users[sender].state == USER_NO_USERNAME)
-                        {
-                            sanitized = allocate_sanitized_message(incoming_event->content);
-                            strcpy(connections.users[sender].username, sanitized);
-                            connections.users[sender].username[strlen(connections.users[sender].username)] = '\0';
-                            send(connections.users[sender].pollfd.fd, &username_accepted_event, sizeof(event_t), 0);
-                            send(connections.users[sender].pollfd.fd, &username_accepted_message, sizeof(username_accepted_message), 0);
-
-                            event_t *user_join_event = malloc(sizeof(event_t) + strlen(sanitized) + 1);
-                            if(user_join_event != NULL)
-                            {
-                                user_join_event->code = EVENT_USER_JOIN;
-                                user_join_event->originator_id = sender;
-                                user_join_event->content_length = strlen(sanitized) + 1;
-                                strcpy(user_join_event->content, sanitized);
-
-                                connections_relay_event_from(&connections, user_join_event, sender);
-                            }
-                            free(user_join_event);
-
-                            printf("Client %d set username as %s\n", sender, connections.users[sender].username);
-                            connections.users[sender].state = USER_ACTIVE;
-                        }
-                        break;
-
-
-                    case EVENT_MESSAGE:
-                        if(connections.users[sender].state >= USER_ACTIVE)
-                        {
-                            sanitized = allocate_sanitized_message(incoming_event->content);
-                            printf("Got message from client %d:\n%s\n", sender, sanitized);
-                            connections_relay_message_from(&connections, sanitized, sender);
-                        }
-                        break;
-
-                    case EVENT_USERNAME_ACCEPTED:
-                    case EVENT_USERNAME_REJECTED:
-                    case EVENT_CONNECTION_FAILED:
-                    case EVENT_SERVER_SHUTDOWN:
-                    case EVENT_USER_LIST:
-                    case EVENT_USER_JOIN:
-                        // no op
-                }
-
-                free(sanitized);
-                free(incoming_event);
-            }
-        }
-
-        // new connection
-        if(connections.users[0].pollfd.revents & POLLIN)
-        {
-            addr_len = sizeof(address);
-            int new_connection = accept(master_socket, (struct sockaddr *)&address, (socklen_t *)&addr_len);
-            if(new_connection < 0)
-            {
-                fprintf(stderr, "New connection failed to accept;\n\t%s\n", strerror(errno));
-                continue;
-            }
-
-            int add_connection_result = connections_add_connection(&connections, new_connection, sizeof(buffer));
-            if(add_connection_result <= 0)
-            {
-                fprintf(stderr, "Unable to allocate memory for new connection\n");
-                continue;
-            }
-            printf("New connection as client %d\n", add_connection_result);
-        }
-    }
-
-    printf("\nShutting down\n");
-    connections_shutdown(&connections);
-    shutdown(master_socket, SHUT_RDWR);
-    close(master_socket);
-    return 0;
-};
\ No newline at end of file
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bucket.h"
+#include "connections.h"
+#include "event.h"
+#include "history.h"
+#include "journal.h"
+#include "log.h"
+#include "messages.h"
+#include "metrics.h"
+#include "packet.h"
+#include "pool.h"
+#include "reader.h"
+#include "ring.h"
+#include "rooms.h"
+#include "timers.h"
+#include "wire.h"
+#include "workers.h"
+
+#define THROTTLE_NOTICE_NS 1000000000ULL // A client kept at its limit hears about it once a second, not once an event
+
+static volatile sig_atomic_t exiting = false;
+static unsigned int sanitize_flags = 0;
+
+
+
+static void handle_signal(int signal_type)
+{
+    exiting = true;
+};
+
+
+
+// SIGUSR1 logs more, SIGUSR2 logs less
+static void handle_log_signal(int signal_type)
+{
+    int level = atomic_load_explicit(&log_threshold, memory_order_relaxed);
+    log_set_level(signal_type == SIGUSR1 ? level - 1 : level + 1);
+};
+
+
+
+static unsigned char username_request_message[] = "Enter username to begin chatting";
+static unsigned char username_accepted_message[] = "Username set";
+static unsigned char username_taken_message[] = "Username is already taken";
+static unsigned char username_invalid_message[] = "Usernames must be 1 to 32 printable characters";
+static unsigned char throttled_message[] = "Sending too fast; the rest waits until your rate allows";
+
+// Built once at startup and shared by every worker; each send only takes a reference
+static packet_t *username_request_packet = NULL;
+static packet_t *username_accepted_packet = NULL;
+static packet_t *username_taken_packet = NULL;
+static packet_t *username_invalid_packet = NULL;
+static packet_t *oversized_content_packet = NULL;
+static packet_t *hello_packet = NULL;
+static packet_t *hello_deflate_packet = NULL;
+static packet_t *ping_packet = NULL;
+static packet_t *pong_packet = NULL;
+static packet_t *throttled_packet = NULL;
+
+
+
+static bool create_server_packets(void)
+{
+    username_request_packet = packet_create_event(EVENT_USERNAME_REQUEST, 0, username_request_message, sizeof(username_request_message));
+    username_accepted_packet = packet_create_event(EVENT_USERNAME_ACCEPTED, 0, username_accepted_message, sizeof(username_accepted_message));
+    username_taken_packet = packet_create_event(EVENT_USERNAME_REJECTED, 0, username_taken_message, sizeof(username_taken_message));
+    username_invalid_packet = packet_create_event(EVENT_USERNAME_REJECTED, 0, username_invalid_message, sizeof(username_invalid_message));
+    oversized_content_packet = packet_create_event(EVENT_OVERSIZED_CONTENT, 0, NULL, 0);
+    ping_packet = packet_create_event(EVENT_PING, 0, NULL, 0);
+    pong_packet = packet_create_event(EVENT_PONG, 0, NULL, 0);
+    throttled_packet = packet_create_event(EVENT_THROTTLED, 0, throttled_message, sizeof(throttled_message));
+
+    unsigned char hello[WIRE_HELLO_SIZE];
+    hello_packet = packet_create_raw(hello, wire_put_hello(hello, WIRE_VERSION, 0));
+    hello_deflate_packet = packet_create_raw(hello, wire_put_hello(hello, WIRE_VERSION, WIRE_FLAG_DEFLATE));
+
+    return username_request_packet != NULL && username_accepted_packet != NULL && username_taken_packet != NULL
+        && username_invalid_packet != NULL && oversized_content_packet != NULL && hello_packet != NULL
+        && hello_deflate_packet != NULL && ping_packet != NULL && pong_packet != NULL && throttled_packet != NULL;
+};
+
+
+
+static void release_server_packets(void)
+{
+    packet_release(username_request_packet);
+    packet_release(username_accepted_packet);
+    packet_release(username_taken_packet);
+    packet_release(username_invalid_packet);
+    packet_release(oversized_content_packet);
+    packet_release(hello_packet);
+    packet_release(hello_deflate_packet);
+    packet_release(ping_packet);
+    packet_release(pong_packet);
+    packet_release(throttled_packet);
+};
+
+
+
+// Nothing is sent until the client's first bytes show which protocol it speaks, or PROTOCOL_SNIFF_MS pass
+// without any, so the greeting arrives in a layout the client can read
+static void greet_client(connections_t *connections, int sender)
+{
+    connections_send_user_list(connections, sender);
+    connections_send_history(connections, sender);
+    connections_send(connections, sender, username_request_packet);
+    connections_user(connections, sender)->state = USER_NO_USERNAME;
+};
+
+
+
+// Called as the user becomes active: their timer still holds the handshake deadline, so it is moved to the
+// idle timeout. A legacy client has no EVENT_PING to answer, so it is never pinged; the kernel's keepalive
+// probes stand in for the heartbeat, finding a peer that is gone rather than quiet.
+static void start_heartbeat(connections_t *connections, int sender)
+{
+    user_t *user = connections_user(connections, sender);
+    if(connections->config.idle_timeout_ms == 0)
+        return;
+
+    if(user->reader.version != WIRE_VERSION_LEGACY)
+    {
+        connections_arm_timer(connections, sender, &user->timer, user->heard_ns + (uint64_t)connections->config.idle_timeout_ms * 1000000);
+        return;
+    }
+
+    int on = 1;
+    int idle_seconds = connections->config.idle_timeout_ms < 1000 ? 1 : connections->config.idle_timeout_ms / 1000;
+    int probes = 1;
+    if(setsockopt(user->fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on))
+        || setsockopt(user->fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle_seconds, sizeof(idle_seconds))
+        || setsockopt(user->fd, IPPROTO_TCP, TCP_KEEPINTVL, &idle_seconds, sizeof(idle_seconds))
+        || setsockopt(user->fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes)))
+        LOG_WARN("keepalive_failed", LOG_INT("client", connections_client_id(connections, sender)));
+};
+
+
+
+// received_ns is when the bytes holding the event were read
+static void handle_event_from(connections_t *connections, int sender, event_t *incoming_event, uint64_t received_ns)
+{
+    // Sanitized in place; the frame buffer always has room for the terminator
+    unsigned char *sanitized = incoming_event->content;
+    size_t sanitized_length = 0;
+    switch(incoming_event->code)
+    {
+        case EVENT_USER_LEAVE:
+        case EVENT_UNDEFINED:
+        default:
+            connections_disconnect(connections, sender);
+            break;
+
+
+        case EVENT_USERNAME_REQUEST:
+        case EVENT_USERNAME_SUBMIT:
+            if(connections_user(connections, sender)->state == USER_NO_USERNAME)
+            {
+                sanitized_length = sanitize_message(sanitized, incoming_event->content, incoming_event->content_length, sanitize_flags);
+
+                // A rejected user stays at USER_NO_USERNAME and may submit again
+                if(sanitized_length == 0 || sanitized_length > MAX_USERNAME_LENGTH)
+                {
+                    connections_send(connections, sender, username_invalid_packet);
+                    break;
+                }
+
+                enum directory_result listed = directory_add(connections->directory, connections_client_id(connections, sender), sanitized, ROOM_LOBBY);
+                if(listed == DIRECTORY_DUPLICATE)
+                {
+                    connections_send(connections, sender, username_taken_packet);
+                    break;
+                }
+                if(listed != DIRECTORY_ADDED)
+                {
+                    LOG_ERROR("directory_add_failed", LOG_INT("client", connections_client_id(connections, sender)));
+                    connections_disconnect(connections, sender);
+                    break;
+                }
+
+                memcpy(connections_user(connections, sender)->username, sanitized, sanitized_length + 1);
+                connections_send(connections, sender, username_accepted_packet);
+                if(!connections_join_room(connections, sender, ROOM_LOBBY, ROOM_LOBBY_NAME))
+                {
+                    directory_remove(connections->directory, connections_client_id(connections, sender), sanitized);
+                    connections_disconnect(connections, sender);
+                    break;
+                }
+
+                packet_t *user_join_packet = packet_create_event(EVENT_USER_JOIN, connections_client_id(connections, sender), sanitized, sanitized_length + 1);
+                if(user_join_packet != NULL)
+                    connections_relay_packet_from(connections, user_join_packet, sender);
+                packet_release(user_join_packet);
+
+                LOG_INFO("username_set", LOG_INT("client", connections_client_id(connections, sender)),
+                    LOG_STR("username", connections_user(connections, sender)->username));
+                connections_user(connections, sender)->state = USER_ACTIVE;
+                start_heartbeat(connections, sender);
+            }
+            break;
+
+
+        case EVENT_MESSAGE:
+            if(connections_user(connections, sender)->state >= USER_ACTIVE)
+            {
+                uint64_t sanitize_start = metrics_now();
+                sanitize_message(sanitized, incoming_event->content, incoming_event->content_length, sanitize_flags);
+                metrics_record_since(&connections->metrics, METRICS_STAGE_SANITIZE, sanitize_start);
+                LOG_DEBUG("message", LOG_INT("client", connections_client_id(connections, sender)), LOG_STR("text", sanitized));
+                connections_relay_message_from(connections, sanitized, sender, received_ns);
+            }
+            break;
+
+
+        case EVENT_ROOM_JOIN:
+            if(connections_user(connections, sender)->state >= USER_ACTIVE)
+            {
+                sanitized_length = sanitize_message(sanitized, incoming_event->content, incoming_event->content_length, sanitize_flags);
+                if(sanitized_length >= ROOM_NAME_LENGTH)
+                {
+                    // Cut before, not inside, a UTF-8 character
+                    size_t cut = ROOM_NAME_LENGTH - 1;
+                    while(cut > 0 && (sanitized[cut] & 0xC0) == 0x80)
+                        cut--;
+                    sanitized[cut] = '\0';
+                }
+                if(sanitized[0] != '\0')
+                    connections_enter_room(connections, sender, sanitized);
+            }
+            break;
+
+
+        case EVENT_ROOM_PART:
+            if(connections_user(connections, sender)->state >= USER_ACTIVE)
+                connections_enter_room(connections, sender, ROOM_LOBBY_NAME);
+            break;
+
+
+        case EVENT_PING:
+            connections_send(connections, sender, pong_packet);
+            break;
+
+        case EVENT_USERNAME_ACCEPTED:
+        case EVENT_USERNAME_REJECTED:
+        case EVENT_CONNECTION_FAILED:
+        case EVENT_SERVER_SHUTDOWN:
+        case EVENT_USER_LIST:
+        case EVENT_USER_JOIN:
+        case EVENT_PONG:
+        case EVENT_THROTTLED:
+            // no op; hearing from the client at all is what counts
+    }
+};
+
+
+
+// Whether another event from the user may be handled now: they must have credit, and so must the room they
+// are in when the event is a message. If not they are throttled, told so at most once a THROTTLE_NOTICE_NS,
+// and not read again until the credit is there.
+static bool admit_from(connections_t *connections, int sender, uint64_t now, bool message)
+{
+    user_t *user = connections_user(connections, sender);
+    uint64_t resume_ns = 0;
+    if(!bucket_ready(&user->bucket, &connections->config.user_limit, now))
+        resume_ns = bucket_ready_at(&user->bucket, &connections->config.user_limit);
+
+    bucket_t *room_bucket = message ? rooms_bucket(&connections->rooms, user->room) : NULL;
+    if(room_bucket != NULL && !bucket_ready(room_bucket, &connections->config.room_limit, now))
+    {
+        uint64_t room_resume_ns = bucket_ready_at(room_bucket, &connections->config.room_limit);
+        if(room_resume_ns > resume_ns)
+            resume_ns = room_resume_ns;
+    }
+    if(resume_ns == 0)
+        return true;
+
+    user->throttled = true;
+    connections_arm_timer(connections, sender, &user->throttle_timer, resume_ns);
+    metrics_add(&connections->metrics.throttled, 1);
+    if(user->throttle_notified_ns == 0 || now - user->throttle_notified_ns >= THROTTLE_NOTICE_NS)
+    {
+        LOG_DEBUG("client_throttled", LOG_INT("client", connections_client_id(connections, sender)));
+        connections_send(connections, sender, throttled_packet);
+        user->throttle_notified_ns = now;
+    }
+    return false;
+};
+
+
+
+// Handles every whole frame in the input while the user has credit; whatever is left when they run out
+// stays in input for the caller to hold on to
+static void handle_input(connections_t *connections, int sender, event_t *incoming_event, const unsigned char **input, size_t *input_length, uint64_t received_ns)
+{
+    user_t *user = connections_user(connections, sender);
+    while(*input_length > 0 && user->state != USER_UNINITIALIZED && !user->evicting)
+    {
+        // Only a message needs its room's credit, so leaving or answering a ping still works in a busy room
+        enum event_code code;
+        bool message = reader_peek_code(&user->reader, *input, *input_length, &code) && code == EVENT_MESSAGE;
+        if(!admit_from(connections, sender, received_ns, message))
+            break;
+
+        enum reader_result result = reader_next(&user->reader, input, input_length, incoming_event);
+        if(result == READER_NEED_MORE)
+            break;
+        if(result == READER_SKIPPED)
+            continue;
+
+        bucket_take(&user->bucket, &connections->config.user_limit);
+        if(result == READER_ERROR || result == READER_MALFORMED)
+        {
+            LOG_WARN("event_rejected", LOG_INT("client", connections_client_id(connections, sender)),
+                LOG_STR("reason", result == READER_ERROR ? "buffer partial" : "malformed"));
+            connections_disconnect(connections, sender);
+            break;
+        }
+
+        // The echoed hello tells the client which of the flags it asked for are on; deflate is the only one
+        // there is, and it stays off when the server never deflates
+        if(result == READER_HELLO)
+        {
+            user->reader.flags &= connections->config.deflate_bytes > 0 ? WIRE_FLAG_DEFLATE : 0;
+            connections_send(connections, sender, user->reader.flags & WIRE_FLAG_DEFLATE ? hello_deflate_packet : hello_packet);
+            if(user->state == USER_CONNECTED)
+                greet_client(connections, sender);
+            continue;
+        }
+
+        // A legacy client starts sending events without a hello
+        if(user->state == USER_CONNECTED)
+            greet_client(connections, sender);
+
+        if(result == READER_OVERSIZED)
+        {
+            connections_send(connections, sender, oversized_content_packet);
+            continue;
+        }
+
+        bucket_t *room_bucket = rooms_bucket(&connections->rooms, user->room);
+        if(incoming_event->code == EVENT_MESSAGE && room_bucket != NULL)
+            bucket_take(room_bucket, &connections->config.room_limit);
+
+        metrics_add(&connections->metrics.events_received[metrics_event_slot(incoming_event->code)], 1);
+        handle_event_from(connections, sender, incoming_event, received_ns);
+    }
+};
+
+
+
+// Keeps the unhandled rest of the input, which may already be the held input itself, for when the user is read again
+static bool hold_input(user_t *user, const unsigned char *input, size_t input_length)
+{
+    if(input_length == 0)
+    {
+        free(user->held);
+        user->held = NULL;
+        user->held_length = 0;
+        return true;
+    }
+
+    if(user->held != NULL && input >= user->held && input < user->held + user->held_length)
+    {
+        memmove(user->held, input, input_length);
+        user->held_length = input_length;
+        return true;
+    }
+
+    unsigned char *held = realloc(user->held, input_length);
+    if(held == NULL)
+        return false;
+    memcpy(held, input, input_length);
+    user->held = held;
+    user->held_length = input_length;
+    return true;
+};
+
+
+
+// Adds input behind whatever is already held
+static bool hold_more(user_t *user, const unsigned char *input, size_t input_length)
+{
+    unsigned char *held = realloc(user->held, user->held_length + input_length);
+    if(held == NULL)
+        return false;
+    memcpy(&held[user->held_length], input, input_length);
+    user->held = held;
+    user->held_length += input_length;
+    return true;
+};
+
+
+
+// Bytes just received from the user, however they were read. What the user has credit for is handled and the
+// rest held. With io_uring bytes can still arrive after the user was throttled, until their receive is
+// cancelled; those go behind what is already held.
+static void handle_received(connections_t *connections, int sender, event_t *incoming_event, const unsigned char *input, size_t input_length, uint64_t received_ns)
+{
+    user_t *user = connections_user(connections, sender);
+    metrics_add(&connections->metrics.bytes_received, input_length);
+    user->heard_ns = received_ns;
+    user->pinged = false;
+
+    bool held;
+    if(user->throttled)
+        held = hold_more(user, input, input_length);
+    else
+    {
+        handle_input(connections, sender, incoming_event, &input, &input_length, received_ns);
+        held = input_length == 0 || user->state == USER_UNINITIALIZED || hold_input(user, input, input_length);
+    }
+
+    if(!held)
+    {
+        LOG_ERROR("hold_failed", LOG_INT("client", connections_client_id(connections, sender)));
+        connections_disconnect(connections, sender);
+    }
+};
+
+
+
+// The sockets are edge-triggered, so keep reading until the kernel has nothing more for us;
+// every read may complete any number of frames, and a partial frame is kept in the user's reader.
+// A throttled user is left unread, their data waiting in the kernel, until their throttle timer
+// comes up; what was already read when they ran out of credit is held and handled first.
+static void handle_events_from(connections_t *connections, int sender)
+{
+    static _Thread_local unsigned char receive_buffer[RECEIVE_BUFFER_SIZE];
+
+    user_t *user = connections_user(connections, sender);
+    if(user->throttled)
+        return;
+
+    event_t *incoming_event = pool_alloc(sizeof(event_t) + MAX_CONTENT_LENGTH + 1);
+    if(incoming_event == NULL)
+    {
+        LOG_ERROR("event_alloc_failed", LOG_INT("client", connections_client_id(connections, sender)));
+        return;
+    }
+
+    if(user->held_length > 0)
+    {
+        const unsigned char *input = user->held;
+        size_t input_length = user->held_length;
+        handle_input(connections, sender, incoming_event, &input, &input_length, metrics_now());
+        if(user->state != USER_UNINITIALIZED)
+            hold_input(user, input, input_length);
+    }
+
+    // With io_uring the bytes come to handle_received as they arrive; all that is left is asking for more
+    if(connections->ring != NULL)
+    {
+        if(user->state != USER_UNINITIALIZED && user->throttled)
+            connections_pause_receive(connections, sender);
+        else if(user->state != USER_UNINITIALIZED)
+            connections_receive(connections, sender);
+        pool_free(incoming_event);
+        return;
+    }
+
+    while(user->state != USER_UNINITIALIZED && !user->evicting && !user->throttled)
+    {
+        uint64_t read_start = metrics_now();
+        ssize_t read_result = read(user->fd, receive_buffer, sizeof(receive_buffer));
+        uint64_t received_ns = metrics_now();
+        if(read_result < 0 && errno == EINTR)
+            continue;
+        if(read_result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if(read_result <= 0)
+        {
+            connections_disconnect(connections, sender);
+            break;
+        }
+
+        histogram_record(&connections->metrics.stages[METRICS_STAGE_RECEIVE], received_ns - read_start);
+        handle_received(connections, sender, incoming_event, receive_buffer, read_result, received_ns);
+    }
+
+    pool_free(incoming_event);
+};
+
+
+
+// A user's deadline came up. A throttled user has credit again and is read. Otherwise, until they have a
+// username it is the protocol sniff, then the handshake deadline; after, the heartbeat: a user silent for the
+// idle timeout is pinged, and dropped if still silent after as long again. Legacy users are left to keepalive.
+static void handle_timeout(void *context, wheel_timer_t *timer)
+{
+    connections_t *connections = context;
+    unsigned int index = timer->owner;
+    user_t *user = connections_user(connections, index);
+    if(user->state == USER_UNINITIALIZED || user->evicting)
+        return;
+
+    if(timer == &user->throttle_timer)
+    {
+        user->throttled = false;
+        handle_events_from(connections, index);
+        return;
+    }
+
+    uint64_t now = metrics_now();
+    if(user->state < USER_ACTIVE)
+    {
+        uint64_t handshake_deadline = user->connected_ns + (uint64_t)connections->config.handshake_timeout_ms * 1000000;
+        if(now >= handshake_deadline)
+        {
+            LOG_INFO("handshake_timeout", LOG_INT("client", connections_client_id(connections, index)));
+            metrics_add(&connections->metrics.timed_out, 1);
+            connections_disconnect(connections, index);
+            return;
+        }
+
+        // A v2 client says hello as soon as it connects; one that has sent nothing at all is a legacy
+        // client waiting to be asked for its username. Bytes already waiting just have not been read yet.
+        unsigned char first_byte;
+        if(user->state == USER_CONNECTED && user->heard_ns == user->connected_ns
+            && recv(user->fd, &first_byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            LOG_DEBUG("protocol_guessed", LOG_INT("client", connections_client_id(connections, index)), LOG_STR("protocol", "legacy"));
+            user->reader.version = WIRE_VERSION_LEGACY;
+            greet_client(connections, index);
+        }
+        connections_arm_timer(connections, index, &user->timer, handshake_deadline);
+        return;
+    }
+
+    if(connections->config.idle_timeout_ms == 0 || user->reader.version == WIRE_VERSION_LEGACY)
+        return;
+
+    uint64_t idle_timeout = (uint64_t)connections->config.idle_timeout_ms * 1000000;
+    if(now < user->heard_ns + idle_timeout)
+    {
+        connections_arm_timer(connections, index, &user->timer, user->heard_ns + idle_timeout);
+        return;
+    }
+
+    if(user->pinged)
+    {
+        LOG_INFO("idle_timeout", LOG_INT("client", connections_client_id(connections, index)));
+        metrics_add(&connections->metrics.timed_out, 1);
+        connections_disconnect(connections, index);
+        return;
+    }
+
+    connections_send(connections, index, ping_packet);
+    user->pinged = true;
+    connections_arm_timer(connections, index, &user->timer, now + idle_timeout);
+};
+
+
+
+static void add_client(connections_t *connections, int new_connection, size_t username_size)
+{
+    int add_connection_result = connections_add_connection(connections, new_connection, username_size);
+    if(add_connection_result <= 0)
+    {
+        LOG_ERROR("connection_alloc_failed", LOG_INT("fd", new_connection));
+        return;
+    }
+
+    LOG_INFO("client_connected", LOG_INT("client", connections_client_id(connections, add_connection_result)));
+};
+
+
+
+static void accept_connections(connections_t *connections, int master_socket, size_t username_size)
+{
+    struct sockaddr_in address;
+    socklen_t addr_len;
+    while(true)
+    {
+        addr_len = sizeof(address);
+        int new_connection = accept4(master_socket, (struct sockaddr *)&address, &addr_len, SOCK_NONBLOCK);
+        if(new_connection < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                LOG_ERROR("accept_failed", LOG_STR("error", strerror(errno)));
+            return;
+        }
+
+        add_client(connections, new_connection, username_size);
+    }
+};
+
+
+
+// A multishot receive delivered bytes, in a buffer that goes straight back to the ring, or ended: at the end
+// of the stream, on an error, when the buffers ran out, or cancelled for a throttle. Unless the user is gone
+// it is armed again.
+static void handle_receive_completion(connections_t *connections, uint32_t tag, const ring_completion_t *completion)
+{
+    int sender = connections_index_for_tag(connections, tag);
+    if(completion->has_buffer)
+    {
+        if(sender != 0 && completion->result > 0)
+        {
+            event_t *incoming_event = pool_alloc(sizeof(event_t) + MAX_CONTENT_LENGTH + 1);
+            if(incoming_event != NULL)
+            {
+                handle_received(connections, sender, incoming_event, ring_buffer(connections->ring, completion->buffer),
+                    completion->result, metrics_now());
+                pool_free(incoming_event);
+            }
+            else
+                LOG_ERROR("event_alloc_failed", LOG_INT("client", connections_client_id(connections, sender)));
+        }
+        ring_recycle(connections->ring, completion->buffer);
+    }
+    else if(sender != 0 && completion->result != -ENOBUFS && completion->result != -ECANCELED)
+        connections_disconnect(connections, sender);
+
+    // Handling may have closed the connection, and the slot may even belong to someone new by now
+    sender = connections_index_for_tag(connections, tag);
+    if(sender == 0)
+        return;
+
+    user_t *user = connections_user(connections, sender);
+    if(!completion->more)
+    {
+        user->receiving = false;
+        user->cancelling = false;
+        connections_receive(connections, sender);
+    }
+    else if(user->throttled)
+        connections_pause_receive(connections, sender);
+};
+
+
+
+// Everything the ring finished since the last loop: new connections, received bytes, sends and mail.
+// The kernel may post a send's completion behind receives it ran after, and until it is seen the user's
+// queue cannot be written, however much those receives add to it, so sends are taken first in each batch.
+static void handle_completions(worker_t *worker)
+{
+    connections_t *connections = &worker->connections;
+    ring_completion_t batch[RING_BATCH];
+    size_t count;
+    do
+    {
+        count = 0;
+        while(count < RING_BATCH && ring_next(connections->ring, &batch[count]))
+            count++;
+
+        for(size_t i = 0; i < count; i++)
+        {
+            if(RING_DATA_OP(batch[i].user_data) == RING_OP_SEND)
+                connections_complete_send(connections, batch[i].user_data, batch[i].result);
+        }
+
+        for(size_t i = 0; i < count; i++)
+        {
+            ring_completion_t completion = batch[i];
+            uint32_t tag = RING_DATA_TAG(completion.user_data);
+            switch(RING_DATA_OP(completion.user_data))
+            {
+                case RING_OP_ACCEPT:
+                    if(completion.result >= 0)
+                        add_client(connections, completion.result, MAX_USERNAME_LENGTH + 1);
+                    else if(completion.result != -ECANCELED)
+                        LOG_ERROR("accept_failed", LOG_STR("error", strerror(-completion.result)));
+                    if(!completion.more && !connections_accept(connections))
+                        LOG_ERROR("accept_failed", LOG_STR("error", "unable to arm accept"));
+                    break;
+
+                case RING_OP_RECEIVE:
+                    handle_receive_completion(connections, tag, &completion);
+                    break;
+
+                case RING_OP_WRITABLE:
+                {
+                    unsigned int index = connections_index_for_tag(connections, tag);
+                    if(index != 0)
+                        connections_writable(connections, index);
+                    break;
+                }
+
+                case RING_OP_WATCH:
+                    if(tag == MAILBOX_TAG)
+                        workers_deliver_mail(worker);
+                    if(!completion.more)
+                        connections_watch(connections, worker->mailbox.wake_fd, MAILBOX_TAG);
+                    break;
+
+                case RING_OP_SEND:
+                case RING_OP_CANCEL:
+                default:
+                    break;
+            }
+        }
+    } while(count == RING_BATCH);
+};
+
+
+
+static bool worker_running(const worker_t *worker)
+{
+    // Only worker 0 runs on the thread that takes signals; it stops the others on its way out
+    if(worker->index == 0)
+        return !exiting;
+    return !atomic_load(&worker->workers->stopping);
+};
+
+
+
+static void *run_worker(void *argument)
+{
+    worker_t *worker = argument;
+    connections_t *connections = &worker->connections;
+
+    // The ring has to be made by the thread that uses it
+    if(connections->config.io_uring)
+    {
+        if(connections_use_ring(connections) && connections_watch(connections, worker->mailbox.wake_fd, MAILBOX_TAG))
+            LOG_INFO("io_backend", LOG_INT("worker", worker->index), LOG_STR("backend", "io_uring"));
+        else
+            LOG_WARN("io_uring_unavailable", LOG_INT("worker", worker->index), LOG_STR("error", strerror(errno)));
+    }
+
+    while(worker_running(worker))
+    {
+        int ready_count = connections_wait(connections);
+        if(ready_count < 0)
+        {
+            if(errno != EINTR)
+                LOG_ERROR("wait_failed", LOG_INT("worker", worker->index), LOG_STR("error", strerror(errno)));
+            continue;
+        }
+
+        if(connections->ring != NULL)
+            handle_completions(worker);
+
+        for(int i = 0; i < ready_count && connections->ring == NULL; i++)
+        {
+            uint32_t tag = connections->ready[i].data.u32;
+            uint32_t ready_events = connections->ready[i].events;
+
+            if(tag == MAILBOX_TAG)
+            {
+                workers_deliver_mail(worker);
+                continue;
+            }
+
+            // new connection
+            if(tag == 0)
+            {
+                accept_connections(connections, worker->listener, MAX_USERNAME_LENGTH + 1);
+                continue;
+            }
+
+            int sender = connections_index_for_tag(connections, tag);
+            if(sender == 0)
+                continue;
+
+            if(ready_events & EPOLLOUT)
+                connections_flush(connections, sender);
+
+            if(ready_events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                handle_events_from(connections, sender);
+        }
+
+        timer_wheel_expire(&connections->timers, metrics_now(), &handle_timeout, connections);
+        connections_flush_pending(connections);
+        connections_reap(connections);
+        connections_publish_metrics(connections);
+    }
+
+    char worker_name[32];
+    snprintf(worker_name, sizeof(worker_name), "Worker %u", worker->index);
+    connections_print_write_stats(connections, worker_name);
+
+    connections_shutdown(connections);
+    packet_thread_exit();
+    pool_print_stats(pool_for_thread(), worker_name);
+    return NULL;
+};
+
+
+
+// Every worker gets its own listener on the same port; SO_REUSEPORT has the kernel spread connections between them
+static int open_listener(unsigned short port)
+{
+    int master_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(master_socket < 0)
+    {
+        fprintf(stderr, "Unable to create socket;\n\t%s\n", strerror(errno));
+        return -1;
+    }
+
+    int opt = 1;
+    if(setsockopt(master_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))
+        || setsockopt(master_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)))
+    {
+        fprintf(stderr, "Unable to set socket options;\n\t%s\n", strerror(errno));
+        close(master_socket);
+        return -1;
+    }
+
+    struct sockaddr_in address;
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    memset(address.sin_zero, 0, sizeof(address.sin_zero));
+
+    if(bind(master_socket, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        fprintf(stderr, "Unable to bind;\n\t%s\n", strerror(errno));
+        close(master_socket);
+        return -1;
+    }
+
+    if(listen(master_socket, SOMAXCONN) < 0)
+    {
+        fprintf(stderr, "Unable to listen;\n\t%s\n", strerror(errno));
+        close(master_socket);
+        return -1;
+    }
+
+    return master_socket;
+};
+
+
+
+// Only the lobby outlives a restart; every other room is empty, and so closed, until someone joins it again
+static void rebuild_history(void *context, const journal_record_t *record)
+{
+    history_t *lobby_history = context;
+    if(record->code != EVENT_MESSAGE || record->room_length != strlen(ROOM_LOBBY_NAME)
+        || memcmp(record->room, ROOM_LOBBY_NAME, record->room_length) != 0)
+        return;
+
+    packet_t *message_packet = packet_create_event(EVENT_MESSAGE, record->originator_id, record->content, record->content_length);
+    if(message_packet != NULL)
+        history_append(lobby_history, message_packet);
+    packet_release(message_packet);
+};
+
+
+
+// rate[:burst], in events a second; the burst defaults to a second's worth. A zero rate is no limit.
+static bool parse_limit(const char *text, bucket_limit_t *limit)
+{
+    char *end;
+    limit->rate = strtod(text, &end);
+    limit->burst = limit->rate;
+    if(*end == ':')
+        limit->burst = strtod(end + 1, &end);
+
+    return *end == '\0' && limit->rate >= 0 && (limit->rate == 0 || limit->burst >= 1);
+};
+
+
+
+static void print_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-q outbound_queue_bytes] [-b flush_bytes] [-d flush_delay_us] [-t handshake_timeout_ms] [-i idle_timeout_ms] [-r user_rate[:burst]] [-R room_rate[:burst]] [-w workers] [-e epoll|uring] [-z deflate_bytes] [-j journal_directory] [-l debug|info|warn|error] [-m metrics_socket] [-u]\n", program);
+};
+
+
+
+int main(int argc, char *argv[])
+{
+    connections_config_t config = {
+        .outbound_cap = DEFAULT_OUTBOUND_CAP,
+        .flush_bytes = DEFAULT_FLUSH_BYTES,
+        .flush_delay_us = DEFAULT_FLUSH_DELAY_US,
+        .handshake_timeout_ms = DEFAULT_HANDSHAKE_TIMEOUT_MS,
+        .idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS,
+        .user_limit = {.rate = DEFAULT_USER_RATE, .burst = DEFAULT_USER_BURST},
+        .room_limit = {.rate = DEFAULT_ROOM_RATE, .burst = DEFAULT_ROOM_BURST},
+        .io_uring = false,
+        .deflate_bytes = DEFAULT_DEFLATE_BYTES
+    };
+    unsigned int worker_count = 1;
+    const char *journal_directory = NULL;
+    enum log_level level = LOG_LEVEL_INFO;
+    const char *metrics_path = NULL;
+
+    int option;
+    while((option = getopt(argc, argv, "q:b:d:t:i:r:R:w:e:z:j:l:m:u")) != -1)
+    {
+        switch(option)
+        {
+            case 'q':
+                config.outbound_cap = strtoul(optarg, NULL, 10);
+                if(config.outbound_cap == 0)
+                {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+
+            case 'b':
+                config.flush_bytes = strtoul(optarg, NULL, 10);
+                if(config.flush_bytes == 0)
+                {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+
+            case 'd':
+                config.flush_delay_us = strtoul(optarg, NULL, 10);
+                break;
+
+            case 't':
+                config.handshake_timeout_ms = strtoul(optarg, NULL, 10);
+                if(config.handshake_timeout_ms <= PROTOCOL_SNIFF_MS)
+                {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+
+            case 'i':
+                config.idle_timeout_ms = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'r':
+            case 'R':
+                if(!parse_limit(optarg, option == 'r' ? &config.user_limit : &config.room_limit))
+                {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+
+            case 'e':
+                if(strcmp(optarg, "uring") != 0 && strcmp(optarg, "epoll") != 0)
+                {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                config.io_uring = strcmp(optarg, "uring") == 0;
+                break;
+
+            case 'z':
+                config.deflate_bytes = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'j':
+                journal_directory = optarg;
+                break;
+
+            case 'l':
+                if(!log_parse_level(optarg, &level))
+                {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+
+            case 'm':
+                metrics_path = optarg;
+                break;
+
+            case 'u':
+                sanitize_flags |= SANITIZE_UTF8;
+                break;
+
+            case 'w':
+                worker_count = strtoul(optarg, NULL, 10);
+                if(worker_count == 0 || worker_count > MAX_WORKERS)
+                {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    struct sigaction signal_action = {.sa_handler = &handle_signal, .sa_flags = 0};
+    sigemptyset(&signal_action.sa_mask);
+    sigaction(SIGHUP, &signal_action, NULL);
+    sigaction(SIGINT, &signal_action, NULL);
+    sigaction(SIGABRT, &signal_action, NULL);
+    sigaction(SIGTERM, &signal_action, NULL);
+
+    struct sigaction log_signal_action = {.sa_handler = &handle_log_signal, .sa_flags = SA_RESTART};
+    sigemptyset(&log_signal_action.sa_mask);
+    sigaction(SIGUSR1, &log_signal_action, NULL);
+    sigaction(SIGUSR2, &log_signal_action, NULL);
+
+    if(!create_server_packets())
+    {
+        fprintf(stderr, "Unable to allocate server events\n");
+        return 1;
+    }
+
+    int listeners[MAX_WORKERS];
+    for(unsigned int i = 0; i < worker_count; i++)
+    {
+        listeners[i] = open_listener(8080);
+        if(listeners[i] < 0)
+            return 1;
+    }
+
+    log_set_level(level);
+    if(!log_start())
+    {
+        fprintf(stderr, "Unable to start the logger\n");
+        return 1;
+    }
+
+    workers_t workers;
+    if(!workers_init(&workers, worker_count, listeners, &config))
+    {
+        fprintf(stderr, "Unable to set up workers;\n\t%s\n", strerror(errno));
+        log_stop();
+        return 1;
+    }
+
+    journal_t *journal = NULL;
+    if(journal_directory != NULL)
+    {
+        if(!journal_replay(journal_directory, &rebuild_history, directory_history(&workers.directory, ROOM_LOBBY)))
+            LOG_WARN("journal_unreadable", LOG_STR("path", journal_directory), LOG_STR("error", strerror(errno)));
+
+        journal = journal_open(journal_directory);
+        if(journal == NULL)
+        {
+            fprintf(stderr, "Unable to open journal %s;\n\t%s\n", journal_directory, strerror(errno));
+            workers_destroy(&workers);
+            log_stop();
+            return 1;
+        }
+
+        for(unsigned int i = 0; i < workers.count; i++)
+            workers.workers[i].connections.journal = journal;
+    }
+
+    metrics_t *metrics_sources[MAX_WORKERS];
+    for(unsigned int i = 0; i < workers.count; i++)
+        metrics_sources[i] = &workers.workers[i].connections.metrics;
+
+    metrics_server_t *metrics_server = NULL;
+    if(metrics_path != NULL)
+    {
+        metrics_server = metrics_serve(metrics_path, metrics_sources, workers.count);
+        if(metrics_server == NULL)
+            LOG_ERROR("metrics_unavailable", LOG_STR("path", metrics_path), LOG_STR("error", strerror(errno)));
+    }
+
+    if(!workers_start(&workers, &run_worker))
+        exiting = true;
+
+    LOG_INFO("server_ready", LOG_INT("workers", workers.count), LOG_INT("port", 8080));
+    run_worker(&workers.workers[0]);
+
+    LOG_INFO("server_stopping", LOG_INT("workers", workers.count));
+    workers_stop(&workers);
+    metrics_server_stop(metrics_server);
+    if(journal != NULL)
+    {
+        journal_print_stats(journal);
+        journal_close(journal);
+    }
+    log_stop();
+    workers_destroy(&workers);
+    for(unsigned int i = 0; i < worker_count; i++)
+    {
+        shutdown(listeners[i], SHUT_RDWR);
+        close(listeners[i]);
+    }
+    release_server_packets();
+    pool_destroy_all();
+    return 0;
+};
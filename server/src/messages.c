@@ -1,24 +1,271 @@
-#include "messages.h"
-
-#include <ctype.h>
-#include <stdlib.h>
-#include <string.h>
-
-unsigned char *allocate_sanitized_message(unsigned char *input_message)
-{
-    int input_length = strlen(input_message);
-
-    unsigned char *sanitized = malloc(input_length + 1);
-
-    int i,s;
-    for(i = s = 0; input_message[i] != '\0'; i++)
-        if(isprint(input_message[i]))
-            sanitized[s++] = input_message[i];
-    
-    sanitized[input_length] = '\0';
-    size_t sanitized_length = strlen(sanitized) + 1;
-    sanitized = realloc(sanitized, sanitized_length);
-    sanitized[sanitized_length - 1] = '\0';
-
-    return sanitized;
-};
\ No newline at end of file
+#include "messages.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define SANITIZE_X86 1
+#include <immintrin.h>
+#endif
+
+// Consumes whole blocks of input for as long as the block can be handled without looking at bytes one by one,
+// writing what it keeps to output, and returns how many bytes of input that was. A block holding a NUL stops it,
+// as does, when keeping UTF-8, one with any byte above 0x7F; the scalar path takes over from there.
+typedef size_t (*sanitize_blocks_t)(unsigned char *output, const unsigned char *input, size_t length, unsigned int flags, size_t *written);
+
+// Length of the well-formed UTF-8 sequence at input, or 0 if it is malformed, overlong, a surrogate,
+// past U+10FFFF or a C1 control
+static size_t utf8_sequence_length(const unsigned char *input, size_t length)
+{
+    unsigned char lead = input[0];
+    size_t sequence_length;
+    unsigned char second_min = 0x80, second_max = 0xBF;
+    if(lead >= 0xC2 && lead <= 0xDF)
+        sequence_length = 2;
+    else if(lead >= 0xE0 && lead <= 0xEF)
+    {
+        sequence_length = 3;
+        if(lead == 0xE0)
+            second_min = 0xA0;
+        else if(lead == 0xED)
+            second_max = 0x9F;
+    }
+    else if(lead >= 0xF0 && lead <= 0xF4)
+    {
+        sequence_length = 4;
+        if(lead == 0xF0)
+            second_min = 0x90;
+        else if(lead == 0xF4)
+            second_max = 0x8F;
+    }
+    else
+        return 0;
+
+    if(sequence_length > length || input[1] < second_min || input[1] > second_max)
+        return 0;
+    if(lead == 0xC2 && input[1] < 0xA0)
+        return 0;
+
+    for(size_t i = 2; i < sequence_length; i++)
+    {
+        if(input[i] < 0x80 || input[i] > 0xBF)
+            return 0;
+    }
+    return sequence_length;
+};
+
+
+
+// The byte at a time path, over input until at least stop bytes are consumed or a NUL is reached; a UTF-8
+// sequence may run past stop, up to length. Returns how many bytes of input it consumed.
+static size_t sanitize_scalar(unsigned char *output, const unsigned char *input, size_t length, size_t stop, unsigned int flags, size_t *written)
+{
+    size_t i = 0, o = 0;
+    while(i < stop && input[i] != '\0')
+    {
+        unsigned char byte = input[i];
+        if(byte >= 0x80 && (flags & SANITIZE_UTF8))
+        {
+            size_t sequence_length = utf8_sequence_length(&input[i], length - i);
+            if(sequence_length == 0)
+                sequence_length = 1;
+            else
+            {
+                memmove(&output[o], &input[i], sequence_length);
+                o += sequence_length;
+            }
+            i += sequence_length;
+            continue;
+        }
+
+        // Always written, only kept if printable
+        output[o] = byte;
+        o += (unsigned char)(byte - 0x20) < 0x5F;
+        i++;
+    }
+
+    *written = o;
+    return i;
+};
+
+
+
+// Without vectors the scalar path takes the whole of the input at once
+static size_t sanitize_blocks_scalar(unsigned char *output, const unsigned char *input, size_t length, unsigned int flags, size_t *written)
+{
+    return sanitize_scalar(output, input, length, length, flags, written);
+};
+
+
+
+#ifdef SANITIZE_X86
+// For each 8 bit keep mask, the shuffle that packs the kept bytes of an 8 byte group to its front
+static unsigned char compact_shuffles[256][8];
+
+static void build_compact_shuffles(void)
+{
+    for(unsigned int mask = 0; mask < 256; mask++)
+    {
+        unsigned int kept = 0;
+        for(unsigned int bit = 0; bit < 8; bit++)
+        {
+            if(mask & (1u << bit))
+                compact_shuffles[mask][kept++] = bit;
+        }
+        while(kept < 8)
+            compact_shuffles[mask][kept++] = 0x80;
+    }
+};
+
+
+
+// Adding 0x60 moves 0x20..0x7E to 0x80..0xDE, the only bytes that then compare below -33 as signed
+static size_t sanitize_blocks_sse2(unsigned char *output, const unsigned char *input, size_t length, unsigned int flags, size_t *written)
+{
+    (void)flags; // Any byte above 0x7F stops it either way
+    const __m128i shift = _mm_set1_epi8(0x60);
+    const __m128i limit = _mm_set1_epi8(-33);
+    size_t consumed = 0;
+    while(length - consumed >= sizeof(__m128i))
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)&input[consumed]);
+        __m128i printable = _mm_cmplt_epi8(_mm_add_epi8(block, shift), limit);
+        if(_mm_movemask_epi8(printable) != 0xFFFF)
+            break;
+
+        // Safe in place; output never runs ahead of input, and the block is already loaded
+        _mm_storeu_si128((__m128i *)&output[consumed], block);
+        consumed += sizeof(__m128i);
+    }
+
+    *written = consumed;
+    return consumed;
+};
+
+
+
+// Blocks with something to drop are packed 8 bytes at a time with a byte shuffle, each group's store
+// overlapping the next; with output never ahead of input that stays safe in place
+__attribute__((target("avx2")))
+static size_t sanitize_blocks_avx2(unsigned char *output, const unsigned char *input, size_t length, unsigned int flags, size_t *written)
+{
+    const __m256i shift = _mm256_set1_epi8(0x60);
+    const __m256i limit = _mm256_set1_epi8(-33);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t consumed = 0, kept = 0;
+    while(length - consumed >= sizeof(__m256i))
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i *)&input[consumed]);
+        unsigned int printable = _mm256_movemask_epi8(_mm256_cmpgt_epi8(limit, _mm256_add_epi8(block, shift)));
+        if(printable == 0xFFFFFFFF)
+        {
+            _mm256_storeu_si256((__m256i *)&output[kept], block);
+            consumed += sizeof(__m256i);
+            kept += sizeof(__m256i);
+            continue;
+        }
+
+        unsigned int stops = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, zero));
+        if(flags & SANITIZE_UTF8)
+            stops |= _mm256_movemask_epi8(block);
+        if(stops != 0)
+            break;
+
+        __m128i halves[2] = {_mm256_castsi256_si128(block), _mm256_extracti128_si256(block, 1)};
+        for(unsigned int group = 0; group < 4; group++)
+        {
+            unsigned int mask = (printable >> (group * 8)) & 0xFF;
+            __m128i bytes = group % 2 == 0 ? halves[group / 2] : _mm_srli_si128(halves[group / 2], 8);
+            __m128i packed = _mm_shuffle_epi8(bytes, _mm_loadl_epi64((const __m128i *)compact_shuffles[mask]));
+            _mm_storel_epi64((__m128i *)&output[kept], packed);
+            kept += __builtin_popcount(mask);
+        }
+        consumed += sizeof(__m256i);
+    }
+
+    size_t tail_written;
+    consumed += sanitize_blocks_sse2(&output[kept], &input[consumed], length - consumed, flags, &tail_written);
+    *written = kept + tail_written;
+    return consumed;
+};
+#endif
+
+
+
+static _Atomic(sanitize_blocks_t) sanitize_blocks = NULL;
+
+static sanitize_blocks_t select_kernel(void)
+{
+    sanitize_blocks_t kernel = atomic_load_explicit(&sanitize_blocks, memory_order_acquire);
+    if(kernel != NULL)
+        return kernel;
+
+#ifdef SANITIZE_X86
+    build_compact_shuffles();
+    __builtin_cpu_init();
+    kernel = __builtin_cpu_supports("avx2") ? &sanitize_blocks_avx2 : &sanitize_blocks_sse2;
+#else
+    kernel = &sanitize_blocks_scalar;
+#endif
+    atomic_store_explicit(&sanitize_blocks, kernel, memory_order_release);
+    return kernel;
+};
+
+
+
+// Overrides the kernel picked from the CPU's features; false if this build or CPU cannot run it
+bool sanitize_use_kernel(enum sanitize_kernel kernel)
+{
+    select_kernel();
+    switch(kernel)
+    {
+        case SANITIZE_SCALAR:
+            atomic_store(&sanitize_blocks, &sanitize_blocks_scalar);
+            return true;
+
+#ifdef SANITIZE_X86
+        case SANITIZE_SSE2:
+            atomic_store(&sanitize_blocks, &sanitize_blocks_sse2);
+            return true;
+
+        case SANITIZE_AVX2:
+            if(!__builtin_cpu_supports("avx2"))
+                return false;
+            atomic_store(&sanitize_blocks, &sanitize_blocks_avx2);
+            return true;
+#endif
+
+        default:
+            return false;
+    }
+};
+
+
+
+// Keeps the printable characters of at most input_length bytes of input, stopping early at a NUL, and returns how
+// many bytes were kept. output may be input itself or a separate buffer, but either needs room for
+// input_length + 1 bytes, as the result is always NUL terminated. One pass, no allocation: whole runs of printable ASCII are copied a vector at a
+// time and only the blocks holding anything else are looked at byte by byte.
+size_t sanitize_message(unsigned char *output, const unsigned char *input, size_t input_length, unsigned int flags)
+{
+    sanitize_blocks_t kernel = select_kernel();
+    size_t i = 0, o = 0;
+    while(i < input_length)
+    {
+        size_t written;
+        i += kernel(&output[o], &input[i], input_length - i, flags, &written);
+        o += written;
+
+        // Finish the block the kernel stopped at, then give it another go
+        size_t block_end = i + 32 < input_length ? i + 32 : input_length;
+        i += sanitize_scalar(&output[o], &input[i], input_length - i, block_end - i, flags, &written);
+        o += written;
+        if(i < input_length && input[i] == '\0')
+            break;
+    }
+
+    output[o] = '\0';
+    return o;
+};
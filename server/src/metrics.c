@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "log.h"
+
+#define METRICS_POLL_MS 250
+
+static const char *metrics_stage_names[METRICS_STAGE_COUNT] = {"receive", "sanitize", "relay", "send", "delivery"};
+
+static const char *metrics_event_names[METRICS_EVENT_CODES] = {
+    "undefined", "connection_failed", "oversized_content", "username_request", "username_submit",
+    "username_accepted", "username_rejected", "server_shutdown", "user_list", "user_join", "user_leave",
+    "message", "room_join", "room_part", "ping", "pong", "throttled", "other"
+};
+
+static const double metrics_quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+
+
+uint64_t metrics_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+};
+
+
+
+void metrics_init(metrics_t *metrics)
+{
+    memset(metrics, 0, sizeof(metrics_t));
+};
+
+
+
+static unsigned int histogram_index(uint64_t value)
+{
+    if(value >= (1ull << HISTOGRAM_MAX_BITS))
+        value = (1ull << HISTOGRAM_MAX_BITS) - 1;
+    if(value < HISTOGRAM_SUB_BUCKETS)
+        return value;
+
+    unsigned int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+};
+
+
+
+// The largest value that lands in the bucket
+static uint64_t histogram_bucket_limit(unsigned int index)
+{
+    if(index < HISTOGRAM_SUB_BUCKETS)
+        return index;
+
+    unsigned int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t lowest = (uint64_t)(HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS) << shift;
+    return lowest + (1ull << shift) - 1;
+};
+
+
+
+// Only ever called by the histogram's owner
+void histogram_record(histogram_t *histogram, uint64_t value)
+{
+    metrics_add(&histogram->counts[histogram_index(value)], 1);
+    metrics_add(&histogram->count, 1);
+    metrics_add(&histogram->sum, value);
+    if(value > atomic_load_explicit(&histogram->max, memory_order_relaxed))
+        metrics_set(&histogram->max, value);
+};
+
+
+
+void metrics_record_since(metrics_t *metrics, enum metrics_stage stage, uint64_t start_ns)
+{
+    histogram_record(&metrics->stages[stage], metrics_now() - start_ns);
+};
+
+
+
+static unsigned long metrics_sum(metrics_t *const *sources, unsigned int count, size_t offset)
+{
+    unsigned long total = 0;
+    for(unsigned int i = 0; i < count; i++)
+        total += atomic_load_explicit((atomic_ulong *)((char *)sources[i] + offset), memory_order_relaxed);
+    return total;
+};
+
+
+
+static void print_counter(FILE *stream, const char *name, const char *help, metrics_t *const *sources, unsigned int count, size_t offset)
+{
+    fprintf(stream, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", name, help, name, name, metrics_sum(sources, count, offset));
+};
+
+
+
+static void print_gauge(FILE *stream, const char *name, const char *help, metrics_t *const *sources, unsigned int count, size_t offset)
+{
+    fprintf(stream, "# HELP %s %s\n# TYPE %s gauge\n", name, help, name);
+    for(unsigned int i = 0; i < count; i++)
+        fprintf(stream, "%s{worker=\"%u\"} %lu\n", name, i, atomic_load_explicit((atomic_ulong *)((char *)sources[i] + offset), memory_order_relaxed));
+};
+
+
+
+static void print_event_counters(FILE *stream, const char *name, const char *help, metrics_t *const *sources, unsigned int count, size_t offset)
+{
+    fprintf(stream, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for(unsigned int code = 0; code < METRICS_EVENT_CODES; code++)
+    {
+        unsigned long total = metrics_sum(sources, count, offset + code * sizeof(atomic_ulong));
+        fprintf(stream, "%s{event=\"%s\"} %lu\n", name, metrics_event_names[code], total);
+    }
+};
+
+
+
+typedef struct {
+    unsigned long counts[HISTOGRAM_BUCKETS];
+    unsigned long count;
+    unsigned long sum;
+    unsigned long max;
+} merged_histogram_t;
+
+// Adds up every worker's histogram for the stage. The count is taken from the buckets, so the cumulative
+// series always ends exactly at it even while workers keep recording.
+static void merge_stage(merged_histogram_t *merged, metrics_t *const *sources, unsigned int count, enum metrics_stage stage)
+{
+    memset(merged, 0, sizeof(merged_histogram_t));
+    for(unsigned int i = 0; i < count; i++)
+    {
+        histogram_t *histogram = &sources[i]->stages[stage];
+        for(unsigned int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+            merged->counts[bucket] += atomic_load_explicit(&histogram->counts[bucket], memory_order_relaxed);
+        merged->sum += atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+        unsigned long max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+        merged->max = max > merged->max ? max : merged->max;
+    }
+
+    for(unsigned int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+        merged->count += merged->counts[bucket];
+};
+
+
+
+// Buckets are cumulative, as a scraper expects, and only the ones anything landed in are listed
+static void print_stage_histogram(FILE *stream, const merged_histogram_t *merged, const char *name)
+{
+    unsigned long cumulative = 0;
+    for(unsigned int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+    {
+        if(merged->counts[bucket] == 0)
+            continue;
+        cumulative += merged->counts[bucket];
+        fprintf(stream, "chat_stage_latency_ns_bucket{stage=\"%s\",le=\"%lu\"} %lu\n", name, (unsigned long)histogram_bucket_limit(bucket), cumulative);
+    }
+    fprintf(stream, "chat_stage_latency_ns_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n", name, merged->count);
+    fprintf(stream, "chat_stage_latency_ns_sum{stage=\"%s\"} %lu\n", name, merged->sum);
+    fprintf(stream, "chat_stage_latency_ns_count{stage=\"%s\"} %lu\n", name, merged->count);
+};
+
+
+
+// Each quantile is reported as the upper bound of the bucket it falls in, capped at the largest value seen
+static void print_stage_quantiles(FILE *stream, const merged_histogram_t *merged, const char *name)
+{
+    for(size_t q = 0; q < sizeof(metrics_quantiles) / sizeof(metrics_quantiles[0]); q++)
+    {
+        unsigned long rank = (unsigned long)(metrics_quantiles[q] * merged->count + 0.999999);
+        unsigned long seen = 0;
+        unsigned long value = 0;
+        for(unsigned int bucket = 0; bucket < HISTOGRAM_BUCKETS && merged->count > 0; bucket++)
+        {
+            seen += merged->counts[bucket];
+            if(seen >= rank)
+            {
+                value = histogram_bucket_limit(bucket);
+                break;
+            }
+        }
+        fprintf(stream, "chat_stage_latency_quantile_ns{stage=\"%s\",quantile=\"%g\"} %lu\n", name, metrics_quantiles[q], value < merged->max ? value : merged->max);
+    }
+    fprintf(stream, "chat_stage_latency_quantile_ns{stage=\"%s\",quantile=\"1\"} %lu\n", name, merged->max);
+};
+
+
+
+// Prometheus text exposition format
+static void print_metrics(FILE *stream, metrics_t *const *sources, unsigned int count)
+{
+    print_counter(stream, "chat_accepted_total", "Connections accepted", sources, count, offsetof(metrics_t, accepted));
+    print_counter(stream, "chat_disconnected_total", "Connections closed", sources, count, offsetof(metrics_t, disconnected));
+    print_counter(stream, "chat_evicted_total", "Connections dropped for falling behind", sources, count, offsetof(metrics_t, evicted));
+    print_counter(stream, "chat_timed_out_total", "Connections dropped for missing a handshake or heartbeat deadline", sources, count, offsetof(metrics_t, timed_out));
+    print_counter(stream, "chat_throttled_total", "Times a client was held back for sending too fast", sources, count, offsetof(metrics_t, throttled));
+    print_counter(stream, "chat_received_bytes_total", "Bytes read from clients", sources, count, offsetof(metrics_t, bytes_received));
+    print_counter(stream, "chat_sent_events_total", "Frames written to clients", sources, count, offsetof(metrics_t, events_sent));
+    print_counter(stream, "chat_write_syscalls_total", "Write syscalls made", sources, count, offsetof(metrics_t, write_syscalls));
+    print_counter(stream, "chat_sent_bytes_total", "Bytes written to clients", sources, count, offsetof(metrics_t, bytes_sent));
+    print_event_counters(stream, "chat_received_events_total", "Events read from clients", sources, count, offsetof(metrics_t, events_received));
+    print_event_counters(stream, "chat_relayed_events_total", "Events relayed to a room", sources, count, offsetof(metrics_t, events_relayed));
+    print_gauge(stream, "chat_connections", "Open connections", sources, count, offsetof(metrics_t, connections));
+    print_gauge(stream, "chat_queued_bytes", "Bytes waiting in outbound queues", sources, count, offsetof(metrics_t, queued_bytes));
+
+    // Only the stats thread ever builds a report
+    static merged_histogram_t stages[METRICS_STAGE_COUNT];
+    for(unsigned int stage = 0; stage < METRICS_STAGE_COUNT; stage++)
+        merge_stage(&stages[stage], sources, count, stage);
+
+    fprintf(stream, "# HELP chat_stage_latency_ns Time spent in each stage\n# TYPE chat_stage_latency_ns histogram\n");
+    for(unsigned int stage = 0; stage < METRICS_STAGE_COUNT; stage++)
+        print_stage_histogram(stream, &stages[stage], metrics_stage_names[stage]);
+
+    fprintf(stream, "# HELP chat_stage_latency_quantile_ns Stage latency at each quantile, from the histogram buckets\n# TYPE chat_stage_latency_quantile_ns gauge\n");
+    for(unsigned int stage = 0; stage < METRICS_STAGE_COUNT; stage++)
+        print_stage_quantiles(stream, &stages[stage], metrics_stage_names[stage]);
+};
+
+
+
+static void metrics_reply(metrics_server_t *server, int client)
+{
+    char *report = NULL;
+    size_t report_length = 0;
+    FILE *stream = open_memstream(&report, &report_length);
+    if(stream == NULL)
+        return;
+
+    print_metrics(stream, server->sources, server->source_count);
+    fclose(stream);
+
+    // A scraper that stops reading only holds up the stats thread, never a worker
+    struct timeval timeout = {.tv_sec = 1};
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    size_t written = 0;
+    while(written < report_length)
+    {
+        ssize_t result = write(client, &report[written], report_length - written);
+        if(result < 0 && errno == EINTR)
+            continue;
+        if(result <= 0)
+            break;
+        written += result;
+    }
+    free(report);
+};
+
+
+
+static void *run_metrics_server(void *argument)
+{
+    metrics_server_t *server = argument;
+    struct pollfd listener = {.fd = server->fd, .events = POLLIN};
+    while(!atomic_load(&server->stopping))
+    {
+        if(poll(&listener, 1, METRICS_POLL_MS) <= 0)
+            continue;
+
+        int client = accept4(server->fd, NULL, NULL, SOCK_CLOEXEC);
+        if(client < 0)
+            continue;
+
+        metrics_reply(server, client);
+        close(client);
+    }
+
+    return NULL;
+};
+
+
+
+// Every connection to path gets one full report, then is closed
+metrics_server_t *metrics_serve(const char *path, metrics_t *const *sources, unsigned int source_count)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if(strlen(path) >= sizeof(address.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(address.sun_path, path);
+
+    metrics_server_t *server = calloc(1, sizeof(metrics_server_t));
+    if(server == NULL)
+        return NULL;
+
+    server->path = strdup(path);
+    server->sources = sources;
+    server->source_count = source_count;
+    atomic_init(&server->stopping, false);
+    server->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(server->path == NULL || server->fd < 0)
+    {
+        if(server->fd >= 0)
+            close(server->fd);
+        free(server->path);
+        free(server);
+        return NULL;
+    }
+
+    // A socket left behind by an earlier run would make bind fail
+    unlink(path);
+    if(bind(server->fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(server->fd, 16) != 0
+        || pthread_create(&server->thread, NULL, &run_metrics_server, server) != 0)
+    {
+        close(server->fd);
+        free(server->path);
+        free(server);
+        return NULL;
+    }
+
+    LOG_INFO("metrics_listening", LOG_STR("path", path));
+    return server;
+};
+
+
+
+void metrics_server_stop(metrics_server_t *server)
+{
+    if(server == NULL)
+        return;
+
+    atomic_store(&server->stopping, true);
+    pthread_join(server->thread, NULL);
+    close(server->fd);
+    unlink(server->path);
+    free(server->path);
+    free(server);
+};
@@ -0,0 +1,151 @@
+#include "outbound.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "metrics.h"
+#include "packet.h"
+
+#define OUTBOUND_INITIAL_CAPACITY 8
+
+static bool outbound_grow(outbound_t *outbound)
+{
+    size_t new_capacity = outbound->capacity == 0 ? OUTBOUND_INITIAL_CAPACITY : outbound->capacity * 2;
+    outbound_entry_t *new_entries = malloc(new_capacity * sizeof(outbound_entry_t));
+    if(new_entries == NULL)
+        return false;
+
+    for(size_t i = 0; i < outbound->count; i++)
+        new_entries[i] = outbound->entries[(outbound->head + i) & (outbound->capacity - 1)];
+
+    free(outbound->entries);
+    outbound->entries = new_entries;
+    outbound->capacity = new_capacity;
+    outbound->head = 0;
+    return true;
+};
+
+
+
+// Takes a new reference to the packet; the packet itself is never copied
+bool outbound_push(outbound_t *outbound, packet_t *packet)
+{
+    if(outbound->count == outbound->capacity && !outbound_grow(outbound))
+        return false;
+
+    outbound_entry_t *entry = &outbound->entries[(outbound->head + outbound->count) & (outbound->capacity - 1)];
+    entry->packet = packet_retain(packet);
+    entry->offset = 0;
+    outbound->count++;
+    outbound->bytes += packet->length;
+
+    return true;
+};
+
+
+
+static void outbound_pop(outbound_t *outbound)
+{
+    packet_release(outbound->entries[outbound->head].packet);
+    outbound->head = (outbound->head + 1) & (outbound->capacity - 1);
+    outbound->count--;
+};
+
+
+
+// Points iovecs at up to OUTBOUND_IOVECS queued packets, from where the last write stopped, and returns how many.
+// packets, if not NULL, gets the packet behind each iovec.
+size_t outbound_gather(const outbound_t *outbound, struct iovec *iovecs, packet_t **packets)
+{
+    size_t iovec_count = outbound->count < OUTBOUND_IOVECS ? outbound->count : OUTBOUND_IOVECS;
+    for(size_t i = 0; i < iovec_count; i++)
+    {
+        const outbound_entry_t *entry = &outbound->entries[(outbound->head + i) & (outbound->capacity - 1)];
+        iovecs[i].iov_base = &entry->packet->data[entry->offset];
+        iovecs[i].iov_len = entry->packet->length - entry->offset;
+        if(packets != NULL)
+            packets[i] = entry->packet;
+    }
+    return iovec_count;
+};
+
+
+
+// Drops what a write of the gathered iovecs took: finished packets are popped, the first unfinished one
+// remembers how far it got. Each timed packet that finishes adds how long it took since it was read to delivery.
+void outbound_consume(outbound_t *outbound, size_t sent, outbound_stats_t *stats, histogram_t *delivery)
+{
+    stats->syscalls++;
+    stats->bytes += sent;
+    outbound->bytes -= sent;
+    uint64_t now = 0;
+    while(sent > 0)
+    {
+        outbound_entry_t *entry = &outbound->entries[outbound->head];
+        size_t entry_remaining = entry->packet->length - entry->offset;
+        if(sent < entry_remaining)
+        {
+            entry->offset += sent;
+            break;
+        }
+
+        sent -= entry_remaining;
+        if(entry->packet->received_ns != 0 && delivery != NULL)
+        {
+            if(now == 0)
+                now = metrics_now();
+            histogram_record(delivery, now - entry->packet->received_ns);
+        }
+        outbound_pop(outbound);
+        stats->events++;
+    }
+};
+
+
+
+// Writes as much as the socket will take, gathering up to OUTBOUND_IOVECS queued packets into each writev
+// and resuming part way through a packet if the last flush stopped there
+enum outbound_result outbound_flush(outbound_t *outbound, int fd, outbound_stats_t *stats, histogram_t *delivery)
+{
+    struct iovec iovecs[OUTBOUND_IOVECS];
+    struct msghdr message = {.msg_iov = iovecs};
+
+    while(outbound->count > 0)
+    {
+        message.msg_iovlen = outbound_gather(outbound, iovecs, NULL);
+
+        ssize_t sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if(sent < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return OUTBOUND_BLOCKED;
+            return OUTBOUND_ERROR;
+        }
+
+        outbound_consume(outbound, sent, stats, delivery);
+    }
+
+    return OUTBOUND_DRAINED;
+};
+
+
+
+void outbound_free(outbound_t *outbound)
+{
+    while(outbound->count > 0)
+        outbound_pop(outbound);
+
+    free(outbound->entries);
+    outbound->entries = NULL;
+    outbound->capacity = 0;
+    outbound->head = 0;
+    outbound->bytes = 0;
+};
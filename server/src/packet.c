@@ -0,0 +1,261 @@
+#include "packet.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "event.h"
+#include "pool.h"
+#include "wire.h"
+
+// Setting up a deflate stream costs far more than compressing a roster page, so each thread keeps one
+static _Thread_local z_stream *thread_deflate = NULL;
+
+packet_t *packet_create(size_t length)
+{
+    packet_t *packet = pool_alloc(sizeof(packet_t) + length);
+    if(packet == NULL)
+        return NULL;
+
+    atomic_init(&packet->references, 1);
+    atomic_init(&packet->incompressible, false);
+    atomic_init(&packet->variant, NULL);
+    packet->version = WIRE_VERSION_LEGACY;
+    packet->received_ns = 0;
+    packet->length = length;
+    return packet;
+};
+
+
+
+packet_t *packet_create_raw(const void *data, size_t length)
+{
+    packet_t *packet = packet_create(length);
+    if(packet == NULL)
+        return NULL;
+
+    packet->version = PACKET_RAW;
+    memcpy(packet->data, data, length);
+    return packet;
+};
+
+
+
+packet_t *packet_create_event(enum event_code code, int originator_id, const void *content, size_t content_length)
+{
+    packet_t *packet = packet_create(sizeof(event_t) + content_length);
+    if(packet == NULL)
+        return NULL;
+
+    event_t *event = packet_event(packet);
+    event->code = code;
+    event->originator_id = originator_id;
+    event->content_length = content_length;
+    if(content_length > 0)
+        memcpy(event->content, content, content_length);
+
+    return packet;
+};
+
+
+
+static packet_t *packet_encode_v2(packet_t *packet)
+{
+    event_t *event = packet_event(packet);
+    unsigned char header[WIRE_MAX_HEADER];
+    size_t header_size = wire_put_event_header(header, event->code, event->originator_id, event->content_length);
+
+    packet_t *encoded = packet_create(header_size + event->content_length);
+    if(encoded == NULL)
+        return NULL;
+
+    encoded->version = WIRE_VERSION;
+    encoded->received_ns = packet->received_ns;
+    memcpy(encoded->data, header, header_size);
+    memcpy(&encoded->data[header_size], event->content, event->content_length);
+    return encoded;
+};
+
+
+
+// Returns the encoding for a client speaking the given version (0 while it is still unknown), or NULL if it
+// could not be made; the result is owned by the packet, so callers retain it if they keep it
+packet_t *packet_for_version(packet_t *packet, unsigned char version)
+{
+    if(packet->version != WIRE_VERSION_LEGACY || version != WIRE_VERSION)
+        return packet;
+
+    packet_t *variant = atomic_load_explicit(&packet->variant, memory_order_acquire);
+    if(variant != NULL)
+        return variant;
+
+    // Workers may race to encode the same broadcast; the loser drops its copy
+    packet_t *encoded = packet_encode_v2(packet);
+    if(encoded == NULL)
+        return NULL;
+
+    if(!atomic_compare_exchange_strong_explicit(&packet->variant, &variant, encoded, memory_order_acq_rel, memory_order_acquire))
+    {
+        packet_release(encoded);
+        return variant;
+    }
+    return encoded;
+};
+
+
+
+static z_stream *packet_deflate_stream(void)
+{
+    if(thread_deflate != NULL)
+        return deflateReset(thread_deflate) == Z_OK ? thread_deflate : NULL;
+
+    z_stream *stream = calloc(1, sizeof(z_stream));
+    if(stream == NULL)
+        return NULL;
+    if(deflateInit(stream, PACKET_DEFLATE_LEVEL) != Z_OK)
+    {
+        free(stream);
+        return NULL;
+    }
+
+    thread_deflate = stream;
+    return stream;
+};
+
+
+
+// Wraps the v2 frames in a deflate frame; NULL if that would not make them any smaller, or failed
+static packet_t *packet_encode_deflate(packet_t *packet)
+{
+    z_stream *stream = packet_deflate_stream();
+    if(stream == NULL)
+        return NULL;
+
+    unsigned char inflated_length[WIRE_MAX_VARINT];
+    size_t inflated_length_size = wire_put_varint(inflated_length, packet->length);
+
+    // Compressed into place behind room for the largest header, which goes in front afterwards. Output that
+    // does not fit in the packet's own length would not be worth sending, so deflate may stop there.
+    size_t headroom = 1 + WIRE_MAX_VARINT + inflated_length_size;
+    packet_t *encoded = packet_create(headroom + packet->length);
+    if(encoded == NULL)
+        return NULL;
+
+    stream->next_in = packet->data;
+    stream->avail_in = packet->length;
+    stream->next_out = &encoded->data[headroom];
+    stream->avail_out = packet->length;
+    if(deflate(stream, Z_FINISH) != Z_STREAM_END)
+    {
+        packet_release(encoded);
+        return NULL;
+    }
+    size_t compressed_length = stream->total_out;
+
+    unsigned char header[WIRE_MAX_HEADER];
+    size_t header_size = wire_put_deflate_header(header, inflated_length_size + compressed_length);
+    size_t length = header_size + inflated_length_size + compressed_length;
+    if(length >= packet->length)
+    {
+        packet_release(encoded);
+        return NULL;
+    }
+
+    memcpy(encoded->data, header, header_size);
+    memcpy(&encoded->data[header_size], inflated_length, inflated_length_size);
+    memmove(&encoded->data[header_size + inflated_length_size], &encoded->data[headroom], compressed_length);
+    encoded->version = PACKET_RAW;
+    encoded->received_ns = packet->received_ns;
+    encoded->length = length;
+    return encoded;
+};
+
+
+
+// Returns the deflate frame for a v2 packet of at least min_length bytes, made by whichever worker first needs
+// it and kept with the packet, so a broadcast is compressed once however many clients get it. Anything else,
+// and anything deflating does not shrink, comes back as it is. The result is owned by the packet.
+packet_t *packet_deflated(packet_t *packet, size_t min_length)
+{
+    if(packet->version != WIRE_VERSION || min_length == 0 || packet->length < min_length)
+        return packet;
+
+    packet_t *variant = atomic_load_explicit(&packet->variant, memory_order_acquire);
+    if(variant != NULL)
+        return variant;
+    if(atomic_load_explicit(&packet->incompressible, memory_order_relaxed))
+        return packet;
+
+    packet_t *encoded = packet_encode_deflate(packet);
+    if(encoded == NULL)
+    {
+        atomic_store_explicit(&packet->incompressible, true, memory_order_relaxed);
+        return packet;
+    }
+
+    if(!atomic_compare_exchange_strong_explicit(&packet->variant, &variant, encoded, memory_order_acq_rel, memory_order_acquire))
+    {
+        packet_release(encoded);
+        return variant;
+    }
+    return encoded;
+};
+
+
+
+// Lets the holder of a packet change it. When nobody else holds a reference the packet is returned as is, minus
+// its now stale encodings; otherwise it is swapped for a private copy with room for capacity bytes, leaving the
+// shared one untouched for whoever still has it queued. Returns NULL, with the original kept, if the copy fails.
+packet_t *packet_make_writable(packet_t *packet, size_t capacity)
+{
+    if(atomic_load_explicit(&packet->references, memory_order_acquire) == 1)
+    {
+        packet_release(atomic_exchange_explicit(&packet->variant, NULL, memory_order_acq_rel));
+        atomic_store_explicit(&packet->incompressible, false, memory_order_relaxed);
+        return packet;
+    }
+
+    packet_t *copy = packet_create(capacity);
+    if(copy == NULL)
+        return NULL;
+
+    copy->version = packet->version;
+    copy->received_ns = packet->received_ns;
+    copy->length = packet->length;
+    memcpy(copy->data, packet->data, packet->length);
+    packet_release(packet);
+    return copy;
+};
+
+
+
+// For a thread on its way out that may have deflated packets
+void packet_thread_exit(void)
+{
+    if(thread_deflate == NULL)
+        return;
+
+    deflateEnd(thread_deflate);
+    free(thread_deflate);
+    thread_deflate = NULL;
+};
+
+
+
+packet_t *packet_retain(packet_t *packet)
+{
+    atomic_fetch_add_explicit(&packet->references, 1, memory_order_relaxed);
+    return packet;
+};
+
+
+
+void packet_release(packet_t *packet)
+{
+    if(packet != NULL && atomic_fetch_sub_explicit(&packet->references, 1, memory_order_acq_rel) == 1)
+    {
+        packet_release(atomic_load_explicit(&packet->variant, memory_order_relaxed));
+        pool_free(packet);
+    }
+};
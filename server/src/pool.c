@@ -0,0 +1,187 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "log.h"
+
+#define POOL_LARGE POOL_CLASS_COUNT
+
+// Sits in front of every block so pool_free knows where it came from; 16 bytes keeps the block 16-byte aligned
+typedef struct {
+    pool_t *owner;
+    size_t size_class;
+} pool_header_t;
+
+static _Thread_local pool_t *thread_pool = NULL;
+
+// Pools outlive their threads, since packets made on one worker can still be queued on another
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_t *pools = NULL;
+
+
+
+pool_t *pool_for_thread(void)
+{
+    if(thread_pool != NULL)
+        return thread_pool;
+
+    pool_t *pool = calloc(1, sizeof(pool_t));
+    if(pool == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&pools_lock);
+    pool->next_pool = pools;
+    pools = pool;
+    pthread_mutex_unlock(&pools_lock);
+
+    thread_pool = pool;
+    return pool;
+};
+
+
+
+static bool pool_add_slab(pool_t *pool, size_t size_class)
+{
+    if(pool->slab_count == pool->slab_size)
+    {
+        size_t new_size = pool->slab_size == 0 ? 8 : pool->slab_size * 2;
+        void **new_slabs = reallocarray(pool->slabs, new_size, sizeof(void *));
+        if(new_slabs == NULL)
+            return false;
+        pool->slabs = new_slabs;
+        pool->slab_size = new_size;
+    }
+
+    unsigned char *slab = malloc(POOL_SLAB_SIZE);
+    if(slab == NULL)
+        return false;
+    pool->slabs[pool->slab_count++] = slab;
+
+    size_t block_size = pool_class_sizes[size_class];
+    for(size_t offset = 0; offset + block_size <= POOL_SLAB_SIZE; offset += block_size)
+    {
+        pool_block_t *block = (pool_block_t *)&slab[offset];
+        block->next = pool->free[size_class];
+        pool->free[size_class] = block;
+    }
+
+    return true;
+};
+
+
+
+void *pool_alloc(size_t size)
+{
+    pool_t *pool = pool_for_thread();
+    size_t needed = size + sizeof(pool_header_t);
+
+    size_t size_class = 0;
+    while(size_class < POOL_CLASS_COUNT && pool_class_sizes[size_class] < needed)
+        size_class++;
+
+    pool_header_t *header;
+    if(pool == NULL || size_class == POOL_LARGE)
+    {
+        header = malloc(needed);
+        if(header == NULL)
+            return NULL;
+        if(pool != NULL)
+            atomic_fetch_add_explicit(&pool->stats.large, 1, memory_order_relaxed);
+        header->owner = pool;
+        header->size_class = POOL_LARGE;
+        return header + 1;
+    }
+
+    if(pool->free[size_class] == NULL)
+        pool->free[size_class] = atomic_exchange_explicit(&pool->remote_free[size_class], NULL, memory_order_acquire);
+
+    if(pool->free[size_class] != NULL)
+    {
+        atomic_fetch_add_explicit(&pool->stats.hits[size_class], 1, memory_order_relaxed);
+    }
+    else
+    {
+        atomic_fetch_add_explicit(&pool->stats.misses[size_class], 1, memory_order_relaxed);
+        if(!pool_add_slab(pool, size_class))
+            return NULL;
+    }
+
+    header = (pool_header_t *)pool->free[size_class];
+    pool->free[size_class] = pool->free[size_class]->next;
+    header->owner = pool;
+    header->size_class = size_class;
+    return header + 1;
+};
+
+
+
+void pool_free(void *block)
+{
+    if(block == NULL)
+        return;
+
+    pool_header_t *header = (pool_header_t *)block - 1;
+    if(header->size_class == POOL_LARGE)
+    {
+        free(header);
+        return;
+    }
+
+    pool_t *owner = header->owner;
+    size_t size_class = header->size_class;
+    pool_block_t *freed = (pool_block_t *)header;
+    if(owner == thread_pool)
+    {
+        freed->next = owner->free[size_class];
+        owner->free[size_class] = freed;
+        return;
+    }
+
+    // Only the owner ever takes from remote_free, and it takes the whole list at once, so a plain push is ABA safe
+    pool_block_t *head = atomic_load_explicit(&owner->remote_free[size_class], memory_order_relaxed);
+    do
+        freed->next = head;
+    while(!atomic_compare_exchange_weak_explicit(&owner->remote_free[size_class], &head, freed, memory_order_release, memory_order_relaxed));
+};
+
+
+
+// One record per size class, then one for the allocations too big for any class
+void pool_print_stats(const pool_t *pool, const char *name)
+{
+    if(pool == NULL)
+        return;
+
+    for(size_t i = 0; i < POOL_CLASS_COUNT; i++)
+    {
+        LOG_INFO("pool_stats", LOG_STR("worker", name), LOG_INT("class_bytes", pool_class_sizes[i]),
+            LOG_INT("hits", atomic_load_explicit(&pool->stats.hits[i], memory_order_relaxed)),
+            LOG_INT("misses", atomic_load_explicit(&pool->stats.misses[i], memory_order_relaxed)));
+    }
+    LOG_INFO("pool_large_stats", LOG_STR("worker", name),
+        LOG_INT("allocations", atomic_load_explicit(&pool->stats.large, memory_order_relaxed)));
+};
+
+
+
+// Only safe once every thread that allocated from a pool has stopped
+void pool_destroy_all(void)
+{
+    pthread_mutex_lock(&pools_lock);
+    while(pools != NULL)
+    {
+        pool_t *next = pools->next_pool;
+        for(size_t i = 0; i < pools->slab_count; i++)
+            free(pools->slabs[i]);
+        free(pools->slabs);
+        free(pools);
+        pools = next;
+    }
+    pthread_mutex_unlock(&pools_lock);
+
+    thread_pool = NULL;
+};
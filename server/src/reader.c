@@ -0,0 +1,274 @@
+#include "reader.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "event.h"
+#include "wire.h"
+
+static void reader_consume(const unsigned char **input, size_t *input_length, size_t amount)
+{
+    *input += amount;
+    *input_length -= amount;
+};
+
+
+
+static void reader_emit(reader_t *reader, event_t *frame, const unsigned char *content)
+{
+    *frame = reader->header;
+    memcpy(frame->content, content, reader->header.content_length);
+    frame->content[reader->header.content_length] = '\0';
+
+    reader->state = READER_HEADER;
+    reader->partial_length = 0;
+};
+
+
+
+enum reader_parsed {
+    READER_PARSED_MALFORMED = -1,
+    READER_PARSED_INCOMPLETE = 0,
+    READER_PARSED_EVENT,
+    READER_PARSED_BATCH,
+    READER_PARSED_HELLO
+};
+
+
+
+static enum reader_parsed reader_parse_header(reader_t *reader, const unsigned char *bytes, size_t available, size_t *header_size)
+{
+    if(available == 0)
+        return READER_PARSED_INCOMPLETE;
+
+    if(reader->version == 0)
+    {
+        if(bytes[0] != WIRE_MAGIC)
+        {
+            reader->version = WIRE_VERSION_LEGACY;
+        }
+        else
+        {
+            if(available < WIRE_HELLO_SIZE)
+                return READER_PARSED_INCOMPLETE;
+
+            // Speak the highest version both sides know
+            reader->version = bytes[1] < WIRE_VERSION ? bytes[1] : WIRE_VERSION;
+            reader->flags = bytes[2];
+            *header_size = WIRE_HELLO_SIZE;
+            return reader->version >= WIRE_VERSION ? READER_PARSED_HELLO : READER_PARSED_MALFORMED;
+        }
+    }
+
+    if(reader->version == WIRE_VERSION_LEGACY)
+    {
+        if(available < sizeof(event_t))
+            return READER_PARSED_INCOMPLETE;
+
+        memcpy(&reader->header, bytes, sizeof(event_t));
+        *header_size = sizeof(event_t);
+        return READER_PARSED_EVENT;
+    }
+
+    switch(wire_get_header(bytes, available, &reader->header, header_size))
+    {
+        case WIRE_HEADER_EVENT:
+            return READER_PARSED_EVENT;
+        case WIRE_HEADER_BATCH:
+            return READER_PARSED_BATCH;
+        case WIRE_INCOMPLETE:
+            return available < WIRE_MAX_HEADER ? READER_PARSED_INCOMPLETE : READER_PARSED_MALFORMED;
+        case WIRE_HEADER_DEFLATE: // Only the server compresses
+        case WIRE_MALFORMED:
+        default:
+            return READER_PARSED_MALFORMED;
+    }
+};
+
+
+
+enum reader_result reader_next(reader_t *reader, const unsigned char **input, size_t *input_length, event_t *frame)
+{
+    while(true)
+    {
+        size_t amount;
+        size_t header_size;
+        size_t frame_header_size;
+        enum reader_parsed parsed;
+        switch(reader->state)
+        {
+            case READER_HEADER:
+                // Headers are parsed straight from the input unless one was split across reads; in that case
+                // top the saved bytes up and only consume what the header turned out to need
+                if(reader->header_length == 0)
+                {
+                    parsed = reader_parse_header(reader, *input, *input_length, &header_size);
+                    if(parsed == READER_PARSED_INCOMPLETE)
+                    {
+                        memcpy(reader->header_bytes, *input, *input_length);
+                        reader->header_length = *input_length;
+                        reader_consume(input, input_length, *input_length);
+                        return READER_NEED_MORE;
+                    }
+                    frame_header_size = header_size;
+                }
+                else
+                {
+                    amount = sizeof(reader->header_bytes) - reader->header_length;
+                    if(amount > *input_length)
+                        amount = *input_length;
+
+                    size_t saved_length = reader->header_length;
+                    memcpy(&reader->header_bytes[saved_length], *input, amount);
+                    parsed = reader_parse_header(reader, reader->header_bytes, saved_length + amount, &header_size);
+                    if(parsed == READER_PARSED_INCOMPLETE)
+                    {
+                        reader->header_length += amount;
+                        reader_consume(input, input_length, amount);
+                        return READER_NEED_MORE;
+                    }
+                    frame_header_size = header_size;
+                    header_size -= saved_length;
+                    reader->header_length = 0;
+                }
+
+                if(parsed == READER_PARSED_MALFORMED)
+                    return READER_MALFORMED;
+
+                reader_consume(input, input_length, header_size);
+                if(parsed == READER_PARSED_HELLO)
+                    return READER_HELLO;
+
+                // A batch is only a wrapper; the events inside are parsed like any others, but must fill it
+                // exactly, and batches do not nest
+                if(parsed == READER_PARSED_BATCH)
+                {
+                    if(reader->batch_remaining > 0)
+                        return READER_MALFORMED;
+                    reader->batch_remaining = reader->header.content_length;
+                    break;
+                }
+                if(reader->batch_remaining > 0)
+                {
+                    if(frame_header_size > reader->batch_remaining
+                        || reader->header.content_length > reader->batch_remaining - frame_header_size)
+                        return READER_MALFORMED;
+                    reader->batch_remaining -= frame_header_size + reader->header.content_length;
+                }
+
+                reader->remaining = reader->header.content_length;
+                if(reader->header.content_length > MAX_CONTENT_LENGTH)
+                {
+                    *frame = reader->header;
+                    reader->state = READER_DISCARD;
+                    return READER_OVERSIZED;
+                }
+                reader->state = READER_CONTENT;
+                break;
+
+
+            case READER_CONTENT:
+                if(reader->partial_length == 0 && *input_length >= reader->remaining)
+                {
+                    const unsigned char *content = *input;
+                    reader_consume(input, input_length, reader->remaining);
+                    reader_emit(reader, frame, content);
+                    return READER_FRAME;
+                }
+
+                if(*input_length == 0)
+                    return READER_NEED_MORE;
+
+                if(reader->partial == NULL)
+                {
+                    reader->partial = malloc(MAX_CONTENT_LENGTH);
+                    if(reader->partial == NULL)
+                        return READER_ERROR;
+                }
+
+                amount = reader->remaining < *input_length ? reader->remaining : *input_length;
+                memcpy(&reader->partial[reader->partial_length], *input, amount);
+                reader->partial_length += amount;
+                reader->remaining -= amount;
+                reader_consume(input, input_length, amount);
+                if(reader->remaining > 0)
+                    return READER_NEED_MORE;
+
+                reader_emit(reader, frame, reader->partial);
+                return READER_FRAME;
+
+
+            case READER_DISCARD:
+                amount = reader->remaining < *input_length ? reader->remaining : *input_length;
+                reader->remaining -= amount;
+                reader_consume(input, input_length, amount);
+                if(reader->remaining > 0)
+                    return READER_NEED_MORE;
+
+                // Returned rather than read on, so the caller can peek at the next frame before taking it
+                reader->state = READER_HEADER;
+                return READER_SKIPPED;
+        }
+    }
+};
+
+
+
+// The code of the event reader_next will return next, without consuming anything, looking past a batch header
+// if need be; false when too little of its header has arrived to tell, or the next frame is not an event
+bool reader_peek_code(const reader_t *reader, const unsigned char *input, size_t input_length, enum event_code *code)
+{
+    if(reader->state != READER_HEADER)
+    {
+        *code = reader->header.code;
+        return reader->state == READER_CONTENT;
+    }
+
+    // Room for a batch header and the event header behind it, the part of them already saved included
+    unsigned char bytes[2 * WIRE_MAX_HEADER];
+    size_t length = reader->header_length;
+    memcpy(bytes, reader->header_bytes, length);
+    size_t amount = sizeof(bytes) - length < input_length ? sizeof(bytes) - length : input_length;
+    memcpy(&bytes[length], input, amount);
+    length += amount;
+    if(length == 0)
+        return false;
+
+    if(reader->version == WIRE_VERSION_LEGACY || (reader->version == 0 && bytes[0] != WIRE_MAGIC))
+    {
+        if(length < sizeof(event_t))
+            return false;
+        event_t header;
+        memcpy(&header, bytes, sizeof(event_t));
+        *code = header.code;
+        return true;
+    }
+    if(reader->version == 0)
+        return false;
+
+    event_t header;
+    size_t header_size;
+    enum wire_header type = wire_get_header(bytes, length, &header, &header_size);
+    if(type == WIRE_HEADER_BATCH)
+        type = wire_get_header(&bytes[header_size], length - header_size, &header, &header_size);
+    if(type != WIRE_HEADER_EVENT)
+        return false;
+
+    *code = header.code;
+    return true;
+};
+
+
+
+void reader_free(reader_t *reader)
+{
+    free(reader->partial);
+    reader->partial = NULL;
+    reader->partial_length = 0;
+    reader->header_length = 0;
+    reader->batch_remaining = 0;
+    reader->state = READER_HEADER;
+    reader->version = 0;
+    reader->flags = 0;
+};
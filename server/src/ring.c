@@ -0,0 +1,518 @@
+#include "ring.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_SETUP_DEFER_TASKRUN) && defined(IORING_RECV_MULTISHOT)
+#define RING_AVAILABLE
+#endif
+#endif
+
+#ifdef RING_AVAILABLE
+
+#define RING_BUFFER_GROUP 0
+
+static int ring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+};
+
+
+
+static int ring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, const void *argument, size_t argument_size)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, argument, argument_size);
+};
+
+
+
+static int ring_register(int fd, unsigned int opcode, const void *argument, unsigned int count)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, argument, count);
+};
+
+
+
+// The kernel reads its end of each ring with acquire loads and writes with release stores; so do we
+static unsigned int ring_load(const unsigned int *shared)
+{
+    return atomic_load_explicit((_Atomic unsigned int *)shared, memory_order_acquire);
+};
+
+
+
+static void ring_store(unsigned int *shared, unsigned int value)
+{
+    atomic_store_explicit((_Atomic unsigned int *)shared, value, memory_order_release);
+};
+
+
+
+// Hands the kernel one buffer per slot of the provided buffer ring, which multishot receives pick from
+static bool ring_provide_buffers(ring_t *ring)
+{
+    ring->buffer_ring_size = RING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    ring->buffer_ring = mmap(NULL, ring->buffer_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring->buffer_ring == MAP_FAILED)
+    {
+        ring->buffer_ring = NULL;
+        return false;
+    }
+
+    ring->buffers = malloc((size_t)RING_BUFFER_COUNT * RING_BUFFER_SIZE);
+    if(ring->buffers == NULL)
+        return false;
+
+    struct io_uring_buf_reg registration = {
+        .ring_addr = (uintptr_t)ring->buffer_ring,
+        .ring_entries = RING_BUFFER_COUNT,
+        .bgid = RING_BUFFER_GROUP
+    };
+    if(ring_register(ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0)
+        return false;
+
+    ring->buffer_tail = 0;
+    for(unsigned short i = 0; i < RING_BUFFER_COUNT; i++)
+        ring_recycle(ring, i);
+    return true;
+};
+
+
+
+// Needs Linux 6.1; an older kernel refuses the setup flags, and the caller stays on epoll
+bool ring_init(ring_t *ring, unsigned int entries)
+{
+    memset(ring, 0, sizeof(*ring));
+
+    // Completions are only posted when the owning thread enters the kernel to wait for them, so nothing
+    // runs behind the worker's back and no other thread ever touches the ring
+    struct io_uring_params params = {0};
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    ring->fd = ring_setup(entries, &params);
+    if(ring->fd < 0)
+        return false;
+
+    unsigned int needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if((params.features & needed) != needed)
+    {
+        ring_destroy(ring);
+        errno = ENOSYS;
+        return false;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->rings == MAP_FAILED)
+    {
+        ring->rings = NULL;
+        ring_destroy(ring);
+        return false;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        ring_destroy(ring);
+        return false;
+    }
+
+    unsigned char *rings = ring->rings;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_mask = *(unsigned int *)&rings[params.sq_off.ring_mask];
+    ring->sq_head_shared = (unsigned int *)&rings[params.sq_off.head];
+    ring->sq_tail_shared = (unsigned int *)&rings[params.sq_off.tail];
+    ring->sq_tail = *ring->sq_tail_shared;
+    ring->cq_mask = *(unsigned int *)&rings[params.cq_off.ring_mask];
+    ring->cq_head_shared = (unsigned int *)&rings[params.cq_off.head];
+    ring->cq_tail_shared = (unsigned int *)&rings[params.cq_off.tail];
+    ring->cqes = &rings[params.cq_off.cqes];
+
+    // Submission slots are always used in order, so the indirection array never changes
+    unsigned int *array = (unsigned int *)&rings[params.sq_off.array];
+    for(unsigned int i = 0; i < params.sq_entries; i++)
+        array[i] = i;
+
+    if(!ring_provide_buffers(ring))
+    {
+        int error = errno;
+        ring_destroy(ring);
+        errno = error;
+        return false;
+    }
+    return true;
+};
+
+
+
+static unsigned int ring_unsubmitted(const ring_t *ring)
+{
+    return ring->sq_tail - ring_load(ring->sq_head_shared);
+};
+
+
+
+// The next free submission slot, cleared; if every slot is taken, what is queued is submitted first
+static struct io_uring_sqe *ring_slot(ring_t *ring)
+{
+    if(ring_unsubmitted(ring) >= ring->sq_entries
+        && ring_enter(ring->fd, ring_unsubmitted(ring), 0, 0, NULL, 0) < 0)
+        return NULL;
+
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe *)ring->sqes)[ring->sq_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+};
+
+
+
+static void ring_publish(ring_t *ring)
+{
+    ring->sq_tail++;
+    ring_store(ring->sq_tail_shared, ring->sq_tail);
+};
+
+
+
+// Completes with a new nonblocking socket for every connection until cancelled
+bool ring_accept(ring_t *ring, int fd, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = ring_slot(ring);
+    if(sqe == NULL)
+        return false;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = user_data;
+    ring_publish(ring);
+    return true;
+};
+
+
+
+// Completes each time bytes arrive, in one of the provided buffers, until the stream ends, the buffers run
+// out, or it is cancelled
+bool ring_receive(ring_t *ring, int fd, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = ring_slot(ring);
+    if(sqe == NULL)
+        return false;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RING_BUFFER_GROUP;
+    sqe->user_data = user_data;
+    ring_publish(ring);
+    return true;
+};
+
+
+
+// The message, its iovecs and the bytes they point at must stay put until the completion arrives. A full
+// socket fails the send with -EAGAIN rather than parking it in the kernel until the next ring_wait.
+bool ring_sendmsg(ring_t *ring, int fd, const struct msghdr *message, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = ring_slot(ring);
+    if(sqe == NULL)
+        return false;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+    sqe->user_data = user_data;
+    ring_publish(ring);
+    return true;
+};
+
+
+
+// Completes every time fd becomes readable, until cancelled
+bool ring_poll(ring_t *ring, int fd, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = ring_slot(ring);
+    if(sqe == NULL)
+        return false;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data;
+    ring_publish(ring);
+    return true;
+};
+
+
+
+// Completes once, when fd becomes writable
+bool ring_writable(ring_t *ring, int fd, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = ring_slot(ring);
+    if(sqe == NULL)
+        return false;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = user_data;
+    ring_publish(ring);
+    return true;
+};
+
+
+
+// The request submitted as target completes with -ECANCELED, or normally if it got there first
+bool ring_cancel(ring_t *ring, uint64_t target, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = ring_slot(ring);
+    if(sqe == NULL)
+        return false;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+    ring_publish(ring);
+    return true;
+};
+
+
+
+bool ring_cancel_all(ring_t *ring, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = ring_slot(ring);
+    if(sqe == NULL)
+        return false;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data = user_data;
+    ring_publish(ring);
+    return true;
+};
+
+
+
+static unsigned int ring_ready(const ring_t *ring)
+{
+    return ring_load(ring->cq_tail_shared) - *ring->cq_head_shared;
+};
+
+
+
+// Hands what is queued to the kernel without waiting; a queued entry names its socket by number only
+// until it is submitted
+bool ring_submit(ring_t *ring)
+{
+    return ring_unsubmitted(ring) == 0 || ring_enter(ring->fd, ring_unsubmitted(ring), 0, 0, NULL, 0) >= 0;
+};
+
+
+
+// Submits everything queued and, unless completions are already waiting, sleeps until one arrives or
+// timeout_ns pass; UINT64_MAX waits for ever and 0 not at all. Returns the completions ready to be taken
+// with ring_next, or -1 with errno set.
+int ring_wait(ring_t *ring, uint64_t timeout_ns)
+{
+    struct __kernel_timespec timeout = {
+        .tv_sec = timeout_ns / 1000000000,
+        .tv_nsec = timeout_ns % 1000000000
+    };
+    struct io_uring_getevents_arg argument = {0};
+    if(timeout_ns != UINT64_MAX)
+        argument.ts = (uintptr_t)&timeout;
+
+    // Entering with IORING_ENTER_GETEVENTS is also what runs the deferred work that posts completions
+    unsigned int wait = ring_ready(ring) == 0 && timeout_ns != 0 ? 1 : 0;
+    if(ring_enter(ring->fd, ring_unsubmitted(ring), wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+        &argument, sizeof(argument)) < 0 && errno != ETIME)
+        return -1;
+
+    return ring_ready(ring);
+};
+
+
+
+bool ring_next(ring_t *ring, ring_completion_t *completion)
+{
+    unsigned int head = *ring->cq_head_shared;
+    if(head == ring_load(ring->cq_tail_shared))
+        return false;
+
+    const struct io_uring_cqe *cqe = &((struct io_uring_cqe *)ring->cqes)[head & ring->cq_mask];
+    completion->user_data = cqe->user_data;
+    completion->result = cqe->res;
+    completion->more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    completion->has_buffer = (cqe->flags & IORING_CQE_F_BUFFER) != 0;
+    completion->buffer = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    ring_store(ring->cq_head_shared, head + 1);
+    return true;
+};
+
+
+
+const unsigned char *ring_buffer(const ring_t *ring, unsigned short buffer)
+{
+    return &ring->buffers[(size_t)buffer * RING_BUFFER_SIZE];
+};
+
+
+
+// Gives a receive buffer back to the kernel once its bytes have been handled
+void ring_recycle(ring_t *ring, unsigned short buffer)
+{
+    struct io_uring_buf_ring *buffer_ring = ring->buffer_ring;
+    struct io_uring_buf *slot = &buffer_ring->bufs[ring->buffer_tail & (RING_BUFFER_COUNT - 1)];
+    slot->addr = (uintptr_t)&ring->buffers[(size_t)buffer * RING_BUFFER_SIZE];
+    slot->len = RING_BUFFER_SIZE;
+    slot->bid = buffer;
+
+    ring->buffer_tail++;
+    atomic_store_explicit((_Atomic unsigned short *)&buffer_ring->tail, ring->buffer_tail, memory_order_release);
+};
+
+
+
+// Closing the ring cancels whatever is still in flight; anything those requests pointed at must outlive this
+void ring_destroy(ring_t *ring)
+{
+    if(ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_size);
+    if(ring->rings != NULL)
+        munmap(ring->rings, ring->rings_size);
+    if(ring->fd >= 0)
+        close(ring->fd);
+    if(ring->buffer_ring != NULL)
+        munmap(ring->buffer_ring, ring->buffer_ring_size);
+    free(ring->buffers);
+
+    ring->sqes = NULL;
+    ring->rings = NULL;
+    ring->fd = -1;
+    ring->buffer_ring = NULL;
+    ring->buffers = NULL;
+};
+
+#else
+
+bool ring_init(ring_t *ring, unsigned int entries)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    errno = ENOSYS;
+    return false;
+};
+
+
+
+bool ring_accept(ring_t *ring, int fd, uint64_t user_data)
+{
+    return false;
+};
+
+
+
+bool ring_receive(ring_t *ring, int fd, uint64_t user_data)
+{
+    return false;
+};
+
+
+
+bool ring_sendmsg(ring_t *ring, int fd, const struct msghdr *message, uint64_t user_data)
+{
+    return false;
+};
+
+
+
+bool ring_poll(ring_t *ring, int fd, uint64_t user_data)
+{
+    return false;
+};
+
+
+
+bool ring_writable(ring_t *ring, int fd, uint64_t user_data)
+{
+    return false;
+};
+
+
+
+bool ring_cancel(ring_t *ring, uint64_t target, uint64_t user_data)
+{
+    return false;
+};
+
+
+
+bool ring_cancel_all(ring_t *ring, uint64_t user_data)
+{
+    return false;
+};
+
+
+
+bool ring_submit(ring_t *ring)
+{
+    return false;
+};
+
+
+
+int ring_wait(ring_t *ring, uint64_t timeout_ns)
+{
+    errno = ENOSYS;
+    return -1;
+};
+
+
+
+bool ring_next(ring_t *ring, ring_completion_t *completion)
+{
+    return false;
+};
+
+
+
+const unsigned char *ring_buffer(const ring_t *ring, unsigned short buffer)
+{
+    return NULL;
+};
+
+
+
+void ring_recycle(ring_t *ring, unsigned short buffer)
+{
+};
+
+
+
+void ring_destroy(ring_t *ring)
+{
+};
+
+#endif
@@ -0,0 +1,118 @@
+#include "rooms.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "directory.h"
+
+#define ROOMS_INITIAL_SIZE 8
+#define ROOM_INITIAL_MEMBERS 8
+
+bool rooms_init(rooms_t *rooms)
+{
+    rooms->size = ROOMS_INITIAL_SIZE;
+    rooms->rooms = calloc(rooms->size, sizeof(room_t));
+    return rooms->rooms != NULL;
+};
+
+
+
+// Returns NULL when none of this worker's users are in the room
+const room_t *rooms_find(const rooms_t *rooms, uint32_t room)
+{
+    if(room == ROOM_NONE || ROOM_SLOT(room) >= rooms->size)
+        return NULL;
+
+    const room_t *entry = &rooms->rooms[ROOM_SLOT(room)];
+    if(entry->count == 0 || entry->id != room)
+        return NULL;
+
+    return entry;
+};
+
+
+
+// The room's admission bucket, NULL when none of this worker's users are in it
+bucket_t *rooms_bucket(rooms_t *rooms, uint32_t room)
+{
+    room_t *entry = (room_t *)rooms_find(rooms, room);
+    return entry != NULL ? &entry->bucket : NULL;
+};
+
+
+
+// Appends the user to the room's members; position is where they landed, needed to remove them again
+bool rooms_add(rooms_t *rooms, uint32_t room, const unsigned char *name, history_t *history, unsigned int index, size_t *position)
+{
+    size_t slot = ROOM_SLOT(room);
+    if(slot >= rooms->size)
+    {
+        size_t new_size = rooms->size;
+        while(new_size <= slot)
+            new_size *= 2;
+
+        room_t *new_rooms = reallocarray(rooms->rooms, new_size, sizeof(room_t));
+        if(new_rooms == NULL)
+            return false;
+
+        memset(&new_rooms[rooms->size], 0, (new_size - rooms->size) * sizeof(room_t));
+        rooms->rooms = new_rooms;
+        rooms->size = new_size;
+    }
+
+    room_t *entry = &rooms->rooms[slot];
+    if(entry->count == 0)
+    {
+        entry->id = room;
+        strncpy((char *)entry->name, (const char *)name, ROOM_NAME_LENGTH - 1);
+        entry->name[ROOM_NAME_LENGTH - 1] = '\0';
+        entry->history = history;
+        entry->bucket = (bucket_t){0};
+    }
+
+    if(entry->count >= entry->size)
+    {
+        size_t new_size = entry->size > 0 ? entry->size * 2 : ROOM_INITIAL_MEMBERS;
+        unsigned int *new_members = reallocarray(entry->members, new_size, sizeof(unsigned int));
+        if(new_members == NULL)
+            return false;
+
+        entry->members = new_members;
+        entry->size = new_size;
+    }
+
+    *position = entry->count;
+    entry->members[entry->count++] = index;
+    return true;
+};
+
+
+
+// Fills the gap with the last member; returns that member's index so the caller can update its position,
+// or 0 if nobody moved
+unsigned int rooms_remove(rooms_t *rooms, uint32_t room, size_t position)
+{
+    room_t *entry = (room_t *)rooms_find(rooms, room);
+    if(entry == NULL || position >= entry->count)
+        return 0;
+
+    entry->count--;
+    if(position == entry->count)
+        return 0;
+
+    entry->members[position] = entry->members[entry->count];
+    return entry->members[position];
+};
+
+
+
+void rooms_destroy(rooms_t *rooms)
+{
+    for(size_t i = 0; i < rooms->size; i++)
+        free(rooms->rooms[i].members);
+
+    free(rooms->rooms);
+};
@@ -0,0 +1,152 @@
+#include "timers.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now_ns)
+{
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->now = now_ns / TIMER_TICK_NS;
+    wheel->count = 0;
+};
+
+
+
+// The level is picked by how far off the timer is and the slot by its own tick, so a timer lands in the
+// slot that level reaches in the same turn it comes due. Never called with a timer already past due.
+static void timer_wheel_place(timer_wheel_t *wheel, wheel_timer_t *timer)
+{
+    uint64_t expires = timer->expires;
+    uint64_t delta = expires - wheel->now;
+
+    unsigned int level = 0;
+    while(level < TIMER_WHEEL_LEVELS - 1 && delta >= (uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1)))
+        level++;
+
+    // Beyond the last level it waits in the furthest slot, and is placed again when that slot turns over
+    if(level == TIMER_WHEEL_LEVELS - 1 && delta >= (uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+        expires = wheel->now + ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+
+    wheel_timer_t **slot = &wheel->slots[level][(expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+    timer->next = *slot;
+    if(timer->next != NULL)
+        timer->next->link = &timer->next;
+    timer->link = slot;
+    *slot = timer;
+};
+
+
+
+static void timer_wheel_unlink(wheel_timer_t *timer)
+{
+    *timer->link = timer->next;
+    if(timer->next != NULL)
+        timer->next->link = timer->link;
+    timer->next = NULL;
+    timer->link = NULL;
+};
+
+
+
+// Re-arming an armed timer moves it
+void timer_wheel_arm(timer_wheel_t *wheel, wheel_timer_t *timer, uint64_t deadline_ns)
+{
+    if(timer_armed(timer))
+        timer_wheel_unlink(timer);
+    else
+        wheel->count++;
+
+    // The current tick has been processed already, so anything due by now goes in the next one
+    timer->expires = (deadline_ns + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+    if(timer->expires <= wheel->now)
+        timer->expires = wheel->now + 1;
+    timer_wheel_place(wheel, timer);
+};
+
+
+
+void timer_wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer)
+{
+    if(!timer_armed(timer))
+        return;
+
+    timer_wheel_unlink(timer);
+    wheel->count--;
+};
+
+
+
+// When timer_wheel_expire next needs calling, in CLOCK_MONOTONIC ns; UINT64_MAX with nothing armed. Only the
+// rest of level 0's turn is looked at, so with nothing due in it this is the end of the turn, when the level
+// above hands its next slot down.
+uint64_t timer_wheel_next(const timer_wheel_t *wheel)
+{
+    if(wheel->count == 0)
+        return UINT64_MAX;
+
+    uint64_t tick = wheel->now + 1;
+    while((tick & TIMER_WHEEL_MASK) != 0 && wheel->slots[0][tick & TIMER_WHEEL_MASK] == NULL)
+        tick++;
+
+    return tick * TIMER_TICK_NS;
+};
+
+
+
+// Moves a higher level's slot down; everything in it is now due within that level's slot width, some of it
+// on this very tick, which lands in the level 0 slot about to be expired
+static void timer_wheel_cascade(timer_wheel_t *wheel, unsigned int level)
+{
+    wheel_timer_t **slot = &wheel->slots[level][(wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+    wheel_timer_t *timer = *slot;
+    *slot = NULL;
+    while(timer != NULL)
+    {
+        wheel_timer_t *next = timer->next;
+        timer_wheel_place(wheel, timer);
+        timer = next;
+    }
+};
+
+
+
+// Calls expired for every timer due by now_ns, disarmed first so the handler is free to arm it again
+void timer_wheel_expire(timer_wheel_t *wheel, uint64_t now_ns, timer_expired_t expired, void *context)
+{
+    uint64_t now = now_ns / TIMER_TICK_NS;
+    if(wheel->count == 0)
+    {
+        if(now > wheel->now)
+            wheel->now = now;
+        return;
+    }
+
+    while(wheel->now < now)
+    {
+        wheel->now++;
+
+        // Highest level first, so whatever it hands down lands in slots cascaded later in this same tick
+        unsigned int top = 0;
+        while(top < TIMER_WHEEL_LEVELS - 1 && (wheel->now & (((uint64_t)1 << (TIMER_WHEEL_BITS * (top + 1))) - 1)) == 0)
+            top++;
+        for(unsigned int level = top; level > 0; level--)
+            timer_wheel_cascade(wheel, level);
+
+        wheel_timer_t **slot = &wheel->slots[0][wheel->now & TIMER_WHEEL_MASK];
+        while(*slot != NULL)
+        {
+            wheel_timer_t *timer = *slot;
+            timer_wheel_unlink(timer);
+            wheel->count--;
+            expired(context, timer);
+        }
+
+        if(wheel->count == 0)
+        {
+            wheel->now = now;
+            break;
+        }
+    }
+};
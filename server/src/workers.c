@@ -0,0 +1,153 @@
+#include "workers.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "connections.h"
+#include "directory.h"
+#include "event.h"
+#include "log.h"
+#include "mailbox.h"
+#include "packet.h"
+#include "pool.h"
+
+// Every other worker with members in the room gets a reference to the same packet through its mailbox
+static void workers_broadcast(void *context, packet_t *packet, uint32_t room)
+{
+    worker_t *worker = context;
+    uint64_t targets = directory_room_workers(&worker->workers->directory, room) & ~((uint64_t)1 << worker->index);
+    while(targets != 0)
+    {
+        unsigned int i = __builtin_ctzll(targets);
+        targets &= targets - 1;
+
+        relayed_packet_t *relayed = pool_alloc(sizeof(relayed_packet_t));
+        if(relayed == NULL)
+        {
+            LOG_ERROR("relay_failed", LOG_INT("worker", i));
+            continue;
+        }
+
+        relayed->packet = packet_retain(packet);
+        relayed->room = room;
+        mailbox_push(&worker->workers->workers[i].mailbox, &relayed->node);
+    }
+};
+
+
+
+bool workers_init(workers_t *workers, unsigned int count, const int *listeners, const connections_config_t *config)
+{
+    workers->count = count;
+    atomic_init(&workers->stopping, false);
+    workers->workers = calloc(count, sizeof(worker_t));
+    if(workers->workers == NULL)
+        return false;
+
+    if(!directory_init(&workers->directory))
+    {
+        free(workers->workers);
+        return false;
+    }
+
+    for(unsigned int i = 0; i < count; i++)
+    {
+        worker_t *worker = &workers->workers[i];
+        worker->index = i;
+        worker->listener = listeners[i];
+        worker->workers = workers;
+
+        if(!connections_init(&worker->connections, worker->listener, config, &workers->directory))
+            return false;
+        if(!mailbox_init(&worker->mailbox))
+            return false;
+        if(!connections_watch(&worker->connections, worker->mailbox.wake_fd, MAILBOX_TAG))
+            return false;
+
+        worker->connections.id_base = i;
+        worker->connections.id_stride = count;
+        worker->connections.worker = i;
+        if(count > 1)
+        {
+            worker->connections.broadcast = &workers_broadcast;
+            worker->connections.broadcast_context = worker;
+        }
+    }
+
+    return true;
+};
+
+
+
+// Worker 0 runs on the calling thread; the rest get their own, with signals left to the caller
+bool workers_start(workers_t *workers, void *(*run)(void *worker))
+{
+    sigset_t all_signals, previous_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &previous_signals);
+
+    bool started = true;
+    for(unsigned int i = 1; i < workers->count && started; i++)
+    {
+        if(pthread_create(&workers->workers[i].thread, NULL, run, &workers->workers[i]) != 0)
+        {
+            LOG_ERROR("worker_start_failed", LOG_INT("worker", i));
+            workers->count = i;
+            started = false;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &previous_signals, NULL);
+    return started;
+};
+
+
+
+void workers_stop(workers_t *workers)
+{
+    atomic_store(&workers->stopping, true);
+    for(unsigned int i = 1; i < workers->count; i++)
+        mailbox_wake(&workers->workers[i].mailbox);
+
+    for(unsigned int i = 1; i < workers->count; i++)
+        pthread_join(workers->workers[i].thread, NULL);
+};
+
+
+
+void workers_deliver_mail(worker_t *worker)
+{
+    mailbox_acknowledge(&worker->mailbox);
+
+    mailbox_node_t *node;
+    while((node = mailbox_pop(&worker->mailbox)) != NULL)
+    {
+        relayed_packet_t *relayed = (relayed_packet_t *)node;
+        connections_relay_local(&worker->connections, relayed->packet, relayed->room, 0);
+        packet_release(relayed->packet);
+        pool_free(relayed);
+    }
+};
+
+
+
+void workers_destroy(workers_t *workers)
+{
+    for(unsigned int i = 0; i < workers->count; i++)
+    {
+        mailbox_node_t *node;
+        while((node = mailbox_pop(&workers->workers[i].mailbox)) != NULL)
+        {
+            packet_release(((relayed_packet_t *)node)->packet);
+            pool_free(node);
+        }
+        mailbox_destroy(&workers->workers[i].mailbox);
+    }
+
+    directory_destroy(&workers->directory);
+    free(workers->workers);
+};
@@ -0,0 +1,112 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+// Prints journal segments offline, either as readable lines or, with -c, as CSV with a header row.
+// Records after a torn or corrupt one are not trusted and not printed.
+
+static void print_text(const unsigned char *data, size_t length)
+{
+    for(size_t i = 0; i < length; i++)
+    {
+        if(data[i] == '\0')
+            fputs("\\0", stdout);
+        else
+            putchar(data[i]);
+    }
+};
+
+
+
+// Quoted, with inner quotes doubled; the NULs terminating usernames and messages are left out
+static void print_csv_field(const unsigned char *data, size_t length)
+{
+    putchar('"');
+    for(size_t i = 0; i < length; i++)
+    {
+        if(data[i] == '"')
+            putchar('"');
+        if(data[i] != '\0')
+            putchar(data[i]);
+    }
+    putchar('"');
+};
+
+
+
+static void dump_record(void *context, const journal_record_t *record)
+{
+    bool csv = *(bool *)context;
+    if(csv)
+    {
+        printf("%llu,", (unsigned long long)record->time_ns);
+        print_csv_field(record->room, record->room_length);
+        printf(",%d,%d,", record->code, record->originator_id);
+        print_csv_field(record->content, record->content_length);
+        putchar('\n');
+        return;
+    }
+
+    time_t seconds = record->time_ns / 1000000000;
+    struct tm utc;
+    char timestamp[32];
+    gmtime_r(&seconds, &utc);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &utc);
+
+    printf("%s.%06lluZ #", timestamp, (unsigned long long)(record->time_ns % 1000000000) / 1000);
+    print_text(record->room, record->room_length);
+    printf(" code %d from %d: ", record->code, record->originator_id);
+    print_text(record->content, record->content_length);
+    putchar('\n');
+};
+
+
+
+int main(int argc, char *argv[])
+{
+    bool csv = false;
+    int option;
+    while((option = getopt(argc, argv, "c")) != -1)
+    {
+        if(option != 'c')
+        {
+            fprintf(stderr, "Usage: %s [-c] segment...\n", argv[0]);
+            return 1;
+        }
+        csv = true;
+    }
+
+    if(optind == argc)
+    {
+        fprintf(stderr, "Usage: %s [-c] segment...\n", argv[0]);
+        return 1;
+    }
+
+    if(csv)
+        printf("time_ns,room,code,originator,content\n");
+
+    int status = 0;
+    for(int i = optind; i < argc; i++)
+    {
+        size_t records;
+        bool truncated;
+        if(!journal_read_segment(argv[i], &dump_record, &csv, &records, &truncated))
+        {
+            fprintf(stderr, "%s is not a journal segment\n", argv[i]);
+            status = 1;
+            continue;
+        }
+
+        if(truncated)
+        {
+            fprintf(stderr, "%s: stopped at a torn or corrupt record after %zu records\n", argv[i], records);
+            status = 1;
+        }
+    }
+
+    return status;
+};